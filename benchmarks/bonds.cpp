@@ -0,0 +1,51 @@
+#include <cmath>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+
+#include "bonds.hpp"
+#include "misc/timer.hpp"
+
+using namespace Graphics;
+
+// Times find_bonds on a box of water molecules at about liquid density.
+//
+// usage: bonds_benchmark [atoms]
+
+int main(int argc, char ** argv) {
+
+  size_t n = (argc > 1) ? std::stoull(argv[1]) : 3000000;
+  size_t molecules = n / 3;
+  size_t side = std::ceil(std::cbrt(double(molecules)));
+  float spacing = 3.1f;
+
+  std::mt19937 rng(5);
+  std::normal_distribution< float > jitter(0.0f, 0.1f);
+  std::vector< Sphere > atoms;
+  std::vector< uint32_t > atomic_numbers;
+  for (size_t i = 0; i < molecules; i++) {
+    glm::vec3 o = spacing * glm::vec3(i % side, (i / side) % side, i / (side * side));
+    o += glm::vec3(jitter(rng), jitter(rng), jitter(rng));
+    atoms.push_back(Sphere{o, 0.3f});
+    atoms.push_back(Sphere{o + glm::vec3(0.96f, 0.0f, 0.0f), 0.3f});
+    atoms.push_back(Sphere{o + glm::vec3(-0.24f, 0.93f, 0.0f), 0.3f});
+    atomic_numbers.insert(atomic_numbers.end(), {8, 1, 1});
+  }
+
+  // the first call also pays for starting the threads and faulting in the pages
+  for (int repeat = 0; repeat < 3; repeat++) {
+    timer stopwatch;
+    stopwatch.start();
+    std::vector< Bond > bonds = find_bonds(atoms, atomic_numbers);
+    stopwatch.stop();
+
+    if (bonds.size() != 2 * molecules) {
+      std::cout << "error: water box doesn't have 2 bonds per molecule" << std::endl;
+    }
+    std::cout << "find_bonds: " << atoms.size() << " atoms, " << bonds.size() << " bonds in "
+              << stopwatch.elapsed() << "s on " << std::thread::hardware_concurrency() << " hardware threads" << std::endl;
+  }
+
+}
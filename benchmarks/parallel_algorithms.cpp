@@ -0,0 +1,78 @@
+#include <random>
+#include <vector>
+#include <thread>
+#include <string>
+#include <numeric>
+#include <iostream>
+#include <algorithm>
+
+#include "misc/timer.hpp"
+#include "misc/parallel_for.hpp"
+
+// Times the threadpool's algorithms against their serial std:: equivalents.
+//
+// usage: parallel_algorithms_benchmark [n] [threads]
+
+// best of a few runs, in seconds
+template < typename setup_lambda, typename lambda >
+double best_time(const setup_lambda & setup, const lambda & f) {
+  double best = 1.0e30;
+  for (int repeat = 0; repeat < 5; repeat++) {
+    setup();
+    timer stopwatch;
+    stopwatch.start();
+    f();
+    stopwatch.stop();
+    best = std::min(best, stopwatch.elapsed());
+  }
+  return best;
+}
+
+void report(const std::string & name, double serial, double parallel) {
+  std::cout << name << ": std " << serial * 1000.0 << " ms, threadpool " << parallel * 1000.0
+            << " ms, speedup " << serial / parallel << std::endl;
+}
+
+int main(int argc, char ** argv) {
+
+  uint64_t n = (argc > 1) ? std::stoull(argv[1]) : 10000000;
+  int threads = (argc > 2) ? std::stoi(argv[2]) : int(std::thread::hardware_concurrency());
+
+  threadpool pool(threads);
+  std::cout << n << " elements, " << pool.num_threads << " threads" << std::endl;
+
+  std::mt19937 rng(3);
+  std::vector< float > x(n);
+  for (auto & value : x) value = std::uniform_real_distribution< float >(-1.0f, 1.0f)(rng);
+
+  std::vector< float > y;
+  auto nothing = []() {};
+  auto copy_x = [&]() { y = x; };
+  auto plus = [](float a, float b) { return a + b; };
+  auto positive = [](float value) { return value > 0.0f; };
+
+  // keep the results alive, so the loops aren't optimized away
+  volatile float sink = 0.0f;
+
+  report("reduce",
+    best_time(nothing, [&]() { sink = std::accumulate(x.begin(), x.end(), 0.0f); }),
+    best_time(nothing, [&]() { sink = pool.parallel_reduce(n, 0.0f, [&](uint64_t i) { return x[i]; }, plus); }));
+
+  y.resize(n);
+  report("inclusive scan",
+    best_time(nothing, [&]() { std::inclusive_scan(x.begin(), x.end(), y.begin()); }),
+    best_time(nothing, [&]() { pool.parallel_inclusive_scan(x, y, 0.0f, plus); }));
+
+  report("copy_if",
+    best_time([&]() { y.clear(); }, [&]() { std::copy_if(x.begin(), x.end(), std::back_inserter(y), positive); }),
+    best_time(nothing, [&]() { pool.parallel_copy_if(x, y, positive); }));
+
+  report("stable partition",
+    best_time(copy_x, [&]() { std::stable_partition(y.begin(), y.end(), positive); }),
+    best_time(copy_x, [&]() { pool.parallel_partition(y, positive); }));
+
+  report("stable sort",
+    best_time(copy_x, [&]() { std::stable_sort(y.begin(), y.end()); }),
+    best_time(copy_x, [&]() { pool.parallel_sort(y); }));
+
+}
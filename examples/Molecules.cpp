@@ -1,4 +1,5 @@
 #include <array>
+#include <algorithm>
 #include <vector>
 #include <random>
 #include <iostream>
@@ -10,6 +11,11 @@
 
 #include "spheres.hpp"
 #include "cylinders.hpp"
+#include "bonds.hpp"
+#include "structure_files.hpp"
+#include "trajectory.hpp"
+#include "culling.hpp"
+#include "picking.hpp"
 
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
@@ -22,11 +28,15 @@
 #include "imgui_impl_opengl3.h"
 
 #include "misc/json.hpp"
+#include "misc/mapped_file.hpp"
 
-#include <fstream>
+#include <memory>
+#include <cstdlib>
+#include <filesystem>
 #include <unordered_map>
 
 using namespace colors;
+using namespace Graphics;
 
 static const std::unordered_map< uint32_t, rgbcolor > color_from_atomic_number = {
   { 1, white},      // hydrogen
@@ -38,67 +48,312 @@ static const std::unordered_map< uint32_t, rgbcolor > color_from_atomic_number =
   {30, purple}      // zinc
 };
 
+// Fills the atom and bond arrays straight from the parser's events, instead
+// of building a DOM first (which costs tens of bytes per number).
+struct MoleculeSAX {
+
+  using json = nlohmann::json;
+
+  MoleculeSAX(float r) : radius(r), depth(0), section(NONE), field(OTHER), component(0), vector(0) {}
+
+  bool number(double x) {
+    if (section == ATOMS && depth == 3 && field == ATOMIC_NUMBER) {
+      atomic_number = x;
+    }
+    if (section == ATOMS && depth == 4 && field == COORDINATES && component < 3) {
+      coordinates[component++] = x;
+    }
+    if (section == LATTICE && depth == 3 && vector < 3 && component < 3) {
+      structure.cell[vector][component++] = x;
+    }
+    if (section == BONDS && depth == 3 && component < 2) {
+      bond.atoms[component++] = x;
+    } else if (section == BONDS && depth == 3 && component == 2) {
+      bond.order = x;
+      component++;
+    }
+    return true;
+  }
+
+  bool null() { return true; }
+  bool boolean(bool) { return true; }
+  bool number_integer(json::number_integer_t x) { return number(x); }
+  bool number_unsigned(json::number_unsigned_t x) { return number(x); }
+  bool number_float(json::number_float_t x, const json::string_t &) { return number(x); }
+  bool string(json::string_t &) { return true; }
+  bool binary(json::binary_t &) { return true; }
+
+  bool start_object(size_t) {
+    depth++;
+    if (section == ATOMS && depth == 3) {
+      atomic_number = 0;
+      coordinates = glm::vec3(0.0f);
+    }
+    return true;
+  }
+
+  bool end_object() {
+    if (section == ATOMS && depth == 3) {
+      structure.atoms.push_back(Sphere{coordinates, radius});
+      structure.atomic_numbers.push_back(atomic_number);
+    }
+    depth--;
+    return true;
+  }
+
+  bool start_array(size_t) {
+    depth++;
+    component = 0;
+    if (section == BONDS && depth == 3) bond = Bond{{0, 0}, 1};
+    return true;
+  }
+
+  bool end_array() {
+    if (section == BONDS && depth == 3) structure.bonds.push_back(bond);
+    if (section == LATTICE && depth == 3) vector++;
+    depth--;
+    return true;
+  }
+
+  bool key(json::string_t & k) {
+    if (depth == 1) {
+      section = (k == "atoms") ? ATOMS : (k == "bonds") ? BONDS : (k == "lattice") ? LATTICE : NONE;
+    }
+    if (depth == 3) {
+      field = (k == "atomic_number") ? ATOMIC_NUMBER : (k == "coordinates") ? COORDINATES : OTHER;
+    }
+    return true;
+  }
+
+  bool parse_error(size_t position, const std::string &, const nlohmann::detail::exception & e) {
+    std::cout << "parse error at byte " << position << ": " << e.what() << std::endl;
+    return false;
+  }
+
+  float radius;
+
+  int depth;
+  enum { NONE, ATOMS, BONDS, LATTICE } section;
+  enum { OTHER, ATOMIC_NUMBER, COORDINATES } field;
+  int component;
+  int vector;
+
+  uint32_t atomic_number;
+  glm::vec3 coordinates;
+  Bond bond;
+
+  Structure structure;
+
+};
+
 struct Molecule {
 
-  static Molecule import_from_json(std::string filename) {
+  // Reads {"atoms": [{"atomic_number": 8, "coordinates": [x, y, z]}, ...],
+  //        "bonds": [[first atom, second atom, bond order], ...],
+  //        "lattice": [[ax, ay, az], [bx, by, bz], [cx, cy, cz]]}, where the lattice is optional
+  // from json, or from the same schema in CBOR (.cbor) or MessagePack (.msgpack).
+  static Structure read_json(std::string filename, float atom_radius) {
+    femto::mapped_file file(filename, femto::MapAccess::READ_ONLY, femto::MapAdvice::SEQUENTIAL);
+    if (!file) {
+      std::cout << "file: " << filename << " not found. exiting ... " << std::endl;
+      exit(1);
+    }
+
+    auto format = nlohmann::json::input_format_t::json;
+    std::string extension = std::filesystem::path(filename).extension().string();
+    if (extension == ".cbor") format = nlohmann::json::input_format_t::cbor;
+    if (extension == ".msgpack") format = nlohmann::json::input_format_t::msgpack;
+
+    MoleculeSAX sax(atom_radius);
+    if (!nlohmann::json::sax_parse(file.data(), file.data() + file.size(), &sax, format)) {
+      std::cout << "file: " << filename << " could not be parsed. exiting ... " << std::endl;
+      exit(1);
+    }
+    return std::move(sax.structure);
+  }
+
+  // json (or CBOR / MessagePack), PDB (.pdb, .ent), mmCIF (.cif) or XYZ (.xyz) files
+  static Molecule import(std::string filename) {
 
     float atom_radius = 0.3; 
     float bond_radius = 0.1; 
 
-    // read the contents of the entire file into str
-    std::ifstream infile(filename);
-    std::string str;
-    if (infile) {
-      infile.seekg(0, std::ios::end);   
-      str.reserve(infile.tellg());
-      infile.seekg(0, std::ios::beg);
-      str.assign((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
+    Structure structure;
+    std::string extension = std::filesystem::path(filename).extension().string();
+    if (extension == ".pdb" || extension == ".ent") {
+      structure = read_pdb(filename, atom_radius);
+    } else if (extension == ".cif" || extension == ".mmcif") {
+      structure = read_mmcif(filename, atom_radius);
+    } else if (extension == ".xyz") {
+      structure = read_xyz(filename, atom_radius);
     } else {
-      std::cout << "file: " << filename << " not found. exiting ... " << std::endl;
-      exit(1);
+      structure = read_json(filename, atom_radius);
     }
 
-    auto j = nlohmann::json::parse(str);
+    if (structure.atoms.empty()) {
+      std::cout << "file: " << filename << " has no atoms. exiting ... " << std::endl;
+      exit(1);
+    }
 
+    std::vector < Sphere > & atoms = structure.atoms;
+    std::vector < rgbcolor > atom_colors(atoms.size());
     glm::vec3 offset{};
-
-    std::vector < Sphere > atoms;
-    std::vector < rgbcolor > atom_colors;
-    for (auto & atom : j["atoms"]) {
-      atoms.push_back(Sphere{
-        {atom["coordinates"][0], atom["coordinates"][1], atom["coordinates"][2]}, 
-        atom_radius
-      });
-      atom_colors.push_back(color_from_atomic_number.at(atom["atomic_number"].get<uint32_t>()));
-
-      offset += atoms.back().center;
+    for (size_t i = 0; i < atoms.size(); i++) {
+      auto color = color_from_atomic_number.find(structure.atomic_numbers[i]);
+      atom_colors[i] = (color != color_from_atomic_number.end()) ? color->second : off_white;
+      offset += atoms[i].center;
     }
 
     offset /= atoms.size();
     for (auto & atom : atoms) { atom.center -= offset; }
 
-    std::vector < Cylinder > bonds;
-    std::vector < rgbcolor > bond_colors;
-    for (auto & bond : j["bonds"]) {
-      Sphere start = atoms[bond[0]];
-      Sphere mid = {(atoms[bond[0]].center + atoms[bond[1]].center) * 0.5f, bond_radius};
-      Sphere end = atoms[bond[1]];
+    // structures with only coordinates (e.g. from XYZ files or MD frames) get their bonds inferred
+    if (structure.bonds.empty()) structure.bonds = find_bonds(atoms, structure.atomic_numbers);
 
-      start.radius = mid.radius = end.radius = bond_radius * ((bond[2] == 2) ? 1.7 : 1.0);
+    Molecule m;
+    if (structure.cell[0] != glm::vec3(0.0f)) m.cell.assign(structure.cell, structure.cell + 3);
+    m.offset = offset;
+    m.bonds = std::move(structure.bonds);
+    m.bonds.erase(std::remove_if(m.bonds.begin(), m.bonds.end(), [&](const Bond & bond) {
+      return bond.atoms[0] >= atoms.size() || bond.atoms[1] >= atoms.size();
+    }), m.bonds.end());
+    m.spheres.append(atoms, atom_colors);
+    append_bonds(m.cylinders, atoms, atom_colors, m.bonds, bond_radius);
+    return m;
+  }
+
+  // Move the atoms (and the bonds between them) to the positions in one frame of a trajectory.
+  // Only the atom centers are sent to the GPU, and the bonds are streamed as dynamic cylinders.
+  // The frame is also kept in frame_atoms and frame_bonds, for picking.
+  bool set_frame(const std::vector< Sphere > & atoms) {
+    if (atoms.size() != spheres.size()) {
+      std::cout << "error: frame has " << atoms.size() << " atoms, expected " << spheres.size() << std::endl;
+      return false;
+    }
 
-      bonds.push_back(Cylinder{start, mid});
-      bond_colors.push_back(atom_colors[bond[0]]);
+    auto & pool = worker_threads();
+
+    const std::vector< Sphere > & initial_atoms = spheres.primitives();
+    frame_atoms.resize(atoms.size());
+    glm::vec3 * positions = spheres.map_positions();
+    pool.parallel_for_range(atoms.size(), primitive_grain, [&](uint64_t begin, uint64_t end) {
+      for (uint32_t i = begin; i < end; i++) {
+        positions[i] = atoms[i].center - offset;
+        frame_atoms[i] = Sphere{positions[i], initial_atoms[i].radius};
+      }
+    });
+
+    if (cylinders.size() != 2 * bonds.size()) {
+      frame_bonds.clear();
+      return true;
+    }
 
-      bonds.push_back(Cylinder{mid, end});
-      bond_colors.push_back(atom_colors[bond[1]]);
-   }
+    cylinders.set_dynamic(true);
+    frame_bonds.resize(cylinders.size());
+    Cylinder * halves = cylinders.map_cylinders();
+    const std::vector< Cylinder > & initial = cylinders.primitives();
+    pool.parallel_for_range(bonds.size(), primitive_grain, [&](uint64_t begin, uint64_t end) {
+      for (uint32_t i = begin; i < end; i++) {
+        glm::vec3 p = atoms[bonds[i].atoms[0]].center - offset;
+        glm::vec3 q = atoms[bonds[i].atoms[1]].center - offset;
+        glm::vec3 mid = (p + q) * 0.5f;
+        float r = initial[2 * i].endpoints[0].radius;
+        frame_bonds[2 * i + 0] = halves[2 * i + 0] = Cylinder{Sphere{p, r}, Sphere{mid, r}};
+        frame_bonds[2 * i + 1] = halves[2 * i + 1] = Cylinder{Sphere{mid, r}, Sphere{q, r}};
+      }
+    });
+    return true;
+  }
 
-    Molecule m;
-    m.spheres.append(atoms, atom_colors);
-    m.cylinders.append(bonds, bond_colors);
+  // Go back to drawing the atoms and bonds as they were imported, from their static buffers.
+  void clear_frame() {
+    spheres.clear_positions();
+    cylinders.set_dynamic(false);
+    frame_atoms.clear();
+    frame_bonds.clear();
+  }
+
+  // bump when import() makes something different of the same file, to invalidate the cached scenes
+  static constexpr uint32_t import_version = 1;
+
+  // The first time a molecule is loaded, it is also saved as a binary scene file in a cache
+  // directory, which is much faster to reopen than reparsing it. The cached scene is only used
+  // while the file's size and modification time, and import_version, match the ones it records.
+  static Molecule load(std::string filename) {
+    std::error_code size_error, time_error;
+    uint64_t size = std::filesystem::file_size(filename, size_error);
+    auto modified = std::filesystem::last_write_time(filename, time_error);
+    std::filesystem::path cached = cache_path(filename, ".scene");
+    if (size_error || time_error || cached.empty()) return import(filename);
+
+    SceneSource source{size, int64_t(modified.time_since_epoch().count()), import_version, 0};
+
+    if (std::filesystem::exists(cached)) {
+      SceneFile scene(cached.string());
+      auto recorded = scene.section< SceneSource >(SectionType::SOURCE_FILE);
+      if (scene && recorded.size() == 1 && *recorded.begin() == source) {
+        Molecule m;
+        m.spheres.load(scene);
+        m.cylinders.load(scene);
+        m.cell = scene.read< glm::vec3 >(SectionType::UNIT_CELL);
+        return m;
+      }
+    }
+
+    Molecule m = import(filename);
+    SceneWriter scene(cached.string());
+    scene.add(SectionType::SOURCE_FILE, std::vector< SceneSource >{source});
+    m.spheres.save(scene);
+    m.cylinders.save(scene);
+    if (!m.cell.empty()) scene.add(SectionType::UNIT_CELL, m.cell);
     return m;
   }
 
+  // Draw n x n x n randomly oriented copies of the molecule on a grid, like a solvent box.
+  // The atoms and bonds are only stored once, and each copy costs 32 bytes.
+  void set_copies(uint32_t n) {
+    placements.clear();
+    if (n > 1) {
+      float extent = 0.0f;
+      for (auto & atom : spheres.primitives()) {
+        extent = std::max(extent, glm::length(atom.center) + atom.radius);
+      }
+      float spacing = 2.0f * extent + 1.0f;
+      glm::vec3 corner = -0.5f * spacing * float(n - 1) * glm::vec3(1.0f);
+
+      std::mt19937 generator(0);
+      std::normal_distribution< float > distribution;
+      for (uint32_t k = 0; k < n; k++) {
+        for (uint32_t j = 0; j < n; j++) {
+          for (uint32_t i = 0; i < n; i++) {
+            glm::quat q(distribution(generator), distribution(generator), distribution(generator), distribution(generator));
+            placements.push_back(make_placement(glm::normalize(q), corner + spacing * glm::vec3(i, j, k)));
+          }
+        }
+      }
+    }
+    spheres.set_placements(placements);
+    cylinders.set_placements(placements);
+  }
+
+  // Draw n x n x n unit cells of a crystal, whose images of the atoms and bonds of one cell are
+  // made up in the vertex shaders. Structures without a unit cell are tiled by their bounding box.
+  void set_cells(uint32_t n) {
+    lattice = Lattice{{glm::vec3(0.0f), glm::vec3(0.0f), glm::vec3(0.0f)}, glm::uvec3((n > 1) ? n : 0)};
+    if (cell.size() == 3) {
+      std::copy(cell.begin(), cell.end(), lattice.basis);
+    } else {
+      glm::vec3 lo(1.0e30f), hi(-1.0e30f);
+      for (auto & atom : spheres.primitives()) {
+        lo = glm::min(lo, atom.center - atom.radius);
+        hi = glm::max(hi, atom.center + atom.radius);
+      }
+      for (int i = 0; i < 3; i++) lattice.basis[i][i] = hi[i] - lo[i];
+    }
+    spheres.set_lattice(lattice);
+    cylinders.set_lattice(lattice);
+  }
+
   void draw(const Camera & camera) {
     spheres.draw(camera);
     cylinders.draw(camera);
@@ -106,12 +361,29 @@ struct Molecule {
 
   Spheres spheres;
   Cylinders cylinders;
+
+  // the unit cell's basis vectors, if the file had one
+  std::vector< glm::vec3 > cell;
+
+  // where set_copies() put the copies, or empty, and the cells set_cells() tiled
+  std::vector< Placement > placements;
+  Lattice lattice{};
+
+  // what import() did to the atoms, for set_frame() to do the same
+  glm::vec3 offset;
+  std::vector< Bond > bonds;
+
+  // the atoms and bond halves of the last frame given to set_frame(), or empty
+  std::vector< Sphere > frame_atoms;
+  std::vector< Cylinder > frame_bonds;
 };
 
 class Molecules : public Application {
  public:
-  Molecules() : Application("Molecules") {
-    m = Molecule::import_from_json(GRAPHICS_DATA_DIR"citric_acid.json"); 
+  Molecules(std::string filename) : Application("Molecules"), impostors(false), culling(false), playing(false), copies(1), cells(1) {
+
+    picker = Picker(&m.spheres, &m.cylinders);
+    open(filename);
 
     fov = 1.0;
     camera_speed = 0.02;
@@ -123,6 +395,14 @@ class Molecules : public Application {
   }
 
  protected:
+  virtual void mouse_click_callback(GLFWwindow* window, double xpos, double ypos) {
+    glm::ivec2 window_size;
+    glfwGetWindowSize(window, &window_size.x, &window_size.y);
+    if (picker_moved) picker.refit();
+    picker_moved = false;
+    picked = picker.pick(pick_ray(camera, window_size, xpos, ypos));
+  }
+
   virtual void loop() {
 
     // exit on window close button pressed
@@ -140,6 +420,22 @@ class Molecules : public Application {
     ImGui_ImplGlfw_NewFrame();
     ImGui::NewFrame();
 
+    m.spheres.set_render_mode(impostors ? RenderMode::IMPOSTOR : RenderMode::MESH);
+    m.cylinders.set_render_mode(impostors ? RenderMode::IMPOSTOR : RenderMode::MESH);
+    m.spheres.set_frustum_culling(culling);
+    m.cylinders.set_frustum_culling(culling);
+
+    // the next frame was decoded in the background while the last one was drawn, and
+    // the GPU keeps drawing the last frame it was sent while paused
+    if (trajectory) {
+      if (playing) trajectory->advance();
+      if (int64_t(trajectory->frame()) != shown_frame) {
+        playing &= m.set_frame(trajectory->atoms());
+        shown_frame = trajectory->frame();
+        pick_frame();
+      }
+    }
+
     m.draw(camera);
 
     // render your GUI
@@ -149,6 +445,21 @@ class Molecules : public Application {
       camera.perspective(fov, getWindowRatio(), 0.01f, 100.0f);
     }
 
+    ImGui::Checkbox("impostors", &impostors);
+    ImGui::Checkbox("frustum culling", &culling);
+    ImGui::Text("culled: %d / %d atoms, %d / %d bonds",
+                int(m.spheres.culled()), int(m.spheres.size()),
+                int(m.cylinders.culled()), int(m.cylinders.size()));
+
+    // each bond is drawn as two cylinders
+    if (picked.type == Pick::SPHERE) ImGui::Text("picked: atom %d", int(picked.index));
+    if (picked.type == Pick::CYLINDER) ImGui::Text("picked: bond %d", int(picked.index / 2));
+    if (picked.type != Pick::NONE && m.lattice.num_cells() > 0) {
+      ImGui::Text("in cell (%d, %d, %d)", int(picked.cell.x), int(picked.cell.y), int(picked.cell.z));
+    } else if (picked.type != Pick::NONE && !m.placements.empty()) {
+      ImGui::Text("of copy %d", int(picked.placement));
+    }
+
     static float light_intensity = 0.0f;
     if (ImGui::DragFloat("light intensity", &light_intensity, 0.01f, 0.0f, 1.0f)) {
       glm::vec3 direction(0.721995, 0.618853, 0.309426);
@@ -156,16 +467,37 @@ class Molecules : public Application {
       m.cylinders.set_light(direction, light_intensity);
     }
 
+    if (ImGui::SliderInt("copies per side", &copies, 1, 50)) {
+      m.set_copies(copies);
+      picker.set_placements(m.placements);
+      picked.type = Pick::NONE;
+    }
+
+    if (ImGui::SliderInt("unit cells per side", &cells, 1, 50)) {
+      m.set_cells(cells);
+      picker.set_lattice(m.lattice);
+      picked.type = Pick::NONE;
+    }
+    if (cells > 1 && m.cell.empty()) ImGui::Text("no unit cell in the file, so its bounding box is tiled");
+
+    if (trajectory) {
+      int frame = trajectory->frame();
+      ImGui::Checkbox("play", &playing);
+      if (ImGui::SliderInt("frame", &frame, 0, trajectory->num_frames() - 1)) {
+        trajectory->seek(frame);
+      }
+    }
+
     static int which = 0;
 
     if (ImGui::RadioButton("citric acid", &which, 0)) {
-      m = Molecule::import_from_json(GRAPHICS_DATA_DIR"citric_acid.json"); 
+      open(GRAPHICS_DATA_DIR"citric_acid.json");
     }
     if (ImGui::RadioButton("guanine", &which, 1)) {
-      m = Molecule::import_from_json(GRAPHICS_DATA_DIR"guanine.json"); 
+      open(GRAPHICS_DATA_DIR"guanine.json");
     }
     if (ImGui::RadioButton("CUVNAK", &which, 2)) {
-      m = Molecule::import_from_json(GRAPHICS_DATA_DIR"CUVNAK.json"); 
+      open(GRAPHICS_DATA_DIR"CUVNAK.json");
     }
 
     ImGui::End();
@@ -177,13 +509,65 @@ class Molecules : public Application {
   }
 
  private:
+  // Multi-frame XYZ files are played back, starting from the bonds of their first frame, and
+  // anything else is drawn as it is, with static atoms and bonds.
+  void open(const std::string & filename) {
+    trajectory.reset();
+    shown_frame = -1;
+    playing = false;
+
+    if (std::filesystem::path(filename).extension() == ".xyz") {
+      trajectory = std::make_unique< Trajectory >(filename);
+      if (*trajectory && trajectory->num_frames() > 1) {
+        m = Molecule::import(filename);
+        playing = true;
+      } else {
+        trajectory.reset();
+      }
+    }
+
+    if (!trajectory) {
+      m = Molecule::load(filename);
+      m.clear_frame();
+    }
+
+    m.set_copies(copies);
+    m.set_cells(cells);
+    picker.set_placements(m.placements);
+    picker.set_lattice(m.lattice);
+    picker.sphere_positions = nullptr;
+    picker.cylinder_positions = nullptr;
+    picker.build();
+    picker_moved = false;
+    picked.type = Pick::NONE;
+  }
+
+  // Pick the atoms and bonds where the last frame put them. The BVHs built from the first frame
+  // are only refit on the next click, rather than for every frame played.
+  void pick_frame() {
+    picker.sphere_positions = m.frame_atoms.empty() ? nullptr : &m.frame_atoms;
+    picker.cylinder_positions = m.frame_bonds.empty() ? nullptr : &m.frame_bonds;
+    picker_moved = true;
+  }
+
   float fov;
+  bool impostors;
+  bool culling;
+  bool playing;
+  int copies;
+  int cells;
 
   Molecule m;
+  std::unique_ptr< Trajectory > trajectory;
+  int64_t shown_frame;  // the trajectory frame last sent to m, or -1
+  Picker picker;
+  bool picker_moved;  // whether a frame moved the atoms since the picker was last fit to them
+  Pick picked;
 };
 
+// optionally, pass a .json, .cbor, .msgpack, .pdb, .cif or .xyz file to open
 int main(int argc, const char* argv[]) {
-  Molecules app;
+  Molecules app((argc > 1) ? argv[1] : GRAPHICS_DATA_DIR"citric_acid.json");
   app.run();
   return 0;
 }
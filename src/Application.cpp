@@ -10,6 +10,7 @@
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <cmath>
 #include <iostream>
 #include <stdexcept>
 
@@ -287,6 +288,8 @@ void Application::mouse_button_callback(GLFWwindow* window,
   if (button == GLFW_MOUSE_BUTTON_1 && action == GLFW_PRESS) {
     lmb_down = true;
     glfwGetCursorPos(window, &mouse_x, &mouse_y);
+    press_x = mouse_x;
+    press_y = mouse_y;
   }
 
   if (button == GLFW_MOUSE_BUTTON_2 && action == GLFW_PRESS) {
@@ -296,12 +299,23 @@ void Application::mouse_button_callback(GLFWwindow* window,
 
   if (button == GLFW_MOUSE_BUTTON_1 && action == GLFW_RELEASE) {
     lmb_down = false;
+
+    double xpos, ypos;
+    glfwGetCursorPos(window, &xpos, &ypos);
+    bool dragged = std::abs(xpos - press_x) > 2.0 || std::abs(ypos - press_y) > 2.0;
+    if (!dragged && !ImGui::GetIO().WantCaptureMouse) {
+      mouse_click_callback(window, xpos, ypos);
+    }
   }
   if (button == GLFW_MOUSE_BUTTON_2 && action == GLFW_RELEASE) {
     rmb_down = false;
   }
 }
 
+void Application::mouse_click_callback(GLFWwindow* window,
+                                   double xpos,
+                                   double ypos) {}
+
 void Application::update_camera_position() {
   // clang-format off
   float scale = 1.0f;
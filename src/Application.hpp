@@ -34,6 +34,10 @@ class Application {
   virtual void mouse_button_callback(GLFWwindow* window, int button, int action, int mods);
   virtual void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
 
+  // called when the left button is released without having dragged the camera,
+  // e.g. to pick primitives with Graphics::pick_ray(camera, window size, xpos, ypos)
+  virtual void mouse_click_callback(GLFWwindow* window, double xpos, double ypos);
+
   static Application& getInstance();
 
   // get the window id
@@ -85,6 +89,10 @@ class Application {
   bool mmb_down = false;
   bool rmb_down = false;
 
+  // cursor position when the left button was pressed
+  double press_x = 0.0;
+  double press_y = 0.0;
+
   Application(const Application&) {};
 
   virtual void loop();
@@ -116,6 +116,10 @@ void Camera::set_far_plane(float far){
   m_far = far;
 }
 
+bool Camera::is_perspective() const {
+  return m_projection_type == ProjectionType::PERSPECTIVE;
+}
+
 void Camera::lookAt(const glm::vec3 & next_pos, const glm::vec3 & next_focus, const glm::vec3 & next_up){
   m_pos = next_pos;
   m_focus = next_focus;
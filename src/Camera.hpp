@@ -28,6 +28,7 @@ class Camera {
     float aspect() const;
     float near() const;
     float far() const;
+    bool is_perspective() const;
 
     void set_fov(float fov);
     void set_aspect(float aspect);
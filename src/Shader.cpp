@@ -135,11 +135,18 @@ GLint ShaderProgram::uniform(const std::string& name) {
 }
 
 GLint ShaderProgram::attribute(const std::string& name) {
-  GLint attrib = glGetAttribLocation(handle, name.c_str());
-  if (attrib == GL_INVALID_OPERATION || attrib < 0)
-    cout << "[Error] Attribute " << name << " doesn't exist in program" << endl;
-
-  return attrib;
+  auto it = attributes.find(name);
+  if (it == attributes.end()) {
+    // attribute that is not referenced
+    GLint attrib = glGetAttribLocation(handle, name.c_str());
+    if (attrib == GL_INVALID_OPERATION || attrib < 0)
+      cout << "[Error] Attribute " << name << " doesn't exist in program" << endl;
+    // add it anyways, as uniform() does
+    attributes[name] = attrib;
+
+    return attrib;
+  } else
+    return it->second;
 }
 
 void ShaderProgram::setAttribute(const std::string& name,
@@ -204,6 +211,10 @@ void ShaderProgram::setUniform(const std::string& name, const dvec3& v) {
   glUniform3dv(uniform(name), 1, value_ptr(v));
 }
 
+void ShaderProgram::setUniform(const std::string& name, const ivec3& v) {
+  glUniform3iv(uniform(name), 1, value_ptr(v));
+}
+
 void ShaderProgram::setUniform(const std::string& name, const vec4& v) {
   glUniform4fv(uniform(name), 1, value_ptr(v));
 }
@@ -80,6 +80,7 @@ class ShaderProgram {
   void setUniform(const std::string& name, const glm::dvec2& v);
   void setUniform(const std::string& name, const glm::vec3& v);
   void setUniform(const std::string& name, const glm::dvec3& v);
+  void setUniform(const std::string& name, const glm::ivec3& v);
   void setUniform(const std::string& name, const glm::vec4& v);
   void setUniform(const std::string& name, const glm::dvec4& v);
   void setUniform(const std::string& name, const glm::dmat4& m);
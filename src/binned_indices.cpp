@@ -0,0 +1,71 @@
+#include "binned_indices.hpp"
+
+namespace Graphics {
+
+void BinnedIndices::sort(threadpool & pool, uint32_t num_bins) {
+  parallel_bin(pool, bins, num_bins, permutation, offsets);
+  slots.assign(bins.size(), none);
+  pool.parallel_for_range(permutation.size(), primitive_grain, [&](uint64_t begin, uint64_t end) {
+    for (uint32_t p = begin; p < end; p++) slots[permutation[p]] = p;
+  });
+  written.clear();
+}
+
+void BinnedIndices::place(uint32_t position, uint32_t i) {
+  permutation[position] = i;
+  slots[i] = position;
+  written.push_back(position);
+}
+
+// Taking an entry out of a bin leaves a hole, which is filled by the last entry of the bin,
+// which leaves a hole at the start of the next bin, and so on up to the end of the permutation.
+// Putting one in does the same in reverse, from a new hole at the end down to the bin's end.
+void BinnedIndices::set_bin(uint32_t i, uint8_t bin) {
+  if (bin == bins[i]) return;
+  uint32_t num_bins = offsets.size() - 1;
+
+  if (bins[i] != culled_bin) {
+    uint32_t hole = slots[i];
+    for (uint32_t b = bins[i]; b < num_bins; b++) {
+      uint32_t last = offsets[b + 1] - 1;
+      if (last != hole) place(hole, permutation[last]);
+      hole = last;
+      offsets[b + 1]--;
+    }
+    permutation.pop_back();
+    slots[i] = none;
+  }
+
+  if (bin != culled_bin) {
+    permutation.push_back(i);
+    uint32_t hole = permutation.size() - 1;
+    offsets[num_bins]++;
+    for (uint32_t b = num_bins - 1; b > bin; b--) {
+      uint32_t first = offsets[b];
+      if (first != hole) place(hole, permutation[first]);
+      hole = first;
+      offsets[b]++;
+    }
+    place(hole, i);
+  }
+
+  bins[i] = bin;
+}
+
+void BinnedIndices::swap_remove(uint32_t i) {
+  set_bin(i, culled_bin);
+  uint32_t last = bins.size() - 1;
+  if (i != last) {
+    bins[i] = bins[last];
+    if (slots[last] != none) place(slots[last], i);
+  }
+  bins.pop_back();
+  slots.pop_back();
+}
+
+void BinnedIndices::append(uint32_t count) {
+  bins.resize(bins.size() + count, culled_bin);
+  slots.resize(slots.size() + count, none);
+}
+
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include "worker_threads.hpp"
+
+namespace Graphics {
+
+// bin value for primitives that should not be drawn at all
+static constexpr uint8_t culled_bin = 0xFF;
+
+// Stable, parallel counting sort of the indices {0, 1, ..., n-1} by bin_of(i) < num_bins,
+// omitting the indices where bin_of(i) == culled_bin. On return, bin b of the sorted indices
+// is permutation[offsets[b]] ... permutation[offsets[b+1]-1]
+template < typename lambda >
+void parallel_bin(threadpool & pool, uint32_t n, uint32_t num_bins, const lambda & bin_of,
+                  std::vector< uint32_t > & permutation, std::vector< uint32_t > & offsets) {
+
+  uint32_t blocks = (n + primitive_grain - 1) / primitive_grain;
+
+  std::vector< uint8_t > bins(n);
+  std::vector< uint32_t > counts(blocks * num_bins, 0);
+
+  pool.parallel_for_range(n, primitive_grain, [&](uint64_t begin, uint64_t end) {
+    uint32_t * block_counts = &counts[(begin / primitive_grain) * num_bins];
+    for (uint32_t i = begin; i < end; i++) {
+      bins[i] = bin_of(i);
+      if (bins[i] != culled_bin) block_counts[bins[i]]++;
+    }
+  });
+
+  // exclusive scan over (bin, block) pairs, so that every bin is contiguous
+  // and blocks keep their relative order within a bin
+  offsets.resize(num_bins + 1);
+  uint32_t total = 0;
+  for (uint32_t bin = 0; bin < num_bins; bin++) {
+    offsets[bin] = total;
+    for (uint32_t b = 0; b < blocks; b++) {
+      uint32_t count = counts[b * num_bins + bin];
+      counts[b * num_bins + bin] = total;
+      total += count;
+    }
+  }
+  offsets[num_bins] = total;
+
+  permutation.resize(total);
+  pool.parallel_for_range(n, primitive_grain, [&](uint64_t begin, uint64_t end) {
+    uint32_t * next = &counts[(begin / primitive_grain) * num_bins];
+    for (uint32_t i = begin; i < end; i++) {
+      if (bins[i] != culled_bin) permutation[next[bins[i]]++] = i;
+    }
+  });
+
+}
+
+// the same, for bins that are already known
+inline void parallel_bin(threadpool & pool, const std::vector< uint8_t > & bins, uint32_t num_bins,
+                         std::vector< uint32_t > & permutation, std::vector< uint32_t > & offsets) {
+  parallel_bin(pool, bins.size(), num_bins, [&](uint32_t i) { return bins[i]; }, permutation, offsets);
+}
+
+// The indices of some primitives sorted into bins, as by parallel_bin(), together with each
+// index's bin and its position in the permutation. After sort(), a single primitive can change
+// bins, be removed or be appended by moving at most one entry per bin, instead of binning all of
+// them again, though the order within a bin is then no longer that of the indices. The positions
+// of the permutation that were rewritten since sort() are listed in `written`, so only those
+// need to be sent to the GPU again.
+struct BinnedIndices {
+
+  static constexpr uint32_t none = 0xFFFFFFFF;
+
+  // bin every index by bins[i], from scratch
+  void sort(threadpool & pool, uint32_t num_bins);
+
+  // move index i into another bin, or out of all of them, with culled_bin
+  void set_bin(uint32_t i, uint8_t bin);
+
+  // remove index i, and rename the last index to i, as swap_remove() does to the primitives
+  void swap_remove(uint32_t i);
+
+  // add `count` indices at the end, in no bin until set_bin()
+  void append(uint32_t count);
+
+  std::vector< uint8_t > bins;         // the bin of each index
+  std::vector< uint32_t > permutation; // bin b is permutation[offsets[b]] ... permutation[offsets[b+1]-1]
+  std::vector< uint32_t > offsets;
+  std::vector< uint32_t > slots;       // the position of each index in permutation, or none
+  std::vector< uint32_t > written;
+
+ private:
+  void place(uint32_t position, uint32_t i);
+
+};
+
+// output[i] = input[permutation[i]]
+template < typename T >
+void parallel_gather(threadpool & pool, const std::vector< uint32_t > & permutation,
+                     const std::vector< T > & input, std::vector< T > & output) {
+  output.resize(permutation.size());
+  pool.parallel_for_range(permutation.size(), primitive_grain, [&](uint64_t begin, uint64_t end) {
+    for (uint32_t i = begin; i < end; i++) {
+      output[i] = input[permutation[i]];
+    }
+  });
+}
+
+}
@@ -0,0 +1,230 @@
+#include "bonds.hpp"
+
+#include <cmath>
+#include <atomic>
+#include <iostream>
+#include <algorithm>
+
+#include "worker_threads.hpp"
+
+namespace Graphics {
+
+float covalent_radius(uint32_t atomic_number) {
+  static constexpr float radii[] = {
+    0.00f,                                                                                  //
+    0.31f, 0.28f,                                                                           // H - He
+    1.28f, 0.96f, 0.84f, 0.76f, 0.71f, 0.66f, 0.57f, 0.58f,                                 // Li - Ne
+    1.66f, 1.41f, 1.21f, 1.11f, 1.07f, 1.05f, 1.02f, 1.06f,                                 // Na - Ar
+    2.03f, 1.76f, 1.70f, 1.60f, 1.53f, 1.39f, 1.39f, 1.32f, 1.26f, 1.24f, 1.32f, 1.22f,     // K - Zn
+    1.22f, 1.20f, 1.19f, 1.20f, 1.20f, 1.16f,                                               // Ga - Kr
+    2.20f, 1.95f, 1.90f, 1.75f, 1.64f, 1.54f, 1.47f, 1.46f, 1.42f, 1.39f, 1.45f, 1.44f,     // Rb - Cd
+    1.42f, 1.39f, 1.39f, 1.38f, 1.39f, 1.40f,                                               // In - Xe
+    2.44f, 2.15f, 2.07f, 2.04f, 2.03f, 2.01f, 1.99f, 1.98f, 1.98f, 1.96f, 1.94f, 1.92f,     // Cs - Dy
+    1.92f, 1.89f, 1.90f, 1.87f, 1.87f, 1.75f, 1.70f, 1.62f, 1.51f, 1.44f, 1.41f, 1.36f,     // Ho - Pt
+    1.36f, 1.32f, 1.45f, 1.46f, 1.48f, 1.40f, 1.50f, 1.50f,                                 // Au - Rn
+    2.60f, 2.21f, 2.15f, 2.06f, 2.00f, 1.96f, 1.90f, 1.87f, 1.80f, 1.69f                    // Fr - Cm
+  };
+  return (atomic_number < sizeof(radii) / sizeof(float)) ? radii[atomic_number] : 0.0f;
+}
+
+// pairs of atoms closer than this are overlapping copies (e.g. alternate locations), not bonds
+static constexpr float min_bond_length = 0.4f;
+
+// cells per block of the neighbor search, which is fixed so that
+// the order of the bonds doesn't depend on the number of threads
+static constexpr uint32_t cells_per_block = 4096;
+
+std::vector< Bond > find_bonds(const std::vector< Sphere > & atoms,
+                               const std::vector< uint32_t > & atomic_numbers,
+                               float tolerance) {
+
+  uint32_t n = atoms.size();
+  if (atomic_numbers.size() != n) {
+    std::cout << "error: find_bonds() needs one atomic number per atom" << std::endl;
+    return {};
+  }
+  if (n < 2) return {};
+
+  threadpool & pool = worker_threads();
+
+  // glm::min and glm::max drop NaNs, so they're counted separately
+  struct Box { glm::vec3 min, max; uint32_t not_finite; };
+  Box box = pool.parallel_reduce(n, Box{glm::vec3(INFINITY), glm::vec3(-INFINITY), 0},
+    [&](uint64_t i) {
+      glm::vec3 p = atoms[i].center;
+      return Box{p, p, uint32_t(!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z))};
+    },
+    [](const Box & a, const Box & b) {
+      return Box{glm::min(a.min, b.min), glm::max(a.max, b.max), a.not_finite + b.not_finite};
+    });
+
+  float max_radius = pool.parallel_reduce(n, 0.0f,
+    [&](uint64_t i) { return covalent_radius(atomic_numbers[i]); },
+    [](float a, float b) { return std::max(a, b); });
+  if (max_radius == 0.0f) return {};
+
+  // cells at least as wide as the longest possible bond, but no more than
+  // about two per atom, so that sparse structures don't need a huge grid
+  float cell_size = 2.0f * max_radius + tolerance;
+  glm::vec3 extent = box.max - box.min;
+  if (box.not_finite > 0 || !std::isfinite(extent.x) || !std::isfinite(extent.y) || !std::isfinite(extent.z)) {
+    std::cout << "error: find_bonds() needs finite atom positions" << std::endl;
+    return {};
+  }
+  uint32_t dims[3];
+  while (true) {
+    double num_cells = 1.0;
+    for (int a = 0; a < 3; a++) {
+      double cells = std::floor(extent[a] / cell_size) + 1.0;
+      dims[a] = uint32_t(std::min(cells, 1.0e9));
+      num_cells *= cells;
+    }
+    if (num_cells <= 2.0 * n + 64) break;
+    cell_size *= 1.25f;
+  }
+  uint32_t num_cells = dims[0] * dims[1] * dims[2];
+
+  auto cell_coordinate = [&](float x, float lo, int a) {
+    return std::min(uint32_t(std::max((x - lo) / cell_size, 0.0f)), dims[a] - 1);
+  };
+
+  // counting sort of the atoms by cell
+  std::vector< uint32_t > cell_of(n);
+  std::vector< std::atomic< uint32_t > > counts(num_cells);
+  pool.parallel_for_range(n, primitive_grain, [&](uint64_t begin, uint64_t end) {
+    for (uint32_t i = begin; i < end; i++) {
+      glm::vec3 p = atoms[i].center;
+      uint32_t x = cell_coordinate(p.x, box.min.x, 0);
+      uint32_t y = cell_coordinate(p.y, box.min.y, 1);
+      uint32_t z = cell_coordinate(p.z, box.min.z, 2);
+      cell_of[i] = (z * dims[1] + y) * dims[0] + x;
+      counts[cell_of[i]].fetch_add(1, std::memory_order_relaxed);
+    }
+  });
+
+  std::vector< uint32_t > offsets(num_cells + 1);
+  pool.parallel_for_range(num_cells, primitive_grain, [&](uint64_t begin, uint64_t end) {
+    for (uint32_t c = begin; c < end; c++) offsets[c] = counts[c].load(std::memory_order_relaxed);
+  });
+  offsets[num_cells] = 0;
+  pool.parallel_exclusive_scan(offsets, offsets, 0u, [](uint32_t a, uint32_t b) { return a + b; });
+
+  pool.parallel_for_range(num_cells, primitive_grain, [&](uint64_t begin, uint64_t end) {
+    for (uint32_t c = begin; c < end; c++) counts[c].store(offsets[c], std::memory_order_relaxed);
+  });
+
+  std::vector< uint32_t > order(n);
+  pool.parallel_for_range(n, primitive_grain, [&](uint64_t begin, uint64_t end) {
+    for (uint32_t i = begin; i < end; i++) {
+      order[counts[cell_of[i]].fetch_add(1, std::memory_order_relaxed)] = i;
+    }
+  });
+
+  // the atoms within a cell were scattered in whatever order the threads got to them,
+  // and gathering their positions and radii makes each cell's atoms contiguous in memory
+  std::vector< glm::vec4 > sorted(n);
+  pool.parallel_for_range(num_cells, primitive_grain, [&](uint64_t begin, uint64_t end) {
+    for (uint32_t c = begin; c < end; c++) {
+      if (offsets[c + 1] - offsets[c] > 1) std::sort(order.begin() + offsets[c], order.begin() + offsets[c + 1]);
+      for (uint32_t s = offsets[c]; s < offsets[c + 1]; s++) {
+        sorted[s] = glm::vec4(atoms[order[s]].center, covalent_radius(atomic_numbers[order[s]]));
+      }
+    }
+  });
+
+  uint32_t num_blocks = (num_cells + cells_per_block - 1) / cells_per_block;
+  std::vector< std::vector< Bond > > block_bonds(num_blocks);
+  pool.parallel_for(num_blocks, [&](uint64_t b) {
+    std::vector< Bond > & found = block_bonds[b];
+
+    // test the atoms in sorted[first, last) against the atoms in sorted[begin, end)
+    auto test = [&](uint32_t first, uint32_t last, uint32_t begin, uint32_t end) {
+      for (uint32_t s = first; s < last; s++) {
+        for (uint32_t t = std::max(begin, s + 1); t < end; t++) {
+          glm::vec3 d = glm::vec3(sorted[s]) - glm::vec3(sorted[t]);
+          float d2 = glm::dot(d, d);
+          float cutoff = sorted[s].w + sorted[t].w + tolerance;
+          if (d2 <= cutoff * cutoff && d2 >= min_bond_length * min_bond_length && sorted[s].w > 0.0f && sorted[t].w > 0.0f) {
+            found.push_back(Bond{{std::min(order[s], order[t]), std::max(order[s], order[t])}, 1});
+          }
+        }
+      }
+    };
+
+    uint32_t end = std::min(num_cells, uint32_t(b + 1) * cells_per_block);
+    for (uint32_t c = b * cells_per_block; c < end; c++) {
+      if (offsets[c] == offsets[c + 1]) continue;
+
+      uint32_t x = c % dims[0];
+      uint32_t y = (c / dims[0]) % dims[1];
+      uint32_t z = c / (dims[0] * dims[1]);
+
+      // the 13 neighboring cells that come after this one, so that each pair of cells
+      // is only visited once: the rest of this cell and the next one in its row, and
+      // then 4 rows of 3 cells, whose atoms are contiguous in the sorted order
+      test(offsets[c], offsets[c + 1], offsets[c], offsets[c + 1 + (x + 1 < dims[0])]);
+
+      uint32_t x0 = (x > 0) ? x - 1 : x;
+      uint32_t x1 = std::min(x + 2, dims[0]);
+      auto test_row = [&](uint32_t ny, uint32_t nz) {
+        if (ny >= dims[1] || nz >= dims[2]) return;
+        uint32_t row = (nz * dims[1] + ny) * dims[0];
+        test(offsets[c], offsets[c + 1], offsets[row + x0], offsets[row + x1]);
+      };
+      test_row(y + 1, z);
+      test_row(y - 1, z + 1);
+      test_row(y, z + 1);
+      test_row(y + 1, z + 1);
+    }
+  });
+
+  std::vector< uint64_t > starts(num_blocks + 1, 0);
+  for (uint32_t b = 0; b < num_blocks; b++) starts[b + 1] = starts[b] + block_bonds[b].size();
+
+  std::vector< Bond > bonds(starts[num_blocks]);
+  pool.parallel_for(num_blocks, [&](uint64_t b) {
+    std::copy(block_bonds[b].begin(), block_bonds[b].end(), bonds.begin() + starts[b]);
+  });
+  return bonds;
+}
+
+void append_bonds(Cylinders & cylinders, const std::vector< Sphere > & atoms,
+                  const std::vector< rgbcolor > & colors, const std::vector< Bond > & bonds, float radius) {
+
+  threadpool & pool = worker_threads();
+
+  uint32_t n = atoms.size();
+  auto exists = [&](const Bond & bond) { return bond.atoms[0] < n && bond.atoms[1] < n; };
+
+  const std::vector< Bond > * valid = &bonds;
+  std::vector< Bond > filtered;
+  uint64_t missing = pool.parallel_reduce(bonds.size(), uint64_t(0),
+    [&](uint64_t i) { return uint64_t(!exists(bonds[i])); }, [](uint64_t a, uint64_t b) { return a + b; });
+  if (missing > 0) {
+    std::cout << "warning: skipping " << missing << " bonds between atoms that don't exist" << std::endl;
+    pool.parallel_copy_if(bonds, filtered, exists);
+    valid = &filtered;
+  }
+
+  std::vector< Cylinder > halves(2 * valid->size());
+  std::vector< rgbcolor > half_colors(2 * valid->size());
+  pool.parallel_for_range(valid->size(), primitive_grain, [&](uint64_t begin, uint64_t end) {
+    for (uint32_t i = begin; i < end; i++) {
+      const Bond & bond = (*valid)[i];
+      float r = radius * ((bond.order == 2) ? 1.7f : 1.0f);
+
+      Sphere start = {atoms[bond.atoms[0]].center, r};
+      Sphere mid = {(atoms[bond.atoms[0]].center + atoms[bond.atoms[1]].center) * 0.5f, r};
+      Sphere end = {atoms[bond.atoms[1]].center, r};
+
+      halves[2 * i + 0] = Cylinder{start, mid};
+      halves[2 * i + 1] = Cylinder{mid, end};
+      half_colors[2 * i + 0] = colors[bond.atoms[0]];
+      half_colors[2 * i + 1] = colors[bond.atoms[1]];
+    }
+  });
+
+  cylinders.append(halves, half_colors);
+}
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "rgbcolor.hpp"
+#include "spheres.hpp"
+#include "cylinders.hpp"
+
+namespace Graphics {
+
+struct Bond {
+  uint32_t atoms[2];
+  uint32_t order;
+};
+
+// covalent radius in angstroms (Cordero et al., 2008), or 0 for unknown elements
+float covalent_radius(uint32_t atomic_number);
+
+// Infers the bonds of a structure that only has atom positions (in angstroms): two atoms are
+// bonded when they are closer than the sum of their covalent radii plus `tolerance`, but more
+// than 0.4 angstroms apart.
+//
+// The atoms are counting-sorted into a uniform grid of cells at least as wide as the longest
+// possible bond, so each atom is only compared with the atoms in its own and neighboring cells,
+// which takes O(N) time. Each bond is found once, with atoms[0] < atoms[1], and the bonds come
+// out in the same order regardless of the number of threads.
+std::vector< Bond > find_bonds(const std::vector< Sphere > & atoms,
+                               const std::vector< uint32_t > & atomic_numbers,
+                               float tolerance = 0.45f);
+
+// Appends two cylinders per bond, from each of its atoms to the midpoint, in that atom's color.
+// Double bonds are drawn thicker.
+void append_bonds(Cylinders & cylinders, const std::vector< Sphere > & atoms,
+                  const std::vector< rgbcolor > & colors, const std::vector< Bond > & bonds, float radius);
+
+}
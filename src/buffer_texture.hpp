@@ -0,0 +1,30 @@
+#pragma once
+
+#include <GL/glew.h>
+
+namespace Graphics {
+
+// A texture whose texels are the contents of a GL buffer, so that shaders can read
+// its elements in any order with texelFetch(samplerBuffer, i). This lets an instanced
+// draw take its instances from an index buffer, instead of from gathered copies of them.
+struct BufferTexture {
+
+  BufferTexture() : handle(0) {}
+
+  // requires a current GL context, so it is called by the owner's constructor
+  void generate() { glGenTextures(1, &handle); }
+
+  // Read `buffer` as texels of the given format (e.g. GL_RGBA32F for one vec4 per texel)
+  // through texture unit `unit`. Call it before each draw, so a reallocated buffer is seen.
+  void bind(GLuint unit, GLuint buffer, GLenum format) {
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_BUFFER, handle);
+    glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+    glActiveTexture(GL_TEXTURE0);
+  }
+
+  GLuint handle;
+
+};
+
+}
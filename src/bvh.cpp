@@ -0,0 +1,324 @@
+#include "bvh.hpp"
+
+#include <cmath>
+#include <atomic>
+#include <numeric>
+#include <algorithm>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace Graphics {
+
+AABB bounds(const Sphere & sphere) {
+  return AABB{sphere.center - sphere.radius, sphere.center + sphere.radius};
+}
+
+AABB bounds(const Cylinder & cylinder) {
+  AABB a = bounds(cylinder.endpoints[0]);
+  AABB b = bounds(cylinder.endpoints[1]);
+  return AABB{glm::min(a.min, b.min), glm::max(a.max, b.max)};
+}
+
+AABB bounds(const Tri3 & triangle) {
+  return AABB{
+    glm::min(triangle[0], glm::min(triangle[1], triangle[2])),
+    glm::max(triangle[0], glm::max(triangle[1], triangle[2]))
+  };
+}
+
+float intersect(const Ray & ray, const Sphere & sphere) {
+  glm::vec3 w = ray.origin - sphere.center;
+  float b = glm::dot(w, ray.direction);
+  float c = glm::dot(w, w) - sphere.radius * sphere.radius;
+  float discriminant = b * b - c;
+  if (discriminant < 0.0f) return miss;
+
+  float s = sqrtf(discriminant);
+  if (-b - s > 0.0f) return -b - s;
+  if (-b + s > 0.0f) return -b + s;
+  return miss;
+}
+
+// same as the cylinder impostor fragment shader, see cylinders.cpp
+float intersect(const Ray & ray, const Cylinder & cylinder) {
+  glm::vec3 pa = cylinder.endpoints[0].center;
+  glm::vec3 pb = cylinder.endpoints[1].center;
+  float ra = cylinder.endpoints[0].radius;
+  float rb = cylinder.endpoints[1].radius;
+
+  float height = glm::length(pb - pa);
+  if (height == 0.0f) return miss;
+  glm::vec3 axis = (pb - pa) / height;
+
+  glm::vec3 w = ray.origin - pa;
+  float slope = (rb - ra) / height;
+  float y0 = glm::dot(w, axis);
+  float ky = glm::dot(ray.direction, axis);
+  float q = ra + slope * y0;
+  float kq = slope * ky;
+
+  float t_hit = miss;
+
+  // lateral surface
+  float A = 1.0f - ky * ky - kq * kq;
+  float B = glm::dot(w, ray.direction) - y0 * ky - q * kq;
+  float C = glm::dot(w, w) - y0 * y0 - q * q;
+  float discriminant = B * B - A * C;
+  if (fabsf(A) > 1.0e-8f && discriminant >= 0.0f) {
+    float s = sqrtf(discriminant);
+    for (float t : {(-B - s) / A, (-B + s) / A}) {
+      float y = y0 + t * ky;
+      if (t > 0.0f && t < t_hit && y >= 0.0f && y <= height) t_hit = t;
+    }
+  }
+
+  // end caps
+  if (fabsf(ky) > 1.0e-8f) {
+    float t = -y0 / ky;
+    glm::vec3 x = w + t * ray.direction;
+    if (t > 0.0f && t < t_hit && glm::dot(x, x) <= ra * ra) t_hit = t;
+
+    t = (height - y0) / ky;
+    x = w + t * ray.direction - height * axis;
+    if (t > 0.0f && t < t_hit && glm::dot(x, x) <= rb * rb) t_hit = t;
+  }
+
+  return t_hit;
+}
+
+// Moller-Trumbore, hitting both sides of the triangle
+float intersect(const Ray & ray, const Tri3 & triangle) {
+  glm::vec3 e1 = triangle[1] - triangle[0];
+  glm::vec3 e2 = triangle[2] - triangle[0];
+  glm::vec3 p = glm::cross(ray.direction, e2);
+  float det = glm::dot(e1, p);
+  if (fabsf(det) < 1.0e-12f) return miss;
+
+  float inv_det = 1.0f / det;
+  glm::vec3 s = ray.origin - triangle[0];
+  float u = glm::dot(s, p) * inv_det;
+  if (u < 0.0f || u > 1.0f) return miss;
+
+  glm::vec3 q = glm::cross(s, e1);
+  float v = glm::dot(ray.direction, q) * inv_det;
+  if (v < 0.0f || u + v > 1.0f) return miss;
+
+  float t = glm::dot(e2, q) * inv_det;
+  return (t > 0.0f) ? t : miss;
+}
+
+float intersect(const Ray & ray, const glm::vec3 & inverse_direction, const AABB & box, float t_max) {
+  float t_enter = 0.0f;
+  float t_exit = t_max;
+  for (int a = 0; a < 3; a++) {
+    float t0 = (box.min[a] - ray.origin[a]) * inverse_direction[a];
+    float t1 = (box.max[a] - ray.origin[a]) * inverse_direction[a];
+
+    // a ray parallel to the slab has t0, t1 = +-inf, or NaN (0 * inf) when its origin is on one
+    // of the slab's planes, and in that case it is inside of the slab for every t
+    if (std::isnan(t0) || std::isnan(t1)) continue;
+
+    t_enter = std::max(t_enter, std::min(t0, t1));
+    t_exit = std::min(t_exit, std::max(t0, t1));
+  }
+  return (t_enter <= t_exit) ? t_enter : miss;
+}
+
+bool intersects(const AABB & a, const AABB & b) {
+  return a.min.x <= b.max.x && b.min.x <= a.max.x &&
+         a.min.y <= b.max.y && b.min.y <= a.max.y &&
+         a.min.z <= b.max.z && b.min.z <= a.max.z;
+}
+
+// the box is outside if its corner farthest along a plane's normal is behind that plane
+bool intersects(const Frustum & frustum, const AABB & box) {
+  for (auto & plane : frustum.planes) {
+    glm::vec3 corner(
+      (plane.x > 0.0f) ? box.max.x : box.min.x,
+      (plane.y > 0.0f) ? box.max.y : box.min.y,
+      (plane.z > 0.0f) ? box.max.z : box.min.z
+    );
+    if (glm::dot(glm::vec3(plane), corner) + plane.w < 0.0f) return false;
+  }
+  return true;
+}
+
+// spread the lower 10 bits of v out to every third bit
+static uint32_t expand_bits(uint32_t v) {
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+// 30 bit Morton code of a point in the unit cube
+static uint32_t morton_code(glm::vec3 p) {
+  glm::uvec3 q(glm::clamp(p * 1024.0f, glm::vec3(0.0f), glm::vec3(1023.0f)));
+  return (expand_bits(q.x) << 2) | (expand_bits(q.y) << 1) | expand_bits(q.z);
+}
+
+static int leading_zeros(uint64_t x) {
+#ifdef _MSC_VER
+  unsigned long i;
+  _BitScanReverse64(&i, x);
+  return 63 - i;
+#else
+  return __builtin_clzll(x);
+#endif
+}
+
+void BVH::build(const std::vector< AABB > & boxes) {
+
+  uint32_t n = boxes.size();
+
+  nodes.clear();
+  leaves.clear();
+  primitives.clear();
+  parents.clear();
+  if (n == 0) return;
+
+  threadpool & pool = worker_threads();
+
+  // bounds of the box centers
+  auto center_bounds = [&](uint64_t i) {
+    glm::vec3 center = 0.5f * (boxes[i].min + boxes[i].max);
+    return AABB{center, center};
+  };
+  auto merge = [](const AABB & a, const AABB & b) {
+    return AABB{glm::min(a.min, b.min), glm::max(a.max, b.max)};
+  };
+  AABB scene = pool.parallel_reduce(n, AABB{glm::vec3(miss), glm::vec3(-miss)}, center_bounds, merge);
+  glm::vec3 scale = 1.0f / glm::max(scene.max - scene.min, glm::vec3(1.0e-30f));
+
+  std::vector< uint32_t > codes(n);
+  pool.parallel_for_range(n, primitive_grain, [&](uint64_t begin, uint64_t end) {
+    for (uint32_t i = begin; i < end; i++) {
+      glm::vec3 center = 0.5f * (boxes[i].min + boxes[i].max);
+      codes[i] = morton_code((center - scene.min) * scale);
+    }
+  });
+
+  // LSD radix sort of the codes, 6 bits per pass, since
+  // parallel_bin reserves the bin value 0xFF for culled items
+  primitives.resize(n);
+  std::iota(primitives.begin(), primitives.end(), 0);
+
+  std::vector< uint32_t > permutation, offsets, sorted;
+  for (int shift = 0; shift < 30; shift += 6) {
+    auto digit = [&](uint32_t i) -> uint8_t { return (codes[i] >> shift) & 63; };
+    parallel_bin(pool, n, 64, digit, permutation, offsets);
+    parallel_gather(pool, permutation, codes, sorted);
+    codes.swap(sorted);
+    parallel_gather(pool, permutation, primitives, sorted);
+    primitives.swap(sorted);
+  }
+
+  // appending the position to each code makes the keys unique
+  std::vector< uint64_t > keys(n);
+  leaves.resize(n);
+  pool.parallel_for_range(n, primitive_grain, [&](uint64_t begin, uint64_t end) {
+    for (uint32_t j = begin; j < end; j++) {
+      keys[j] = (uint64_t(codes[j]) << 32) | j;
+      leaves[j] = boxes[primitives[j]];
+    }
+  });
+
+  parents.assign(2 * n - 1, no_parent);
+  if (n == 1) {
+    root = leaf_bit;
+    return;
+  }
+
+  root = 0;
+  nodes.resize(n - 1);
+
+  // length of the common prefix of keys i and j, or -1 if j is out of range
+  auto delta = [&](int64_t i, int64_t j) -> int {
+    if (j < 0 || j >= int64_t(n)) return -1;
+    return leading_zeros(keys[i] ^ keys[j]);
+  };
+
+  pool.parallel_for_range(n - 1, primitive_grain, [&](uint64_t begin, uint64_t end) {
+    for (int64_t i = begin; i < int64_t(end); i++) {
+
+      // direction of the range of keys covered by node i
+      int64_t d = (delta(i, i + 1) > delta(i, i - 1)) ? 1 : -1;
+
+      // find the other end of that range, j
+      int delta_min = delta(i, i - d);
+      int64_t l_max = 2;
+      while (delta(i, i + l_max * d) > delta_min) l_max *= 2;
+
+      int64_t l = 0;
+      for (int64_t t = l_max / 2; t >= 1; t /= 2) {
+        if (delta(i, i + (l + t) * d) > delta_min) l += t;
+      }
+      int64_t j = i + l * d;
+
+      // find where the keys in the range stop sharing a prefix
+      int delta_node = delta(i, j);
+      int64_t s = 0;
+      for (int64_t t = (l + 1) / 2; ; t = (t + 1) / 2) {
+        if (delta(i, i + (s + t) * d) > delta_node) s += t;
+        if (t == 1) break;
+      }
+      int64_t split = i + s * d + std::min< int64_t >(d, 0);
+
+      uint32_t left = (std::min(i, j) == split) ? (leaf_bit | split) : split;
+      uint32_t right = (std::max(i, j) == split + 1) ? (leaf_bit | (split + 1)) : (split + 1);
+
+      nodes[i].children[0] = left;
+      nodes[i].children[1] = right;
+      parents[(left & leaf_bit) ? (n - 1 + (left & ~leaf_bit)) : left] = i;
+      parents[(right & leaf_bit) ? (n - 1 + (right & ~leaf_bit)) : right] = i;
+    }
+  });
+
+  fit_boxes();
+
+}
+
+void BVH::refit(const std::vector< AABB > & boxes) {
+  if (boxes.size() != leaves.size()) {
+    build(boxes);
+    return;
+  }
+
+  worker_threads().parallel_for_range(leaves.size(), primitive_grain, [&](uint64_t begin, uint64_t end) {
+    for (uint32_t j = begin; j < end; j++) {
+      leaves[j] = boxes[primitives[j]];
+    }
+  });
+
+  fit_boxes();
+}
+
+// Bottom-up pass from every leaf, in parallel. The first thread to reach
+// a node stops there, and the second (whose sibling subtree is then complete)
+// computes the node's box and continues towards the root.
+void BVH::fit_boxes() {
+  uint32_t n = leaves.size();
+  if (n < 2) return;
+
+  std::vector< std::atomic< uint32_t > > visits(n - 1);
+  for (auto & v : visits) v.store(0, std::memory_order_relaxed);
+
+  worker_threads().parallel_for_range(n, primitive_grain, [&](uint64_t begin, uint64_t end) {
+    for (uint32_t j = begin; j < end; j++) {
+      uint32_t node = parents[n - 1 + j];
+      while (node != no_parent) {
+        if (visits[node].fetch_add(1, std::memory_order_acq_rel) == 0) break;
+
+        const AABB & a = box(nodes[node].children[0]);
+        const AABB & b = box(nodes[node].children[1]);
+        nodes[node].box = AABB{glm::min(a.min, b.min), glm::max(a.max, b.max)};
+        node = parents[node];
+      }
+    }
+  });
+}
+
+}
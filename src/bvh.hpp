@@ -0,0 +1,209 @@
+#pragma once
+
+#include <vector>
+#include <limits>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "spheres.hpp"
+#include "cylinders.hpp"
+#include "triangles.hpp"
+#include "culling.hpp"
+
+namespace Graphics {
+
+struct AABB {
+  glm::vec3 min;
+  glm::vec3 max;
+};
+
+AABB bounds(const Sphere & sphere);
+AABB bounds(const Cylinder & cylinder);
+AABB bounds(const Tri3 & triangle);
+
+// the direction is expected to be a unit vector
+struct Ray {
+  glm::vec3 origin;
+  glm::vec3 direction;
+};
+
+// returned by the ray intersection tests when nothing is hit
+static constexpr float miss = std::numeric_limits< float >::infinity();
+
+// distance along the ray to its first intersection with the primitive
+float intersect(const Ray & ray, const Sphere & sphere);
+float intersect(const Ray & ray, const Cylinder & cylinder);
+float intersect(const Ray & ray, const Tri3 & triangle);
+
+// distance along the ray to where it enters the box, if that happens before t_max
+float intersect(const Ray & ray, const glm::vec3 & inverse_direction, const AABB & box, float t_max);
+
+bool intersects(const AABB & a, const AABB & b);
+bool intersects(const Frustum & frustum, const AABB & box);
+
+// bounding boxes of a list of primitives, computed in parallel
+template < typename T >
+std::vector< AABB > bounds(const std::vector< T > & primitives) {
+  std::vector< AABB > boxes(primitives.size());
+  worker_threads().parallel_for_range(primitives.size(), primitive_grain, [&](uint64_t begin, uint64_t end) {
+    for (uint32_t i = begin; i < end; i++) {
+      boxes[i] = bounds(primitives[i]);
+    }
+  });
+  return boxes;
+}
+
+// A linear bounding volume hierarchy (Karras, "Maximizing Parallelism in the
+// Construction of BVHs, Octrees, and k-d Trees", 2012).
+//
+// The primitives are sorted along a Morton curve, and then each internal node
+// of the binary radix tree over those codes is found independently, so every
+// step of the build runs in parallel on worker_threads(). Leaves hold a
+// single primitive, and queries report primitives by their original index.
+struct BVH {
+
+  struct Hit {
+    uint32_t primitive;
+    float t;
+  };
+
+  void build(const std::vector< AABB > & boxes);
+
+  template < typename T >
+  void build(const std::vector< T > & primitives) { build(bounds(primitives)); }
+
+  // Recompute the bounding boxes after the primitives moved, keeping the tree.
+  // This is much cheaper than build(), but queries get slower if primitives
+  // move far from where they were when the tree was built.
+  void refit(const std::vector< AABB > & boxes);
+
+  template < typename T >
+  void refit(const std::vector< T > & primitives) { refit(bounds(primitives)); }
+
+  // call f(i) for every primitive i whose bounding box overlaps the given box
+  template < typename lambda >
+  void query(const AABB & box, const lambda & f) const {
+    traverse([&](const AABB & node) { return intersects(box, node); }, f);
+  }
+
+  // call f(i) for every primitive i whose bounding box may be in the frustum
+  template < typename lambda >
+  void query(const Frustum & frustum, const lambda & f) const {
+    traverse([&](const AABB & node) { return intersects(frustum, node); }, f);
+  }
+
+  // closest primitive along the ray, where hit(i) returns the distance along
+  // the ray to primitive i (or `miss`). If nothing is hit, t is `miss`.
+  template < typename lambda >
+  Hit raycast(const Ray & ray, const lambda & hit, float t_max = miss) const;
+
+  template < typename T >
+  Hit raycast(const Ray & ray, const std::vector< T > & primitives) const {
+    return raycast(ray, [&](uint32_t i) { return intersect(ray, primitives[i]); });
+  }
+
+  size_t size() const { return leaves.size(); }
+
+  // children with this bit set refer to leaves
+  static constexpr uint32_t leaf_bit = 0x80000000;
+  static constexpr uint32_t no_parent = 0xFFFFFFFF;
+
+  struct Node {
+    AABB box;
+    uint32_t children[2];
+  };
+
+  uint32_t root;
+
+  // the n - 1 internal nodes, with the root at 0
+  std::vector< Node > nodes;
+
+  // leaf boxes and the primitive each leaf refers to, in Morton order
+  std::vector< AABB > leaves;
+  std::vector< uint32_t > primitives;
+
+  // parents of internal node i at index i, and of leaf j at index n - 1 + j
+  std::vector< uint32_t > parents;
+
+ private:
+  void fit_boxes();
+
+  const AABB & box(uint32_t child) const {
+    return (child & leaf_bit) ? leaves[child & ~leaf_bit] : nodes[child].box;
+  }
+
+  template < typename overlaps, typename lambda >
+  void traverse(const overlaps & test, const lambda & f) const;
+
+  // the tree depth is bounded by the 64 bit sort keys
+  static constexpr int max_stack = 128;
+
+};
+
+template < typename overlaps, typename lambda >
+void BVH::traverse(const overlaps & test, const lambda & f) const {
+  if (leaves.empty()) return;
+
+  uint32_t stack[max_stack];
+  int top = 0;
+  stack[top++] = root;
+
+  while (top > 0) {
+    uint32_t node = stack[--top];
+    if (!test(box(node))) continue;
+
+    if (node & leaf_bit) {
+      f(primitives[node & ~leaf_bit]);
+    } else {
+      stack[top++] = nodes[node].children[1];
+      stack[top++] = nodes[node].children[0];
+    }
+  }
+}
+
+template < typename lambda >
+BVH::Hit BVH::raycast(const Ray & ray, const lambda & hit, float t_max) const {
+  Hit closest{0, miss};
+  if (leaves.empty()) return closest;
+
+  glm::vec3 inverse_direction = 1.0f / ray.direction;
+
+  struct Entry { uint32_t node; float t; };
+  Entry stack[max_stack];
+  int top = 0;
+
+  float t_root = intersect(ray, inverse_direction, box(root), t_max);
+  if (t_root != miss) stack[top++] = {root, t_root};
+
+  while (top > 0) {
+    Entry e = stack[--top];
+    if (e.t >= t_max) continue;
+
+    if (e.node & leaf_bit) {
+      uint32_t i = primitives[e.node & ~leaf_bit];
+      float t = hit(i);
+      if (t < t_max) {
+        t_max = t;
+        closest = Hit{i, t};
+      }
+      continue;
+    }
+
+    // visit the nearer child first, so that farther subtrees are more likely to be pruned
+    uint32_t a = nodes[e.node].children[0];
+    uint32_t b = nodes[e.node].children[1];
+    float ta = intersect(ray, inverse_direction, box(a), t_max);
+    float tb = intersect(ray, inverse_direction, box(b), t_max);
+    if (ta > tb) {
+      std::swap(a, b);
+      std::swap(ta, tb);
+    }
+    if (tb != miss) stack[top++] = {b, tb};
+    if (ta != miss) stack[top++] = {a, ta};
+  }
+
+  return closest;
+}
+
+}
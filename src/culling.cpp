@@ -0,0 +1,137 @@
+#include "culling.hpp"
+
+#include <cmath>
+
+namespace Graphics {
+
+Frustum::Frustum(const glm::mat4 & proj) {
+
+  // rows of the (column-major) matrix
+  glm::vec4 r[4];
+  for (int i = 0; i < 4; i++) {
+    r[i] = glm::vec4(proj[0][i], proj[1][i], proj[2][i], proj[3][i]);
+  }
+
+  // -w <= x, y, z <= w in clip space
+  planes[0] = r[3] + r[0];
+  planes[1] = r[3] - r[0];
+  planes[2] = r[3] + r[1];
+  planes[3] = r[3] - r[1];
+  planes[4] = r[3] + r[2];
+  planes[5] = r[3] - r[2];
+
+  for (auto & plane : planes) {
+    plane /= glm::length(glm::vec3(plane));
+  }
+
+}
+
+bool Frustum::intersects(const glm::vec3 & center, float radius) const {
+  for (auto & plane : planes) {
+    if (glm::dot(glm::vec3(plane), center) + plane.w < -radius) return false;
+  }
+  return true;
+}
+
+bool Frustum::intersects(const Sphere & sphere) const {
+  return intersects(sphere.center, sphere.radius);
+}
+
+// a truncated cone lies within the convex hull of the spheres at its endpoints,
+// so it is outside of a plane if both of those spheres are
+bool Frustum::intersects(const Cylinder & cylinder) const {
+  const Sphere & a = cylinder.endpoints[0];
+  const Sphere & b = cylinder.endpoints[1];
+  for (auto & plane : planes) {
+    glm::vec3 n(plane);
+    if (glm::dot(n, a.center) + plane.w < -a.radius &&
+        glm::dot(n, b.center) + plane.w < -b.radius) return false;
+  }
+  return true;
+}
+
+// the sphere around the bounding box of the given spheres
+static Sphere bounding_sphere(const Sphere * spheres, size_t n) {
+  if (n == 0) return Sphere{glm::vec3(0.0f), 0.0f};
+  glm::vec3 lo(spheres[0].center - spheres[0].radius);
+  glm::vec3 hi(spheres[0].center + spheres[0].radius);
+  for (size_t i = 1; i < n; i++) {
+    lo = glm::min(lo, spheres[i].center - spheres[i].radius);
+    hi = glm::max(hi, spheres[i].center + spheres[i].radius);
+  }
+  return Sphere{0.5f * (lo + hi), 0.5f * glm::length(hi - lo)};
+}
+
+Sphere bounding_sphere(const std::vector< Sphere > & spheres) {
+  return bounding_sphere(spheres.data(), spheres.size());
+}
+
+// a cylinder lies within the convex hull of its endpoint spheres
+Sphere bounding_sphere(const std::vector< Cylinder > & cylinders) {
+  static_assert(sizeof(Cylinder) == 2 * sizeof(Sphere));
+  return bounding_sphere(cylinders.empty() ? nullptr : &cylinders[0].endpoints[0], 2 * cylinders.size());
+}
+
+std::vector< CellBlock > visible_cells(const Frustum & frustum, const Lattice & lattice, const Sphere & bounds) {
+  std::vector< CellBlock > blocks;
+  glm::uvec3 n = lattice.counts;
+  if (lattice.num_cells() == 0) return blocks;
+
+  // the run [first, last] of cells in row (j, k), where the bounds are inside of every plane:
+  // dot(normal, center + i * basis[0]) + w >= -radius is a bound on i from each plane
+  auto run = [&](uint32_t j, uint32_t k, uint32_t & first, uint32_t & last) {
+    glm::dvec3 origin = glm::dvec3(bounds.center) + double(j) * glm::dvec3(lattice.basis[1]) + double(k) * glm::dvec3(lattice.basis[2]);
+    double lo = 0.0;
+    double hi = n.x - 1.0;
+    for (auto & plane : frustum.planes) {
+      glm::dvec3 normal(plane);
+      double v = glm::dot(normal, origin) + plane.w + bounds.radius;
+      double s = glm::dot(normal, glm::dvec3(lattice.basis[0]));
+      if (s > 0.0) lo = std::max(lo, std::ceil(-v / s));
+      if (s < 0.0) hi = std::min(hi, std::floor(-v / s));
+      if (s == 0.0 && v < 0.0) return false;
+    }
+    if (!(lo <= hi)) return false;
+    first = lo;
+    last = hi;
+    return true;
+  };
+
+  // blocks are extended into the next layer when it has one with the same rows and runs,
+  // which (since both layers' blocks are in order of rows) takes one pass over the two
+  std::vector< size_t > previous, current;
+  for (uint32_t k = 0; k < n.z; k++) {
+
+    std::vector< CellBlock > layer;
+    for (uint32_t j = 0; j < n.y; j++) {
+      uint32_t first, last;
+      if (!run(j, k, first, last)) continue;
+      CellBlock * open = layer.empty() ? nullptr : &layer.back();
+      if (open && open->first.y + open->span.y == j && open->first.x == first && open->span.x == last - first + 1) {
+        open->span.y++;
+      } else {
+        layer.push_back(CellBlock{{first, j, k}, {last - first + 1, 1, 1}});
+      }
+    }
+
+    current.clear();
+    size_t p = 0;
+    for (auto & block : layer) {
+      while (p < previous.size() && blocks[previous[p]].first.y < block.first.y) p++;
+      CellBlock * above = (p < previous.size()) ? &blocks[previous[p]] : nullptr;
+      if (above && above->first.y == block.first.y && above->span.y == block.span.y &&
+          above->first.x == block.first.x && above->span.x == block.span.x) {
+        above->span.z++;
+        current.push_back(previous[p]);
+      } else {
+        current.push_back(blocks.size());
+        blocks.push_back(block);
+      }
+    }
+    std::swap(previous, current);
+  }
+
+  return blocks;
+}
+
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#include "spheres.hpp"
+#include "cylinders.hpp"
+
+#include "binned_indices.hpp"
+
+namespace Graphics {
+
+struct Frustum {
+
+  // extract the 6 clipping planes from a projection * view matrix
+  Frustum(const glm::mat4 & proj);
+
+  // conservative tests: may return true for primitives slightly outside the frustum
+  bool intersects(const glm::vec3 & center, float radius) const;
+  bool intersects(const Sphere & sphere) const;
+  bool intersects(const Cylinder & cylinder) const;
+
+  // (nx, ny, nz, d), with unit normals pointing into the frustum
+  glm::vec4 planes[6];
+
+};
+
+// a sphere containing all of the given primitives
+Sphere bounding_sphere(const std::vector< Sphere > & spheres);
+Sphere bounding_sphere(const std::vector< Cylinder > & cylinders);
+
+// The cells of a lattice where the image of `bounds` (a bounding sphere of the primitives in cell
+// (0, 0, 0)) may be in the frustum, as blocks for draw_lattice(). Each row of cells along basis[0]
+// meets the frustum in a single run of cells, found directly from the planes, and then rows (and
+// layers) with the same runs are merged, so a lattice that's all in view is a single block.
+std::vector< CellBlock > visible_cells(const Frustum & frustum, const Lattice & lattice, const Sphere & bounds);
+
+}
@@ -1,7 +1,12 @@
 #include "cylinders.hpp"
+#include "culling.hpp"
+#include "placements.hpp"
+#include "buffer_texture.hpp"
 
+#include <atomic>
 #include <string>
 #include <iostream>
+#include <algorithm>
 
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
@@ -27,6 +32,14 @@ static const std::vector< glm::vec3 > cylinder_vertices = [](){
   return vertices;
 }();
 
+// the box [-1, 1]^3 as a single triangle strip, wound counterclockwise
+// when viewed from outside so that the impostor shader can cull front faces
+static float box_vertices[14][3] = {
+  {-1, -1,  1}, { 1, -1,  1}, {-1,  1,  1}, { 1,  1,  1}, { 1,  1, -1},
+  { 1, -1,  1}, { 1, -1, -1}, {-1, -1,  1}, {-1, -1, -1}, {-1,  1,  1},
+  {-1,  1, -1}, { 1,  1, -1}, {-1, -1, -1}, { 1, -1, -1}
+};
+
 const std::string vert_shader(R"vert(
 #version 400
 
@@ -35,15 +48,66 @@ in vec4 cyl_end;
 in vec3 corners;
 in vec4 rgba;
 
+// with `indexed` set, the instance is cylinder number binned_index of the buffer textures
+// over all of the cylinders (two texels each) and colors instead, see Cylinders::update_bins()
+uniform int indexed;
+in uint binned_index;
+uniform samplerBuffer cylinder_texels;
+uniform samplerBuffer color_texels;
+
+// the copy of the cylinders being drawn, see draw_placed()
+uniform int placement_count;
+uniform int placement_first;
+uniform samplerBuffer placement_texels;
+vec4 rotation = vec4(0, 0, 0, 1);
+vec4 translation = vec4(0, 0, 0, 1);
+
+void find_placement() {
+  if (placement_count == 0) return;
+  int c = placement_first + gl_InstanceID % placement_count;
+  rotation = texelFetch(placement_texels, 2 * c);
+  translation = texelFetch(placement_texels, 2 * c + 1);
+}
+
+vec4 place(vec4 p) {
+  vec3 rotated = p.xyz + 2.0 * cross(rotation.xyz, cross(rotation.xyz, p.xyz) + rotation.w * p.xyz);
+  return vec4(translation.xyz + translation.w * rotated, translation.w * p.w);
+}
+
+// the cell of the periodic image being drawn, see draw_lattice()
+uniform mat3 lattice;
+uniform ivec3 cell_first;
+uniform ivec3 cell_span;
+
+vec4 image() {
+  int cells = cell_span.x * cell_span.y * cell_span.z;
+  if (cells == 0) return vec4(0);
+  int c = gl_InstanceID % cells;
+  ivec3 cell = cell_first + ivec3(c % cell_span.x, (c / cell_span.x) % cell_span.y, c / (cell_span.x * cell_span.y));
+  return vec4(lattice * vec3(cell), 0);
+}
+
 out vec3 normal;
 out vec4 cylinder_color;
 
 uniform mat4 proj;
 
 void main() {
+  find_placement();
+
+  vec4 a = cyl_start;
+  vec4 b = cyl_end;
   cylinder_color = rgba;
+  if (indexed != 0) {
+    a = texelFetch(cylinder_texels, 2 * int(binned_index));
+    b = texelFetch(cylinder_texels, 2 * int(binned_index) + 1);
+    cylinder_color = texelFetch(color_texels, int(binned_index));
+  }
 
-  vec3 e3 = cyl_end.xyz - cyl_start.xyz;
+  vec4 start = place(a) + image();
+  vec4 end = place(b) + image();
+
+  vec3 e3 = end.xyz - start.xyz;
   //vec3 e1 = vec3(1,0,0);
   vec3 e1 = cross(e3, vec3(0,0,1));
   if (length(e1) < 1.0e-5) {
@@ -52,10 +116,10 @@ void main() {
     e1 = normalize(e1);
   }
   vec3 e2 = normalize(cross(e3, e1));
-  float r = cyl_start.w + corners.z * (cyl_end.w - cyl_start.w);
+  float r = start.w + corners.z * (end.w - start.w);
 
   normal = normalize(corners.x * e1 + corners.y * e2);
-  gl_Position = proj * vec4(cyl_start.xyz + r * corners.x * e1 + r * corners.y * e2 + corners.z * e3, 1);
+  gl_Position = proj * vec4(start.xyz + r * corners.x * e1 + r * corners.y * e2 + corners.z * e3, 1);
 }
 )vert");
 
@@ -79,14 +143,209 @@ void main() {
 }
 )frag");
 
-Cylinders::Cylinders() : program({
+const std::string impostor_vert_shader(R"vert(
+#version 400
+
+in vec4 cyl_start;
+in vec4 cyl_end;
+in vec3 corners;
+in vec4 rgba;
+
+// with `indexed` set, the instance is cylinder number binned_index of the buffer textures
+// over all of the cylinders (two texels each) and colors instead, see Cylinders::update_bins()
+uniform int indexed;
+in uint binned_index;
+uniform samplerBuffer cylinder_texels;
+uniform samplerBuffer color_texels;
+
+// the copy of the cylinders being drawn, see draw_placed()
+uniform int placement_count;
+uniform int placement_first;
+uniform samplerBuffer placement_texels;
+vec4 rotation = vec4(0, 0, 0, 1);
+vec4 translation = vec4(0, 0, 0, 1);
+
+void find_placement() {
+  if (placement_count == 0) return;
+  int c = placement_first + gl_InstanceID % placement_count;
+  rotation = texelFetch(placement_texels, 2 * c);
+  translation = texelFetch(placement_texels, 2 * c + 1);
+}
+
+vec4 place(vec4 p) {
+  vec3 rotated = p.xyz + 2.0 * cross(rotation.xyz, cross(rotation.xyz, p.xyz) + rotation.w * p.xyz);
+  return vec4(translation.xyz + translation.w * rotated, translation.w * p.w);
+}
+
+// the cell of the periodic image being drawn, see draw_lattice()
+uniform mat3 lattice;
+uniform ivec3 cell_first;
+uniform ivec3 cell_span;
+
+vec4 image() {
+  int cells = cell_span.x * cell_span.y * cell_span.z;
+  if (cells == 0) return vec4(0);
+  int c = gl_InstanceID % cells;
+  ivec3 cell = cell_first + ivec3(c % cell_span.x, (c / cell_span.x) % cell_span.y, c / (cell_span.x * cell_span.y));
+  return vec4(lattice * vec3(cell), 0);
+}
+
+out vec3 box_position;
+flat out vec4 cylinder_start;
+flat out vec4 cylinder_end;
+flat out vec4 cylinder_color;
+
+uniform mat4 proj;
+
+void main() {
+  find_placement();
+
+  vec4 a = cyl_start;
+  vec4 b = cyl_end;
+  cylinder_color = rgba;
+  if (indexed != 0) {
+    a = texelFetch(cylinder_texels, 2 * int(binned_index));
+    b = texelFetch(cylinder_texels, 2 * int(binned_index) + 1);
+    cylinder_color = texelFetch(color_texels, int(binned_index));
+  }
+
+  cylinder_start = place(a) + image();
+  cylinder_end = place(b) + image();
+
+  vec3 e3 = cylinder_end.xyz - cylinder_start.xyz;
+  vec3 e1 = cross(e3, vec3(0,0,1));
+  if (length(e1) < 1.0e-5) {
+    e1 = vec3(1,0,0);
+  } else {
+    e1 = normalize(e1);
+  }
+  vec3 e2 = normalize(cross(e3, e1));
+  float r = max(cylinder_start.w, cylinder_end.w);
+
+  box_position = cylinder_start.xyz + r * corners.x * e1 + r * corners.y * e2 + (0.5 * corners.z + 0.5) * e3;
+  gl_Position = proj * vec4(box_position, 1);
+}
+)vert");
+
+const std::string impostor_frag_shader(R"frag(
+#version 400
+
+in vec3 box_position;
+flat in vec4 cylinder_start;
+flat in vec4 cylinder_end;
+flat in vec4 cylinder_color;
+
+out vec4 frag_color;
+
+uniform vec4 light;
+uniform mat4 proj;
+uniform vec3 camera_position;
+uniform vec3 camera_direction;
+uniform int perspective;
+
+void main() {
+
+  vec3 pa = cylinder_start.xyz;
+  vec3 pb = cylinder_end.xyz;
+  float ra = cylinder_start.w;
+  float rb = cylinder_end.w;
+
+  float height = length(pb - pa);
+  vec3 axis = (pb - pa) / height;
+
+  vec3 ray_origin;
+  vec3 ray_direction;
+  if (perspective != 0) {
+    ray_origin = camera_position;
+    ray_direction = normalize(box_position - camera_position);
+  } else {
+    ray_direction = camera_direction;
+    ray_origin = box_position - (height + 4.0 * max(ra, rb)) * ray_direction;
+  }
+
+  // express the ray in terms of its height along the axis, y(t) = y0 + t * ky,
+  // and the cone radius at that height, r(t) = q + t * kq
+  vec3 w = ray_origin - pa;
+  float slope = (rb - ra) / height;
+  float y0 = dot(w, axis);
+  float ky = dot(ray_direction, axis);
+  float q = ra + slope * y0;
+  float kq = slope * ky;
+
+  float t_hit = 1.0e30;
+  vec3 normal;
+
+  // lateral surface: |w + t * d|^2 - y(t)^2 = r(t)^2
+  float A = 1.0 - ky * ky - kq * kq;
+  float B = dot(w, ray_direction) - y0 * ky - q * kq;
+  float C = dot(w, w) - y0 * y0 - q * q;
+  float discriminant = B * B - A * C;
+  if (abs(A) > 1.0e-8 && discriminant >= 0.0) {
+    float s = sqrt(discriminant);
+    float roots[2] = float[2]((-B - s) / A, (-B + s) / A);
+    for (int i = 0; i < 2; i++) {
+      float t = roots[i];
+      float y = y0 + t * ky;
+      if (t > 0.0 && t < t_hit && y >= 0.0 && y <= height) {
+        vec3 x = w + t * ray_direction;
+        t_hit = t;
+        normal = normalize(x - y * axis - (ra + slope * y) * slope * axis);
+      }
+    }
+  }
+
+  // end caps
+  if (abs(ky) > 1.0e-8) {
+    float t = -y0 / ky;
+    vec3 x = w + t * ray_direction;
+    if (t > 0.0 && t < t_hit && dot(x, x) <= ra * ra) {
+      t_hit = t;
+      normal = -axis;
+    }
+
+    t = (height - y0) / ky;
+    x = w + t * ray_direction - height * axis;
+    if (t > 0.0 && t < t_hit && dot(x, x) <= rb * rb) {
+      t_hit = t;
+      normal = axis;
+    }
+  }
+
+  if (t_hit == 1.0e30) discard;
+
+  vec4 clip = proj * vec4(ray_origin + t_hit * ray_direction, 1);
+  float ndc_depth = clip.z / clip.w;
+  gl_FragDepth = 0.5 * (gl_DepthRange.diff * ndc_depth + gl_DepthRange.near + gl_DepthRange.far);
+
+  frag_color = cylinder_color;
+  if (light.w != 0) {
+    float ambient = 1.0 - light.w;
+    float diffuse = clamp(dot(normal,light.xyz), 0.0, 1.0) * light.w;
+    frag_color *= ambient + diffuse;
+  }
+}
+)frag");
+
+Cylinders::Cylinders() :
+  mode(RenderMode::MESH),
+  program({
     Shader::fromString(vert_shader, GL_VERTEX_SHADER),
     Shader::fromString(frag_shader, GL_FRAGMENT_SHADER)
-  }), 
+  }),
+  impostor_program({
+    Shader::fromString(impostor_vert_shader, GL_VERTEX_SHADER),
+    Shader::fromString(impostor_frag_shader, GL_FRAGMENT_SHADER)
+  }),
   color{255, 255, 255, 255},
   light(0.721995, 0.618853, 0.309426, 0.0) {
 
   dirty = true;
+  culling = false;
+  bins_dirty = true;
+  num_culled = 0;
+  dynamic = false;
+  recheck_bins = false;
+  lattice.counts = glm::uvec3(0);
 
   glGenVertexArrays(1, &vao);
   glBindVertexArray(vao);
@@ -98,8 +357,8 @@ Cylinders::Cylinders() : program({
   program.setAttribute("corners", 3, sizeof(glm::vec3), 0);
   glCheckError(__FILE__, __LINE__);
 
-  glGenBuffers(1, &cylinder_vbo);
-  glBindBuffer(GL_ARRAY_BUFFER, cylinder_vbo);
+  cylinder_vbo.generate();
+  glBindBuffer(GL_ARRAY_BUFFER, cylinder_vbo.handle);
 
   program.setAttribute("cyl_start", 4, 2 * sizeof(glm::vec4), 0);
   glVertexAttribDivisor(program.attribute("cyl_start"), 1);
@@ -107,43 +366,174 @@ Cylinders::Cylinders() : program({
   program.setAttribute("cyl_end", 4, 2 * sizeof(glm::vec4), 16);
   glVertexAttribDivisor(program.attribute("cyl_end"), 1);
 
-  glGenBuffers(1, &color_vbo);
-  glBindBuffer(GL_ARRAY_BUFFER, color_vbo);
+  color_vbo.generate();
+  glBindBuffer(GL_ARRAY_BUFFER, color_vbo.handle);
   program.setAttribute("rgba", 4, sizeof(rgbcolor), 0, GL_TRUE, GL_UNSIGNED_BYTE);
   glVertexAttribDivisor(program.attribute("rgba"), 1);
 
+  placement_vbo.generate();
+
+  binned_index_vbo.generate();
+  cylinder_texels.generate();
+  color_texels.generate();
+  placement_texels.generate();
+
+  // the impostor vao shares the per-instance buffers above
+  glGenVertexArrays(1, &impostor_vao);
+  glBindVertexArray(impostor_vao);
+
+  glGenBuffers(1, &impostor_vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, impostor_vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(box_vertices), box_vertices, GL_STATIC_DRAW);
+  impostor_program.setAttribute("corners", 3, sizeof(glm::vec3), 0);
+
+  glBindBuffer(GL_ARRAY_BUFFER, cylinder_vbo.handle);
+  impostor_program.setAttribute("cyl_start", 4, 2 * sizeof(glm::vec4), 0);
+  glVertexAttribDivisor(impostor_program.attribute("cyl_start"), 1);
+
+  impostor_program.setAttribute("cyl_end", 4, 2 * sizeof(glm::vec4), 16);
+  glVertexAttribDivisor(impostor_program.attribute("cyl_end"), 1);
+
+  glBindBuffer(GL_ARRAY_BUFFER, color_vbo.handle);
+  impostor_program.setAttribute("rgba", 4, sizeof(rgbcolor), 0, GL_TRUE, GL_UNSIGNED_BYTE);
+  glVertexAttribDivisor(impostor_program.attribute("rgba"), 1);
+  glCheckError(__FILE__, __LINE__);
+
 }
 
 void Cylinders::clear() {
   data.clear();
   colors.clear();
+  ids.clear();
   dirty = true;
+  bins_dirty = true;
 }
 
-void Cylinders::append(const Cylinder & cylinder) {
+uint32_t Cylinders::append(const Cylinder & cylinder) {
   data.push_back(cylinder);
   colors.push_back(color);
+  cylinder_vbo.mark_dirty(data.size() - 1);
+  color_vbo.mark_dirty(colors.size() - 1);
   dirty = true;
+  bin_appended(1);
+  return ids.create();
 }
 
-void Cylinders::append(const std::vector< Cylinder > & more_cylinders) {
-  data.reserve(data.size() + more_cylinders.size());
+uint32_t Cylinders::append(const std::vector< Cylinder > & more_cylinders) {
   data.insert(data.end(), more_cylinders.begin(), more_cylinders.end());  
-
   colors.insert(colors.end(), more_cylinders.size(), color);
+  cylinder_vbo.mark_dirty(data.size() - more_cylinders.size(), data.size());
+  color_vbo.mark_dirty(colors.size() - more_cylinders.size(), colors.size());
   dirty = true;
+  bin_appended(more_cylinders.size());
+  return ids.create(more_cylinders.size());
 }
 
-void Cylinders::append(const std::vector< Cylinder > & more_cylinders,
+uint32_t Cylinders::append(const std::vector< Cylinder > & more_cylinders,
                      const std::vector< rgbcolor > & more_colors) {
-  data.reserve(data.size() + more_cylinders.size());
   data.insert(data.end(), more_cylinders.begin(), more_cylinders.end());  
-
-  colors.reserve(colors.size() + more_colors.size());
   colors.insert(colors.end(), more_colors.begin(), more_colors.end());  
+  cylinder_vbo.mark_dirty(data.size() - more_cylinders.size(), data.size());
+  color_vbo.mark_dirty(colors.size() - more_colors.size(), colors.size());
+  dirty = true;
+  bin_appended(more_cylinders.size());
+  return ids.create(more_cylinders.size());
+}
+
+void Cylinders::update(uint32_t id, const Cylinder & cylinder) {
+  if (!ids.contains(id)) {
+    std::cout << "error: `Cylinder` id " << id << " does not exist" << std::endl;
+    return;
+  }
+  uint32_t i = ids.index(id);
+  data[i] = cylinder;
+  cylinder_vbo.mark_dirty(i);
+  dirty = true;
+
+  // the cylinder stays where it is in the index buffer, unless it went in or out of view
+  if (updated.size() < data.size() / 16) {
+    updated.push_back(i);
+  } else {
+    recheck_bins = true;
+  }
+}
+
+void Cylinders::set_color(uint32_t id, rgbcolor c) {
+  if (!ids.contains(id)) {
+    std::cout << "error: `Cylinder` id " << id << " does not exist" << std::endl;
+    return;
+  }
+  uint32_t i = ids.index(id);
+  colors[i] = c;
+  color_vbo.mark_dirty(i);
   dirty = true;
 }
 
+void Cylinders::remove(uint32_t id) {
+  if (!ids.contains(id)) {
+    std::cout << "error: `Cylinder` id " << id << " does not exist" << std::endl;
+    return;
+  }
+  uint32_t i = ids.remove(id);
+  swap_remove(data, i);
+  swap_remove(colors, i);
+  cylinder_vbo.mark_dirty(i);
+  color_vbo.mark_dirty(i);
+  dirty = true;
+
+  // the removed cylinder leaves its bin, and the last one, now at i, keeps its own
+  if (!bins_dirty && binned.bins.size() == data.size() + 1) {
+    binned.swap_remove(i);
+    for (uint32_t & u : updated) {
+      if (u == data.size()) u = i;
+    }
+  } else {
+    bins_dirty = true;
+  }
+}
+
+// Appended cylinders only need their own bins found, like updated ones, unless there are too
+// many to keep track of, while the rest stay where they are in the index buffer.
+void Cylinders::bin_appended(uint32_t count) {
+  uint32_t n = data.size();
+  if (bins_dirty || binned.bins.size() != n - count) return;
+  binned.append(count);
+  if (updated.size() + count < n / 16) {
+    for (uint32_t i = n - count; i < n; i++) updated.push_back(i);
+  } else {
+    recheck_bins = true;
+  }
+}
+
+void Cylinders::save(SceneWriter & scene, uint32_t tag) const {
+  scene.add(SectionType::CYLINDERS, data, tag);
+  scene.add(SectionType::CYLINDER_COLORS, colors, tag);
+}
+
+void Cylinders::load(const SceneFile & scene, uint32_t tag) {
+  clear();
+  data = scene.read< Cylinder >(SectionType::CYLINDERS, tag);
+  colors = scene.read< rgbcolor >(SectionType::CYLINDER_COLORS, tag);
+  if (colors.size() != data.size()) colors.assign(data.size(), color);
+  ids.create(data.size());
+  cylinder_vbo.mark_dirty(0, data.size());
+  color_vbo.mark_dirty(0, colors.size());
+}
+
+void Cylinders::set_lattice(const Lattice & l) {
+  lattice = l;
+  lattice_bounds = bounding_sphere(data);
+}
+
+void Cylinders::set_placements(const std::vector< Placement > & p) {
+  placements = p;
+  placement_vbo.mark_dirty(0, placements.size());
+}
+
+Cylinder * Cylinders::map_cylinders() {
+  return dynamic_cylinders.map(data.size());
+}
+
 void Cylinders::set_light(glm::vec3 direction, float intensity) {
   auto unit_direction = normalize(direction);
   light[0] = unit_direction[0];
@@ -156,35 +546,220 @@ void Cylinders::set_color(rgbcolor c) {
   color = c;
 }
 
-void Cylinders::draw(const Camera & camera) {
+// Lists the indices of the visible cylinders in binned_index_vbo, as in Spheres::update_bins():
+// they are only sorted again when a camera move takes some cylinder in or out of view, and edits
+// only move the cylinders concerned.
+void Cylinders::update_bins(const Camera & camera) {
 
-  program.use();
+  glm::mat4 proj = camera.matrix();
 
-  program.setUniform("light", light);
-  program.setUniform("proj", camera.matrix());
-  glCheckError(__FILE__, __LINE__);
+  uint32_t n = data.size();
+  bool moved_camera = (proj != binned_camera);
+  bool changed = bins_dirty || binned.bins.size() != n;
+
+  if (!changed && !moved_camera && !recheck_bins && updated.empty() && binned.written.empty()) {
+    num_culled = n - binned.permutation.size();
+    return;
+  }
+
+  Frustum frustum(proj);
+  auto bin_of = [&](uint32_t i) -> uint8_t {
+    return frustum.intersects(data[i]) ? 0 : culled_bin;
+  };
+
+  threadpool & pool = worker_threads();
+  if (changed || moved_camera || recheck_bins) {
+    std::vector< uint8_t > & bins = binned.bins;
+    bins.resize(n, culled_bin);
+    std::atomic< bool > any_changed(false);
+    pool.parallel_for_range(n, primitive_grain, [&](uint64_t begin, uint64_t end) {
+      bool differs = false;
+      for (uint32_t i = begin; i < end; i++) {
+        uint8_t bin = bin_of(i);
+        differs |= (bin != bins[i]);
+        bins[i] = bin;
+      }
+      if (differs) any_changed.store(true, std::memory_order_relaxed);
+    });
+    changed |= any_changed.load(std::memory_order_relaxed);
+  } else {
+    for (uint32_t i : updated) binned.set_bin(i, bin_of(i));
+  }
+
+  updated.clear();
+  recheck_bins = false;
+  bins_dirty = false;
+  binned_camera = proj;
+
+  if (changed) {
+    binned.sort(pool, 1);
+    binned_index_vbo.mark_dirty(0, binned.permutation.size());
+  }
+  for (uint32_t position : binned.written) binned_index_vbo.mark_dirty(position);
+  binned.written.clear();
+  if (binned_index_vbo.dirty()) binned_index_vbo.upload(binned.permutation);
+  num_culled = n - binned.permutation.size();
+
+}
+
+// point the per-instance attributes of the bound vao at instance `first` of the given buffers,
+// where the cylinder data may start at some byte offset `cylinder_base` into its buffer
+static void bind_instances(ShaderProgram & program, GLuint cylinder_buffer, GLuint color_buffer,
+                           uint32_t first, GLintptr cylinder_base = 0) {
+  glBindBuffer(GL_ARRAY_BUFFER, cylinder_buffer);
+  program.setAttribute("cyl_start", 4, 2 * sizeof(glm::vec4), cylinder_base + first * sizeof(Cylinder));
+  program.setAttribute("cyl_end", 4, 2 * sizeof(glm::vec4), cylinder_base + first * sizeof(Cylinder) + 16);
+
+  glBindBuffer(GL_ARRAY_BUFFER, color_buffer);
+  program.setAttribute("rgba", 4, sizeof(rgbcolor), first * sizeof(rgbcolor), GL_TRUE, GL_UNSIGNED_BYTE);
+}
+
+// draw the cylinders listed in an index buffer instead, as in spheres.cpp
+static void bind_indexed_instances(ShaderProgram & program, GLuint index_buffer) {
+  for (auto name : {"cyl_start", "cyl_end", "rgba"}) glDisableVertexAttribArray(program.attribute(name));
+
+  GLint location = program.attribute("binned_index");
+  glBindBuffer(GL_ARRAY_BUFFER, index_buffer);
+  glEnableVertexAttribArray(location);
+  glVertexAttribIPointer(location, 1, GL_UNSIGNED_INT, sizeof(uint32_t), (void*)0);
+  glVertexAttribDivisor(location, 1);
+
+  program.setUniform("indexed", 1);
+  program.setUniform("cylinder_texels", 0);
+  program.setUniform("color_texels", 1);
+}
+
+static void unbind_indexed_instances(ShaderProgram & program) {
+  glDisableVertexAttribArray(program.attribute("binned_index"));
+  program.setUniform("indexed", 0);
+}
+
+void Cylinders::draw(const Camera & camera) {
 
-  glBindVertexArray(vao);
   if (dirty) {
     if (colors.size() != data.size()) {
       std::cout << "error: `Cylinder` buffer sizes are incompatible" << std::endl;
     }
 
-    glBindBuffer(GL_ARRAY_BUFFER, cylinder_vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(Cylinder) * data.size(), &data[0], GL_STATIC_DRAW);
-
-    glBindBuffer(GL_ARRAY_BUFFER, color_vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(rgbcolor) * colors.size(), &colors[0], GL_STATIC_DRAW);
+    if (lattice.num_cells() > 0 && cylinder_vbo.dirty()) lattice_bounds = bounding_sphere(data);
+    cylinder_vbo.upload(data);
+    color_vbo.upload(colors);
     glCheckError(__FILE__, __LINE__);
     dirty = false;
   }
 
+  if (placement_vbo.dirty()) placement_vbo.upload(placements);
+  bool placed = !placements.empty();
+  bool periodic = lattice.num_cells() > 0;
+
+  // in dynamic mode, draw the cylinders most recently written to map_cylinders()
+  if (dynamic) dynamic_cylinders.commit();
+  bool streaming = dynamic && dynamic_cylinders.ready();
+
+  GLuint cylinder_buffer = cylinder_vbo.handle;
+  GLuint color_buffer = color_vbo.handle;
+  GLintptr cylinder_base = 0;
+  uint32_t count = data.size();
+  bool indexed = false;
+  if (streaming) {
+    num_culled = 0;
+    cylinder_buffer = dynamic_cylinders.handle;
+    cylinder_base = dynamic_cylinders.offset();
+    count = std::min(dynamic_cylinders.count, colors.size());
+  } else if (culling && !placed && !periodic) {
+    update_bins(camera);
+    indexed = true;
+    count = binned.permutation.size();
+    cylinder_texels.bind(0, cylinder_vbo.handle, GL_RGBA32F);
+    color_texels.bind(1, color_vbo.handle, GL_RGBA8);
+  } else {
+    num_culled = 0;
+  }
+
+  // only the cells of the lattice in view are drawn, unless the cylinders' bounds are unknown
+  if (periodic) {
+    if (culling && !streaming) {
+      cell_blocks = visible_cells(Frustum(camera.matrix()), lattice, lattice_bounds);
+    } else {
+      cell_blocks = {CellBlock{glm::uvec3(0), lattice.counts}};
+    }
+    uint64_t visible = 0;
+    for (auto & block : cell_blocks) visible += uint64_t(block.span.x) * block.span.y * block.span.z;
+    num_culled = std::min< uint64_t >((lattice.num_cells() - visible) * count, UINT32_MAX);
+  }
+
   glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-  glDisable(GL_CULL_FACE);
-  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, cylinder_vertices.size(), data.size());
-  glCheckError(__FILE__, __LINE__);
 
-  program.unuse();
+  if (mode == RenderMode::IMPOSTOR) {
+
+    impostor_program.use();
+
+    impostor_program.setUniform("light", light);
+    impostor_program.setUniform("proj", camera.matrix());
+    impostor_program.setUniform("camera_position", camera.pos());
+    impostor_program.setUniform("camera_direction", camera.direction());
+    impostor_program.setUniform("perspective", int(camera.is_perspective()));
+    glCheckError(__FILE__, __LINE__);
+
+    // only the back faces of each bounding box are rasterized, so every
+    // covered pixel casts exactly one ray (even with the camera inside the box)
+    glBindVertexArray(impostor_vao);
+    glEnable(GL_CULL_FACE);
+    glCullFace(GL_FRONT);
+    if (periodic || placed) {
+      auto bind = [&](uint32_t first) { bind_instances(impostor_program, cylinder_buffer, color_buffer, first, cylinder_base); };
+      auto draw = [&](uint32_t n) { glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 14, n); };
+      if (periodic) {
+        draw_lattice(impostor_program, {"cyl_start", "cyl_end", "rgba"}, lattice, cell_blocks, count, bind, draw);
+      } else {
+        draw_placed(impostor_program, {"cyl_start", "cyl_end", "rgba"}, placement_texels, placement_vbo.handle, placements.size(), count, bind, draw);
+      }
+    } else if (indexed) {
+      bind_indexed_instances(impostor_program, binned_index_vbo.handle);
+      if (count > 0) glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 14, count);
+      unbind_indexed_instances(impostor_program);
+    } else {
+      bind_instances(impostor_program, cylinder_buffer, color_buffer, 0, cylinder_base);
+      glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 14, count);
+    }
+    glCullFace(GL_BACK);
+    glCheckError(__FILE__, __LINE__);
+
+    impostor_program.unuse();
+
+  } else {
+
+    program.use();
+
+    program.setUniform("light", light);
+    program.setUniform("proj", camera.matrix());
+    glCheckError(__FILE__, __LINE__);
+
+    glBindVertexArray(vao);
+    glDisable(GL_CULL_FACE);
+    if (periodic || placed) {
+      auto bind = [&](uint32_t first) { bind_instances(program, cylinder_buffer, color_buffer, first, cylinder_base); };
+      auto draw = [&](uint32_t n) { glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, cylinder_vertices.size(), n); };
+      if (periodic) {
+        draw_lattice(program, {"cyl_start", "cyl_end", "rgba"}, lattice, cell_blocks, count, bind, draw);
+      } else {
+        draw_placed(program, {"cyl_start", "cyl_end", "rgba"}, placement_texels, placement_vbo.handle, placements.size(), count, bind, draw);
+      }
+    } else if (indexed) {
+      bind_indexed_instances(program, binned_index_vbo.handle);
+      if (count > 0) glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, cylinder_vertices.size(), count);
+      unbind_indexed_instances(program);
+    } else {
+      bind_instances(program, cylinder_buffer, color_buffer, 0, cylinder_base);
+      glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, cylinder_vertices.size(), count);
+    }
+    glCheckError(__FILE__, __LINE__);
+
+    program.unuse();
+
+  }
+
+  if (streaming) dynamic_cylinders.fence();
 
 }
 
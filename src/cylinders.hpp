@@ -8,6 +8,13 @@
 #include "Shader.hpp"
 #include "Camera.hpp"
 #include "rgbcolor.hpp"
+#include "dynamic_buffer.hpp"
+#include "buffer_texture.hpp"
+#include "scene_file.hpp"
+#include "stream_buffer.hpp"
+#include "instance_ids.hpp"
+#include "binned_indices.hpp"
+#include "placements.hpp"
 
 #include "spheres.hpp"
 
@@ -23,28 +30,104 @@ struct Cylinders {
   void draw(const Camera & camera);
 
   void clear();
-  void append(const Cylinder & cylinder);
-  void append(const std::vector< Cylinder > & more_cylinders);
-  void append(const std::vector< Cylinder > & more_spheres, const std::vector < rgbcolor > & more_colors);
+
+  // append() returns a stable id for the new cylinder, which stays valid until it is
+  // removed. Appending a batch returns the first of its consecutive, new ids. Only the
+  // new or changed cylinders are sent to the GPU, as described in Spheres.
+  uint32_t append(const Cylinder & cylinder);
+  uint32_t append(const std::vector< Cylinder > & more_cylinders);
+  uint32_t append(const std::vector< Cylinder > & more_spheres, const std::vector < rgbcolor > & more_colors);
+
+  // modify or remove a single cylinder, only sending the changed instances to the GPU,
+  // and only changing the index buffer of visible ones if it went in or out of view
+  void update(uint32_t id, const Cylinder & cylinder);
+  void set_color(uint32_t id, rgbcolor c);
+  void remove(uint32_t id);
 
   void set_color(rgbcolor c);
   void set_light(glm::vec3 direction, float intensity);
 
+  void set_render_mode(RenderMode m) { mode = m; }
+
+  // when enabled, cylinders outside of the camera's view frustum are not drawn
+  void set_frustum_culling(bool enable) { bins_dirty |= (enable != culling); culling = enable; }
+
+  // In dynamic mode, the cylinders are streamed to the GPU through a persistently
+  // mapped ring buffer (see Spheres::set_dynamic). Each frame, write all size()
+  // cylinders to the pointer returned by map_cylinders() before calling draw().
+  void set_dynamic(bool enable) { bins_dirty |= (enable != dynamic); dynamic = enable; }
+  Cylinder * map_cylinders();
+
+  // draw all of the cylinders once per placement, as in Spheres::set_placements
+  void set_placements(const std::vector< Placement > & p);
+
+  // draw the cylinders once per cell of a lattice, as in Spheres::set_lattice
+  void set_lattice(const Lattice & l);
+
+  // Write the cylinders and their colors to a scene file, or replace them with the ones in it. The tag
+  // tells apart several Cylinders objects saved to the same file.
+  void save(SceneWriter & scene, uint32_t tag = 0) const;
+  void load(const SceneFile & scene, uint32_t tag = 0);
+
   auto size() { return data.size(); }
 
+  const std::vector< Cylinder > & primitives() const { return data; }
+
+  // stable id of the cylinder currently stored at `index`
+  uint32_t id(uint32_t index) const { return ids.id_of[index]; }
+
+  // how many cylinders were skipped by frustum culling in the last call to draw()
+  auto culled() { return num_culled; }
+
  private:
+  void update_bins(const Camera & camera);
+  void bin_appended(uint32_t count);
+
   bool dirty;
   GLuint vao;
-  GLuint color_vbo;
+  DynamicBuffer< rgbcolor > color_vbo;
   GLuint instance_vbo; 
-  GLuint cylinder_vbo;
+  DynamicBuffer< Cylinder > cylinder_vbo;
+
+  GLuint impostor_vao;
+  GLuint impostor_vbo;
+
+  bool dynamic;
+  StreamBuffer< Cylinder > dynamic_cylinders;
+
+  std::vector< Placement > placements;
+  DynamicBuffer< Placement > placement_vbo;
+  BufferTexture placement_texels;
+
+  Lattice lattice;
+  Sphere lattice_bounds;
+  std::vector< CellBlock > cell_blocks;
+
+  RenderMode mode;
+
+  bool culling;
+  bool bins_dirty;
+  uint32_t num_culled;
+  glm::mat4 binned_camera;
+  DynamicBuffer< uint32_t > binned_index_vbo;
+  BufferTexture cylinder_texels;
+  BufferTexture color_texels;
 
   ShaderProgram program;
+  ShaderProgram impostor_program;
 
   rgbcolor color;
 
   std::vector< Cylinder > data;
   std::vector< rgbcolor > colors;
+  InstanceIDs ids;
+
+  // whether each cylinder was culled, and the indices of the visible ones
+  BinnedIndices binned;
+
+  // cylinders changed by update() since the last binning, as in Spheres
+  std::vector< uint32_t > updated;
+  bool recheck_bins;
 
   glm::vec4 light;
 
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include <GL/glew.h>
+
+#include "misc/heap_array.hpp"
+
+namespace Graphics {
+
+// A GL array buffer that mirrors a std::vector< T > on the CPU.
+//
+// Modified elements are recorded as a short, sorted list of disjoint dirty
+// ranges, and upload() sends each of them with its own glBufferSubData, so
+// editing the first and last elements doesn't resend everything in between.
+// The GPU storage grows geometrically, so appending a few elements to a large
+// buffer doesn't resend everything either.
+template < typename T >
+struct DynamicBuffer {
+
+  // the half-open range of elements [begin, end)
+  struct Range {
+    size_t begin;
+    size_t end;
+  };
+
+  // past this many ranges, the two closest are merged, so scattered edits
+  // cost at most this many calls per upload
+  static constexpr size_t max_dirty_ranges = 16;
+
+  DynamicBuffer() : handle(0), capacity(0) {}
+
+  // requires a current GL context, so it is called by the owner's constructor
+  void generate() { glGenBuffers(1, &handle); }
+
+  void mark_dirty(size_t begin, size_t end) {
+    if (begin >= end) return;
+
+    // the ranges that overlap or touch [begin, end) are merged into it
+    auto first = std::lower_bound(dirty_ranges.begin(), dirty_ranges.end(), begin,
+                                  [](const Range & r, size_t x) { return r.end < x; });
+    auto last = std::upper_bound(first, dirty_ranges.end(), end,
+                                 [](size_t x, const Range & r) { return x < r.begin; });
+    if (first != last) {
+      begin = std::min(begin, first->begin);
+      end = std::max(end, (last - 1)->end);
+      first = dirty_ranges.erase(first, last);
+    }
+    dirty_ranges.insert(first, Range{begin, end});
+
+    if (dirty_ranges.size() > max_dirty_ranges) {
+      size_t closest = 0;
+      for (size_t i = 1; i + 1 < dirty_ranges.size(); i++) {
+        size_t gap = dirty_ranges[i + 1].begin - dirty_ranges[i].end;
+        if (gap < dirty_ranges[closest + 1].begin - dirty_ranges[closest].end) closest = i;
+      }
+      dirty_ranges[closest].end = dirty_ranges[closest + 1].end;
+      dirty_ranges.erase(dirty_ranges.begin() + closest + 1);
+    }
+  }
+
+  void mark_dirty(size_t i) { mark_dirty(i, i + 1); }
+
+  bool dirty() const { return !dirty_ranges.empty(); }
+
+  void upload(const std::vector< T > & data) {
+    glBindBuffer(GL_ARRAY_BUFFER, handle);
+
+    if (data.size() > capacity) {
+      capacity = std::max(data.size(), 2 * capacity);
+      glBufferData(GL_ARRAY_BUFFER, sizeof(T) * capacity, nullptr, GL_DYNAMIC_DRAW);
+      dirty_ranges.assign(1, Range{0, data.size()});
+    }
+
+    for (const Range & r : dirty_ranges) {
+      size_t end = std::min(r.end, data.size());
+      if (r.begin < end) {
+        glBufferSubData(GL_ARRAY_BUFFER, sizeof(T) * r.begin, sizeof(T) * (end - r.begin), &data[r.begin]);
+      }
+    }
+
+    dirty_ranges.clear();
+  }
+
+  // Replace the contents with the elements of a view, in row-major order.
+  // Contiguous views are sent as they are, and strided ones (e.g. a slice
+  // of a 3D field) are gathered straight into the mapped GL buffer.
+  template < typename U, size_t d >
+  void upload(const view< U, d > & data) {
+    static_assert(std::is_same_v< std::remove_const_t< U >, T >, "view has the wrong element type");
+
+    glBindBuffer(GL_ARRAY_BUFFER, handle);
+
+    size_t n = data.size();
+    if (n > capacity) {
+      capacity = std::max(n, 2 * capacity);
+      glBufferData(GL_ARRAY_BUFFER, sizeof(T) * capacity, nullptr, GL_DYNAMIC_DRAW);
+    }
+
+    if (n > 0 && data.contiguous()) {
+      glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(T) * n, data.data());
+    } else if (n > 0) {
+      GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT;
+      T * ptr = (T *) glMapBufferRange(GL_ARRAY_BUFFER, 0, sizeof(T) * n, access);
+      if (ptr != nullptr) {
+        data.copy_to(ptr);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+      }
+    }
+
+    dirty_ranges.clear();
+  }
+
+  GLuint handle;
+
+  // number of elements the GL buffer can hold
+  size_t capacity;
+
+  // the elements that have changed since the last upload, sorted by begin,
+  // with a gap between each range and the next
+  std::vector< Range > dirty_ranges;
+
+};
+
+}
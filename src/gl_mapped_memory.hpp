@@ -0,0 +1,136 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <iostream>
+
+#include <GL/glew.h>
+
+#include "misc/heap_array.hpp"
+
+namespace femto {
+
+// Storage for buffer< T, MemorySpace::GL_MAPPED >, where every allocation is
+// its own GL buffer object. The elements can then be used directly as vertex
+// attributes (see gl_handle), without keeping a std::vector and copying it
+// with glBufferData.
+//
+// With GL_ARB_buffer_storage (GL 4.4+), the GL buffer is mapped once with
+// GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT, so writes to the elements go
+// straight to GPU-visible memory. The GPU may still be reading from it, so
+// don't overwrite elements used by draw calls that haven't finished (for
+// data rewritten every frame, use Graphics::StreamBuffer instead).
+//
+// Without buffer storage (e.g. a GL 4.1 context), the elements are ordinary
+// CPU memory, and gl_flush copies the modified range into the GL buffer.
+//
+// Allocating or freeing requires a current GL context.
+struct gl_mapped_allocator {
+
+  static void* allocate(size_t bytes) {
+    if (bytes == 0) return nullptr;
+
+    Allocation a{0, bytes, false};
+    glGenBuffers(1, &a.handle);
+    glBindBuffer(GL_ARRAY_BUFFER, a.handle);
+
+    void* ptr = nullptr;
+    if (GLEW_ARB_buffer_storage) {
+      GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glBufferStorage(GL_ARRAY_BUFFER, bytes, nullptr, flags);
+      ptr = glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, flags);
+      a.persistent = (ptr != nullptr);
+      if (ptr == nullptr) {
+        std::cout << "failed to map GL buffer of " << bytes << " bytes" << std::endl;
+        glDeleteBuffers(1, &a.handle);
+        return nullptr;
+      }
+    } else {
+      glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, GL_DYNAMIC_DRAW);
+      ptr = aligned_malloc(bytes, 64);
+    }
+
+    std::lock_guard< std::mutex > lock(mutex());
+    allocations()[ptr] = a;
+    return ptr;
+  }
+
+  static void deallocate(void* ptr) {
+    if (ptr == nullptr) return;
+
+    Allocation a;
+    {
+      std::lock_guard< std::mutex > lock(mutex());
+      auto it = allocations().find(ptr);
+      if (it == allocations().end()) return;
+      a = it->second;
+      allocations().erase(it);
+    }
+
+    if (a.persistent) {
+      glBindBuffer(GL_ARRAY_BUFFER, a.handle);
+      glUnmapBuffer(GL_ARRAY_BUFFER);
+    } else {
+      aligned_free(ptr);
+    }
+    glDeleteBuffers(1, &a.handle);
+  }
+
+  // the GL buffer object backing the allocation that starts at ptr, or 0
+  static GLuint handle(const void* ptr) {
+    std::lock_guard< std::mutex > lock(mutex());
+    auto it = allocations().find(ptr);
+    return (it != allocations().end()) ? it->second.handle : 0;
+  }
+
+  // make CPU writes to bytes [offset, offset + count) of the allocation
+  // visible to GL, which only does anything without persistent mapping
+  static void flush(const void* ptr, size_t offset, size_t count) {
+    Allocation a;
+    {
+      std::lock_guard< std::mutex > lock(mutex());
+      auto it = allocations().find(ptr);
+      if (it == allocations().end()) return;
+      a = it->second;
+    }
+
+    if (a.persistent || count == 0) return;
+    glBindBuffer(GL_ARRAY_BUFFER, a.handle);
+    glBufferSubData(GL_ARRAY_BUFFER, offset, count, (const char*)ptr + offset);
+  }
+
+ private:
+  struct Allocation {
+    GLuint handle;
+    size_t bytes;
+    bool persistent;
+  };
+
+  static std::map< const void*, Allocation >& allocations() {
+    static std::map< const void*, Allocation > a;
+    return a;
+  }
+
+  static std::mutex& mutex() {
+    static std::mutex m;
+    return m;
+  }
+};
+
+template <>
+struct default_allocator<MemorySpace::GL_MAPPED> : gl_mapped_allocator {};
+
+// the GL buffer object holding the elements, e.g. for glVertexAttribPointer
+template <class T, class Allocator>
+GLuint gl_handle(const buffer<T, MemorySpace::GL_MAPPED, Allocator>& b) {
+  return Allocator::handle(b.begin());
+}
+
+// make CPU writes to the elements [begin, end) visible to GL
+template <class T, class Allocator>
+void gl_flush(const buffer<T, MemorySpace::GL_MAPPED, Allocator>& b, size_t begin = 0, size_t end = size_t(-1)) {
+  end = std::min(end, b.size());
+  if (begin < end) Allocator::flush(b.begin(), sizeof(T) * begin, sizeof(T) * (end - begin));
+}
+
+}  // namespace femto
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+namespace Graphics {
+
+// Stable ids for the instances in a dense array.
+//
+// Removing an instance moves the last one into its slot, so the CPU and GPU
+// arrays stay dense, and the ids of removed instances are reused later on.
+struct InstanceIDs {
+
+  static constexpr uint32_t invalid = 0xFFFFFFFF;
+
+  // id for an instance appended at the end of the array
+  uint32_t create() {
+    uint32_t id;
+    if (free_ids.empty()) {
+      id = index_of.size();
+      index_of.push_back(invalid);
+    } else {
+      id = free_ids.back();
+      free_ids.pop_back();
+    }
+    index_of[id] = id_of.size();
+    id_of.push_back(id);
+    return id;
+  }
+
+  // consecutive ids {first, first + 1, ..., first + n - 1} for n appended instances
+  uint32_t create(uint32_t n) {
+    uint32_t first = index_of.size();
+    for (uint32_t i = 0; i < n; i++) {
+      index_of.push_back(id_of.size());
+      id_of.push_back(first + i);
+    }
+    return first;
+  }
+
+  bool contains(uint32_t id) const {
+    return id < index_of.size() && index_of[id] != invalid;
+  }
+
+  uint32_t index(uint32_t id) const { return index_of[id]; }
+
+  // returns the slot that held the removed instance, which the
+  // caller fills by moving its last element there
+  uint32_t remove(uint32_t id) {
+    uint32_t i = index_of[id];
+    uint32_t moved = id_of.back();
+    id_of[i] = moved;
+    index_of[moved] = i;
+    id_of.pop_back();
+    index_of[id] = invalid;
+    free_ids.push_back(id);
+    return i;
+  }
+
+  void clear() {
+    index_of.clear();
+    id_of.clear();
+    free_ids.clear();
+  }
+
+  std::vector< uint32_t > index_of; // id -> index
+  std::vector< uint32_t > id_of;    // index -> id
+  std::vector< uint32_t > free_ids;
+
+};
+
+// move the last element of v into slot i and shrink it by one
+template < typename T >
+void swap_remove(std::vector< T > & v, uint32_t i) {
+  v[i] = v.back();
+  v.pop_back();
+}
+
+}
@@ -1,42 +1,297 @@
 #pragma once
 
-#include <fstream>
-#include <iostream>
+#include <future>
 #include <string>
 #include <vector>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+#include "mapped_file.hpp"
+
+// Files written by write_binary / binary_writer start with this header,
+// followed by `count` elements of `element_size` bytes each.
+struct binary_header {
+  static constexpr char expected_magic[4] = {'F', 'B', 'I', 'N'};
+  static constexpr uint32_t current_version = 1;
+
+  // written in the byte order of the machine that wrote the file,
+  // so it reads back differently on a machine with the other byte order
+  static constexpr uint32_t byte_order_mark = 0x01020304;
+
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t element_size;
+  uint64_t count;
+  uint64_t checksum;  // femto::checksum of the elements
+
+  bool valid_magic() const { return std::memcmp(magic, expected_magic, 4) == 0; }
+};
+
+static_assert(sizeof(binary_header) == 32, "the elements should start 32 byte aligned");
+
+namespace femto {
+
+// 64 bit FNV-1a over 8 byte words (and then over any remaining bytes),
+// which keeps up with reading from disk
+struct checksum {
+  checksum() : hash(14695981039346656037ull), tail_size(0) {}
+
+  void update(const void* data, size_t bytes) {
+    const unsigned char* ptr = (const unsigned char*)data;
+
+    // complete a word started by the previous update
+    while (tail_size > 0 && tail_size < 8 && bytes > 0) {
+      tail[tail_size++] = *ptr++;
+      bytes--;
+    }
+    if (tail_size == 8) {
+      mix(tail);
+      tail_size = 0;
+    }
+
+    for (; bytes >= 8; ptr += 8, bytes -= 8) mix(ptr);
+
+    std::memcpy(tail + tail_size, ptr, bytes);
+    tail_size += bytes;
+  }
+
+  uint64_t value() const {
+    uint64_t h = hash;
+    for (size_t i = 0; i < tail_size; i++) h = (h ^ tail[i]) * prime;
+    return h;
+  }
+
+ private:
+  static constexpr uint64_t prime = 1099511628211ull;
+
+  void mix(const unsigned char* word) {
+    uint64_t w;
+    std::memcpy(&w, word, 8);
+    hash = (hash ^ w) * prime;
+  }
+
+  uint64_t hash;
+  unsigned char tail[8];
+  size_t tail_size;
+};
 
+}  // namespace femto
+
+// Writes a file in chunks, so the elements don't all have to be in memory at
+// once. The header is completed by close() (or the destructor).
 template <typename T>
-std::vector<T> read_binary(std::string filename) {
-  std::vector<T> buffer;
+struct binary_writer {
+  binary_writer(std::string filename) : count(0), outfile(filename, std::ios::binary) {
+    if (!outfile) {
+      std::cout << "could not open file for writing: " << filename << std::endl;
+      return;
+    }
+    binary_header header = make_header();
+    outfile.write((const char*)&header, sizeof(header));
+  }
+
+  ~binary_writer() { close(); }
+
+  explicit operator bool() const { return bool(outfile); }
+
+  void write(const T* data, size_t n) {
+    if (!outfile || n == 0) return;
+    outfile.write((const char*)data, sizeof(T) * n);
+    hash.update(data, sizeof(T) * n);
+    count += n;
+  }
+
+  void write(const std::vector<T>& data) { write(data.data(), data.size()); }
+
+  void close() {
+    if (!outfile.is_open()) return;
+    binary_header header = make_header();
+    outfile.seekp(0);
+    outfile.write((const char*)&header, sizeof(header));
+    outfile.close();
+  }
+
+ private:
+  binary_header make_header() const {
+    binary_header header;
+    std::memcpy(header.magic, binary_header::expected_magic, 4);
+    header.version = binary_header::current_version;
+    header.byte_order = binary_header::byte_order_mark;
+    header.element_size = sizeof(T);
+    header.count = count;
+    header.checksum = hash.value();
+    return header;
+  }
 
-  std::ifstream infile(filename, std::ios::binary);
+  uint64_t count;
+  femto::checksum hash;
+  std::ofstream outfile;
+};
+
+// Reads a file written by binary_writer in chunks. While the caller works on
+// one chunk, the next one is read (and checksummed) on a background thread.
+//
+//   binary_reader< float > reader(filename);
+//   const float * chunk;
+//   while (size_t n = reader.next(chunk)) { ... }
+//   if (!reader.checksum_ok()) { ... }
+//
+template <typename T>
+struct binary_reader {
+  binary_reader(std::string filename, size_t chunk_size = (size_t(16) << 20) / sizeof(T))
+      : remaining(0), current(0), valid(false), filename(filename), infile(filename, std::ios::binary) {
+    if (!infile) {
+      std::cout << "file not found: " << filename << std::endl;
+      return;
+    }
+
+    infile.read((char*)&header, sizeof(header));
+    if (!infile || !valid_header(header, filename)) return;
 
-  if (infile) {
-    // std::cout << "file found: " << filename << std::endl;
     infile.seekg(0, std::ios::end);
-    std::streampos filesize = infile.tellg();
-    infile.seekg(0, std::ios::beg);
+    uint64_t available = (uint64_t(infile.tellg()) - sizeof(header)) / sizeof(T);
+    infile.seekg(sizeof(header));
+    if (available < header.count) {
+      std::cout << "file is truncated: " << filename << " has " << available << " of "
+                << header.count << " elements" << std::endl;
+      return;
+    }
 
-    buffer = std::vector<T>(filesize / sizeof(T));
-    infile.read((char*)&buffer[0], filesize);
-  } else {
-    std::cout << "file not found: " << filename << std::endl;
+    valid = true;
+    remaining = header.count;
+    chunk_size = std::max<size_t>(chunk_size, 1);
+    for (auto& chunk : chunks) chunk.resize(std::min<uint64_t>(chunk_size, header.count));
+    read_ahead();
   }
 
-  infile.close();
+  ~binary_reader() {
+    if (pending.valid()) pending.wait();
+  }
 
-  return buffer;
-}
+  explicit operator bool() const { return valid; }
+
+  // total number of elements in the file
+  uint64_t size() const { return valid ? header.count : 0; }
+
+  // Points chunk at the next elements, which stay valid until the following
+  // call, and returns how many there are (0 once all have been read).
+  size_t next(const T*& chunk) {
+    if (!pending.valid()) return 0;
+    size_t n = pending.get();
+    chunk = chunks[current].data();
+    current = 1 - current;
+    read_ahead();
+    return n;
+  }
+
+  // once every chunk has been read, whether they matched the header's checksum
+  bool checksum_ok() const { return valid && remaining == 0 && !pending.valid() && hash.value() == header.checksum; }
 
+  // checks the header against T, printing what's wrong with it
+  static bool valid_header(const binary_header& header, const std::string& filename) {
+    if (!header.valid_magic()) {
+      std::cout << "not a binary_io file: " << filename << std::endl;
+      return false;
+    }
+    if (header.byte_order != binary_header::byte_order_mark) {
+      std::cout << "file was written with a different byte order: " << filename << std::endl;
+      return false;
+    }
+    if (header.element_size != sizeof(T)) {
+      std::cout << "file has " << header.element_size << " byte elements, but expected "
+                << sizeof(T) << ": " << filename << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  // start reading into chunks[current], which next() hands out after the one it's returning now
+  void read_ahead() {
+    if (remaining == 0) return;
+    size_t n = std::min<uint64_t>(remaining, chunks[current].size());
+    remaining -= n;
+    T* destination = chunks[current].data();
+    pending = std::async(std::launch::async, [this, destination, n]() {
+      infile.read((char*)destination, sizeof(T) * n);
+      hash.update(destination, sizeof(T) * n);
+      return n;
+    });
+  }
+
+  binary_header header;
+  uint64_t remaining;  // elements not yet requested from the file
+  int current;
+  bool valid;
+
+  std::string filename;
+  std::ifstream infile;
+  femto::checksum hash;
+  std::vector<T> chunks[2];
+  std::future<size_t> pending;
+};
+
+// Reads a whole file into memory. Files are mapped rather than read through a
+// stream, so the elements are only copied once, straight from the page cache.
+//
+// Files without a header (written by older versions of write_binary) are
+// read as raw elements.
 template <typename T>
-void write_binary(const std::vector<T>& buffer, std::string filename) {
-  std::ofstream outfile(filename, std::ios::binary);
+std::vector<T> read_binary(std::string filename) {
+  std::vector<T> buffer;
 
-  if (outfile) {
-    outfile.write((char*)&buffer[0], sizeof(T) * buffer.size());
-  } else {
+  femto::mapped_file file(filename, femto::MapAccess::READ_ONLY, femto::MapAdvice::SEQUENTIAL);
+  if (!file) {
     std::cout << "file not found: " << filename << std::endl;
+    return buffer;
+  }
+
+  const binary_header* header = (const binary_header*)file.data();
+  if (file.size() < sizeof(binary_header) || !header->valid_magic()) {
+    size_t n = file.size() / sizeof(T);
+    if (file.size() % sizeof(T) != 0) {
+      std::cout << "file ends with a partial element: " << filename << std::endl;
+    }
+    buffer.resize(n);
+    if (n > 0) std::memcpy(buffer.data(), file.data(), sizeof(T) * n);
+    return buffer;
+  }
+
+  if (!binary_reader<T>::valid_header(*header, filename)) return buffer;
+
+  uint64_t available = (file.size() - sizeof(binary_header)) / sizeof(T);
+  if (available < header->count) {
+    std::cout << "file is truncated: " << filename << " has " << available << " of "
+              << header->count << " elements" << std::endl;
+    return buffer;
+  }
+
+  // copy and checksum a few MB at a time, while they're still in cache
+  const char* payload = file.data() + sizeof(binary_header);
+  size_t bytes = sizeof(T) * header->count;
+  size_t block = size_t(4) << 20;
+  femto::checksum hash;
+  buffer.resize(header->count);
+  for (size_t offset = 0; offset < bytes; offset += block) {
+    size_t n = std::min(block, bytes - offset);
+    std::memcpy((char*)buffer.data() + offset, payload + offset, n);
+    hash.update(payload + offset, n);
   }
 
-  outfile.close();
-}
\ No newline at end of file
+  if (hash.value() != header->checksum) {
+    std::cout << "checksum mismatch, the file is corrupted: " << filename << std::endl;
+    buffer.clear();
+  }
+
+  return buffer;
+}
+
+template <typename T>
+void write_binary(const std::vector<T>& buffer, std::string filename) {
+  binary_writer<T> writer(filename);
+  writer.write(buffer);
+}
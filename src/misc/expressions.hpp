@@ -0,0 +1,374 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <cstddef>
+#include <iostream>
+#include <algorithm>
+#include <type_traits>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+// some versions of gcc warn about the intentionally undefined
+// registers inside the AVX-512 intrinsics, when they're inlined
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#else
+#include <immintrin.h>
+#endif
+#endif
+
+#include "macros.hpp"
+
+template <class T, MemorySpace memory, class Allocator>
+struct buffer;
+
+template <typename T>
+struct Iterator;
+
+// Lazily evaluated element-wise arithmetic on CPU arrays, e.g.
+//
+//   heap_array<float, 3> normalized(n0, n1, n2);
+//   normalized = femto::clamp((field - lo) * (1.0f / (hi - lo)), 0.0f, 1.0f);
+//
+// builds a tree of small expression objects that is only evaluated on
+// assignment, in a single pass over memory. The inner loop works on whole
+// SIMD registers (AVX-512 or AVX2 when compiled with them, e.g. -march=native)
+// with a scalar loop for the remaining elements.
+//
+// Operands are heap_arrays, buffers, Iterators (rows of a 2D heap_array),
+// std::vectors, other expressions and scalars. Array operands must have the
+// same element type and size, and expressions only refer to them, so they
+// shouldn't outlive the arrays they were made from.
+//
+// The operators are found by argument-dependent lookup, through femto's
+// expression types and the array_operand base of buffer and Iterator, so they
+// don't apply to types that don't opt in. An expression of std::vectors alone
+// needs femto::operator+ etc. (or using namespace femto) in scope.
+namespace femto {
+
+// empty base of the array types outside of this namespace, so
+// that argument-dependent lookup finds the operators below
+struct array_operand {};
+
+// A register of `width` elements of type T, with unaligned loads and stores.
+// The primary template is the scalar fallback.
+template <class T>
+struct simd {
+  static constexpr size_t width = 1;
+  static simd load(const T* ptr) { return simd{*ptr}; }
+  static simd broadcast(T x) { return simd{x}; }
+  void store(T* ptr) const { *ptr = value; }
+
+  friend simd operator+(simd a, simd b) { return simd{a.value + b.value}; }
+  friend simd operator-(simd a, simd b) { return simd{a.value - b.value}; }
+  friend simd operator*(simd a, simd b) { return simd{a.value * b.value}; }
+  friend simd operator/(simd a, simd b) { return simd{a.value / b.value}; }
+  static simd min(simd a, simd b) { return simd{std::min(a.value, b.value)}; }
+  static simd max(simd a, simd b) { return simd{std::max(a.value, b.value)}; }
+
+  // reductions over the lanes
+  T hsum() const { return value; }
+  T hmin() const { return value; }
+  T hmax() const { return value; }
+
+  T value;
+};
+
+#if defined(__AVX512F__)
+
+template <>
+struct simd<float> {
+  static constexpr size_t width = 16;
+  static simd load(const float* ptr) { return simd{_mm512_loadu_ps(ptr)}; }
+  static simd broadcast(float x) { return simd{_mm512_set1_ps(x)}; }
+  void store(float* ptr) const { _mm512_storeu_ps(ptr, value); }
+
+  friend simd operator+(simd a, simd b) { return simd{_mm512_add_ps(a.value, b.value)}; }
+  friend simd operator-(simd a, simd b) { return simd{_mm512_sub_ps(a.value, b.value)}; }
+  friend simd operator*(simd a, simd b) { return simd{_mm512_mul_ps(a.value, b.value)}; }
+  friend simd operator/(simd a, simd b) { return simd{_mm512_div_ps(a.value, b.value)}; }
+  static simd min(simd a, simd b) { return simd{_mm512_min_ps(a.value, b.value)}; }
+  static simd max(simd a, simd b) { return simd{_mm512_max_ps(a.value, b.value)}; }
+
+  float hsum() const { return _mm512_reduce_add_ps(value); }
+  float hmin() const { return _mm512_reduce_min_ps(value); }
+  float hmax() const { return _mm512_reduce_max_ps(value); }
+
+  __m512 value;
+};
+
+template <>
+struct simd<double> {
+  static constexpr size_t width = 8;
+  static simd load(const double* ptr) { return simd{_mm512_loadu_pd(ptr)}; }
+  static simd broadcast(double x) { return simd{_mm512_set1_pd(x)}; }
+  void store(double* ptr) const { _mm512_storeu_pd(ptr, value); }
+
+  friend simd operator+(simd a, simd b) { return simd{_mm512_add_pd(a.value, b.value)}; }
+  friend simd operator-(simd a, simd b) { return simd{_mm512_sub_pd(a.value, b.value)}; }
+  friend simd operator*(simd a, simd b) { return simd{_mm512_mul_pd(a.value, b.value)}; }
+  friend simd operator/(simd a, simd b) { return simd{_mm512_div_pd(a.value, b.value)}; }
+  static simd min(simd a, simd b) { return simd{_mm512_min_pd(a.value, b.value)}; }
+  static simd max(simd a, simd b) { return simd{_mm512_max_pd(a.value, b.value)}; }
+
+  double hsum() const { return _mm512_reduce_add_pd(value); }
+  double hmin() const { return _mm512_reduce_min_pd(value); }
+  double hmax() const { return _mm512_reduce_max_pd(value); }
+
+  __m512d value;
+};
+
+#elif defined(__AVX2__)
+
+template <>
+struct simd<float> {
+  static constexpr size_t width = 8;
+  static simd load(const float* ptr) { return simd{_mm256_loadu_ps(ptr)}; }
+  static simd broadcast(float x) { return simd{_mm256_set1_ps(x)}; }
+  void store(float* ptr) const { _mm256_storeu_ps(ptr, value); }
+
+  friend simd operator+(simd a, simd b) { return simd{_mm256_add_ps(a.value, b.value)}; }
+  friend simd operator-(simd a, simd b) { return simd{_mm256_sub_ps(a.value, b.value)}; }
+  friend simd operator*(simd a, simd b) { return simd{_mm256_mul_ps(a.value, b.value)}; }
+  friend simd operator/(simd a, simd b) { return simd{_mm256_div_ps(a.value, b.value)}; }
+  static simd min(simd a, simd b) { return simd{_mm256_min_ps(a.value, b.value)}; }
+  static simd max(simd a, simd b) { return simd{_mm256_max_ps(a.value, b.value)}; }
+
+  // these only run once per reduction, so they just spill the lanes
+  float hsum() const { float x[width]; store(x); float s = 0.0f; for (float v : x) s += v; return s; }
+  float hmin() const { float x[width]; store(x); return *std::min_element(x, x + width); }
+  float hmax() const { float x[width]; store(x); return *std::max_element(x, x + width); }
+
+  __m256 value;
+};
+
+template <>
+struct simd<double> {
+  static constexpr size_t width = 4;
+  static simd load(const double* ptr) { return simd{_mm256_loadu_pd(ptr)}; }
+  static simd broadcast(double x) { return simd{_mm256_set1_pd(x)}; }
+  void store(double* ptr) const { _mm256_storeu_pd(ptr, value); }
+
+  friend simd operator+(simd a, simd b) { return simd{_mm256_add_pd(a.value, b.value)}; }
+  friend simd operator-(simd a, simd b) { return simd{_mm256_sub_pd(a.value, b.value)}; }
+  friend simd operator*(simd a, simd b) { return simd{_mm256_mul_pd(a.value, b.value)}; }
+  friend simd operator/(simd a, simd b) { return simd{_mm256_div_pd(a.value, b.value)}; }
+  static simd min(simd a, simd b) { return simd{_mm256_min_pd(a.value, b.value)}; }
+  static simd max(simd a, simd b) { return simd{_mm256_max_pd(a.value, b.value)}; }
+
+  double hsum() const { double x[width]; store(x); double s = 0.0; for (double v : x) s += v; return s; }
+  double hmin() const { double x[width]; store(x); return *std::min_element(x, x + width); }
+  double hmax() const { double x[width]; store(x); return *std::max_element(x, x + width); }
+
+  __m256d value;
+};
+
+#endif
+
+// the elements of an array
+template <class T>
+struct terminal {
+  using value_type = T;
+  size_t size() const { return n; }
+  T operator[](size_t i) const { return ptr[i]; }
+  simd<T> load(size_t i) const { return simd<T>::load(ptr + i); }
+  const T* ptr;
+  size_t n;
+};
+
+// a scalar, repeated to match the size of the other operand
+template <class T>
+struct constant {
+  using value_type = T;
+  size_t size() const { return std::numeric_limits<size_t>::max(); }
+  T operator[](size_t) const { return value; }
+  simd<T> load(size_t) const { return simd<T>::broadcast(value); }
+  T value;
+};
+
+// n is the size of both array operands, or 0 when they differ (see make_binary)
+template <class op, class A, class B>
+struct binary {
+  using value_type = typename A::value_type;
+  size_t size() const { return n; }
+  value_type operator[](size_t i) const { return op{}(a[i], b[i]); }
+  simd<value_type> load(size_t i) const { return op{}(a.load(i), b.load(i)); }
+  A a;
+  B b;
+  size_t n;
+};
+
+struct add { template <class V> V operator()(V a, V b) const { return a + b; } };
+struct subtract { template <class V> V operator()(V a, V b) const { return a - b; } };
+struct multiply { template <class V> V operator()(V a, V b) const { return a * b; } };
+struct divide { template <class V> V operator()(V a, V b) const { return a / b; } };
+
+struct minimum {
+  template <class T> T operator()(T a, T b) const { return std::min(a, b); }
+  template <class T> simd<T> operator()(simd<T> a, simd<T> b) const { return simd<T>::min(a, b); }
+};
+
+struct maximum {
+  template <class T> T operator()(T a, T b) const { return std::max(a, b); }
+  template <class T> simd<T> operator()(simd<T> a, simd<T> b) const { return simd<T>::max(a, b); }
+};
+
+template <class E> struct is_expression : std::false_type {};
+template <class T> struct is_expression<terminal<T>> : std::true_type {};
+template <class T> struct is_expression<constant<T>> : std::true_type {};
+template <class op, class A, class B> struct is_expression<binary<op, A, B>> : std::true_type {};
+
+template <class E>
+constexpr bool is_expression_v = is_expression<E>::value;
+
+template <class E, class = std::enable_if_t<is_expression_v<E>>>
+E to_expression(const E& e) { return e; }
+
+template <class T, MemorySpace memory, class Allocator, class = std::enable_if_t<is_host_memory(memory)>>
+terminal<T> to_expression(const buffer<T, memory, Allocator>& b) { return terminal<T>{b.begin(), b.size()}; }
+
+template <class T>
+terminal<std::remove_const_t<T>> to_expression(const Iterator<T>& it) {
+  return terminal<std::remove_const_t<T>>{it.begin_, size_t(it.end_ - it.begin_)};
+}
+
+template <class T>
+terminal<T> to_expression(const std::vector<T>& v) { return terminal<T>{v.data(), v.size()}; }
+
+// whether X can be used as an array operand
+template <class X, class = void>
+struct is_operand : std::false_type {};
+
+template <class X>
+struct is_operand<X, std::void_t<decltype(to_expression(std::declval<const X&>()))>> : std::true_type {};
+
+template <class X>
+constexpr bool is_operand_v = is_operand<X>::value;
+
+template <class A, class B>
+using enable_binary = std::enable_if_t<(is_operand_v<A> && (is_operand_v<B> || std::is_arithmetic_v<B>)) ||
+                                       (std::is_arithmetic_v<A> && is_operand_v<B>)>;
+
+// Scalars take the element type of the other operand. Array operands of
+// different sizes are an error, and make an empty expression, so that
+// nothing past the end of the shorter one is read.
+template <class op, class A, class B>
+auto make_binary(const A& a, const B& b) {
+  if constexpr (std::is_arithmetic_v<A>) {
+    auto eb = to_expression(b);
+    using T = typename decltype(eb)::value_type;
+    return binary<op, constant<T>, decltype(eb)>{constant<T>{T(a)}, eb, eb.size()};
+  } else if constexpr (std::is_arithmetic_v<B>) {
+    auto ea = to_expression(a);
+    using T = typename decltype(ea)::value_type;
+    return binary<op, decltype(ea), constant<T>>{ea, constant<T>{T(b)}, ea.size()};
+  } else {
+    auto ea = to_expression(a);
+    auto eb = to_expression(b);
+    static_assert(std::is_same_v<typename decltype(ea)::value_type, typename decltype(eb)::value_type>,
+                  "array operands must have the same element type");
+    size_t n = ea.size();
+    if (eb.size() != n) {
+      std::cout << "error: array operands have different sizes, " << n << " and " << eb.size() << std::endl;
+      n = 0;
+    }
+    return binary<op, decltype(ea), decltype(eb)>{ea, eb, n};
+  }
+}
+
+template <class A, class B, class = enable_binary<A, B>>
+auto operator+(const A& a, const B& b) { return make_binary<add>(a, b); }
+
+template <class A, class B, class = enable_binary<A, B>>
+auto operator-(const A& a, const B& b) { return make_binary<subtract>(a, b); }
+
+template <class A, class B, class = enable_binary<A, B>>
+auto operator*(const A& a, const B& b) { return make_binary<multiply>(a, b); }
+
+template <class A, class B, class = enable_binary<A, B>>
+auto operator/(const A& a, const B& b) { return make_binary<divide>(a, b); }
+
+// element-wise
+template <class A, class B, class = enable_binary<A, B>>
+auto min(const A& a, const B& b) { return make_binary<minimum>(a, b); }
+
+template <class A, class B, class = enable_binary<A, B>>
+auto max(const A& a, const B& b) { return make_binary<maximum>(a, b); }
+
+template <class E, class L, class H, class = std::enable_if_t<is_operand_v<E>>>
+auto clamp(const E& e, const L& lo, const H& hi) { return min(max(e, lo), hi); }
+
+// alpha * x + y, so y = axpy(alpha, x, y) updates y in place
+template <class S, class X, class Y, class = std::enable_if_t<is_operand_v<X> && is_operand_v<Y>>>
+auto axpy(const S& alpha, const X& x, const Y& y) { return alpha * x + y; }
+
+// write the first n elements of the expression to output
+template <class T, class E>
+void evaluate(T* output, const E& e, size_t n) {
+  constexpr size_t width = simd<T>::width;
+  size_t i = 0;
+  for (; i + width <= n; i += width) e.load(i).store(output + i);
+  for (; i < n; i++) output[i] = e[i];
+}
+
+// reductions, each in a single pass
+
+template <class X, class = std::enable_if_t<is_operand_v<X>>>
+auto sum(const X& x) {
+  auto e = to_expression(x);
+  using T = typename decltype(e)::value_type;
+  constexpr size_t width = simd<T>::width;
+  size_t n = e.size(), i = 0;
+  simd<T> partial = simd<T>::broadcast(T(0));
+  for (; i + width <= n; i += width) partial = partial + e.load(i);
+  T total = partial.hsum();
+  for (; i < n; i++) total += e[i];
+  return total;
+}
+
+template <class X, class = std::enable_if_t<is_operand_v<X>>>
+auto min_value(const X& x) {
+  auto e = to_expression(x);
+  using T = typename decltype(e)::value_type;
+  constexpr size_t width = simd<T>::width;
+  size_t n = e.size(), i = 0;
+  T lowest = std::numeric_limits<T>::max();
+  if (n >= width) {
+    simd<T> partial = e.load(0);
+    for (i = width; i + width <= n; i += width) partial = simd<T>::min(partial, e.load(i));
+    lowest = partial.hmin();
+  }
+  for (; i < n; i++) lowest = std::min(lowest, e[i]);
+  return lowest;
+}
+
+template <class X, class = std::enable_if_t<is_operand_v<X>>>
+auto max_value(const X& x) {
+  auto e = to_expression(x);
+  using T = typename decltype(e)::value_type;
+  constexpr size_t width = simd<T>::width;
+  size_t n = e.size(), i = 0;
+  T highest = std::numeric_limits<T>::lowest();
+  if (n >= width) {
+    simd<T> partial = e.load(0);
+    for (i = width; i + width <= n; i += width) partial = simd<T>::max(partial, e.load(i));
+    highest = partial.hmax();
+  }
+  for (; i < n; i++) highest = std::max(highest, e[i]);
+  return highest;
+}
+
+// euclidean norm
+template <class X, class = std::enable_if_t<is_operand_v<X>>>
+auto norm(const X& x) {
+  auto e = to_expression(x);
+  return std::sqrt(sum(e * e));
+}
+
+}  // namespace femto
+
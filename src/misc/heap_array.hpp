@@ -1,50 +1,122 @@
 #pragma once
 
 #include <cstdio>
+#include <cstdlib>
+#include <array>
+#include <string>
+#include <vector>
+#include <memory>
 #include <fstream>
+#include <utility>
+#include <type_traits>
+#include <iostream>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
 
 #include "macros.hpp"
+#include "mapped_file.hpp"
 #include "iterator.hpp"
+#include "expressions.hpp"
 
 namespace femto {
 
-template <MemorySpace memory, typename T>
-void malloc(T*& ptr, size_t n) {
-  if constexpr (memory == MemorySpace::CPU) {
-    ptr = (T*)::malloc(n * sizeof(T));
+// alignment must be a power of two, and a multiple of sizeof(void*)
+inline void* aligned_malloc(size_t bytes, size_t alignment) {
+  if (bytes == 0) return nullptr;
+#ifdef _WIN32
+  return _aligned_malloc(bytes, alignment);
+#else
+  void* ptr = nullptr;
+  if (posix_memalign(&ptr, alignment, bytes) != 0) return nullptr;
+  return ptr;
+#endif
+}
+
+inline void aligned_free(void* ptr) {
+#ifdef _WIN32
+  _aligned_free(ptr);
+#else
+  ::free(ptr);
+#endif
+}
+
+// Allocators are stateless types with
+//   static void* allocate(size_t bytes);
+//   static void deallocate(void* ptr);
+// that buffer / heap_array take as an optional template parameter.
+
+// cache line (and AVX-512 register) aligned
+template <size_t alignment = 64>
+struct aligned_allocator {
+  static void* allocate(size_t bytes) { return aligned_malloc(bytes, alignment); }
+  static void deallocate(void* ptr) { aligned_free(ptr); }
+};
+
+// 2MB aligned and padded to a whole number of 2MB pages, which on linux are
+// also marked as eligible for transparent huge pages, to cut down on TLB misses
+// when streaming through large arrays
+struct huge_page_allocator {
+  static constexpr size_t page_size = size_t(2) << 20;
+  static void* allocate(size_t bytes) {
+    bytes = ((bytes + page_size - 1) / page_size) * page_size;
+    void* ptr = aligned_malloc(bytes, page_size);
+#ifdef MADV_HUGEPAGE
+    if (ptr) madvise(ptr, bytes, MADV_HUGEPAGE);
+#endif
+    return ptr;
   }
+  static void deallocate(void* ptr) { aligned_free(ptr); }
+};
+
 #ifdef __NVCC__
-  if constexpr (memory == MemorySpace::GPU) {
-    cudaMalloc(&ptr, n);
-  }
-  if constexpr (memory == MemorySpace::UNIFIED) {
-    cudaMallocManaged(&ptr, n);
-  }
+struct device_allocator {
+  static void* allocate(size_t bytes) { void* ptr = nullptr; cudaMalloc(&ptr, bytes); return ptr; }
+  static void deallocate(void* ptr) { cudaFree(ptr); }
+};
+
+struct unified_allocator {
+  static void* allocate(size_t bytes) { void* ptr = nullptr; cudaMallocManaged(&ptr, bytes); return ptr; }
+  static void deallocate(void* ptr) { cudaFree(ptr); }
+};
 #endif
+
+template <MemorySpace memory>
+struct default_allocator;
+
+template <>
+struct default_allocator<MemorySpace::CPU> : aligned_allocator<64> {};
+
+#ifdef __NVCC__
+template <>
+struct default_allocator<MemorySpace::GPU> : device_allocator {};
+
+template <>
+struct default_allocator<MemorySpace::UNIFIED> : unified_allocator {};
+#endif
+
+template <MemorySpace memory, typename T>
+void malloc(T*& ptr, size_t n) {
+  ptr = (T*)default_allocator<memory>::allocate(n * sizeof(T));
 }
 
 template <MemorySpace memory, typename T>
 void free(T* ptr) {
-  if constexpr (memory == MemorySpace::CPU) {
-    ::free(ptr);
-  }
-#ifdef __NVCC__
-  if constexpr (memory == MemorySpace::GPU || memory == MemorySpace::UNIFIED) {
-    cudaFree(ptr);
-  }
-#endif
+  default_allocator<memory>::deallocate(ptr);
 }
 
 template <MemorySpace src_memory, MemorySpace dst_memory, typename T>
 auto copy(const T* begin, const T* end, T* output) {
-  if constexpr (src_memory == MemorySpace::CPU &&
-                dst_memory == MemorySpace::CPU) {
+  if constexpr (is_host_memory(src_memory) && is_host_memory(dst_memory)) {
     std::copy(begin, end, output);
   }
 #ifdef __NVCC__
-  if constexpr (src_memory != MemorySpace::CPU ||
-                dst_memory != MemorySpace::CPU) {
-    cudaMemcpy(begin_, output_, (end - begin) * sizeof(T), cudaMemcpyDefault);
+  if constexpr (!is_host_memory(src_memory) || !is_host_memory(dst_memory)) {
+    cudaMemcpy(output, begin, (end - begin) * sizeof(T), cudaMemcpyDefault);
   }
 #endif
 }
@@ -62,15 +134,15 @@ __global__ void fill_kernel(T * ptr, size_t n, T value) {
 template <MemorySpace memory, typename T>
 void fill_n(T* ptr, size_t n, const T& value) {
 
-  if constexpr (memory == MemorySpace::CPU) {
+  if constexpr (is_host_memory(memory)) {
     std::fill_n(ptr, n, value);
   }
 
 #ifdef __NVCC__
-  if constexpr (memory != MemorySpace::CPU) {
+  if constexpr (!is_host_memory(memory)) {
     int blocksize = 128;
-    int gridsize = (blocksize + size_ - 1) / blocksize;
-    fill_kernel<<<gridsize, blocksize>>>(begin_, size_, value);
+    int gridsize = (n + blocksize - 1) / blocksize;
+    fill_kernel<<<gridsize, blocksize>>>(ptr, n, value);
     cudaDeviceSynchronize();
   }
 #endif
@@ -106,55 +178,129 @@ struct Indexable<3> {
   size_t strides[2];
 };
 
-template <class T, MemorySpace memory>
-struct buffer {
-  explicit buffer() {
-    size_ = 0;
-    ptr_ = nullptr;
-  }
+// A contiguous array of trivially copyable T in the given memory space.
+// Elements are not constructed, so newly allocated storage is uninitialized.
+//
+// A CPU buffer can also refer to the contents of a file mapped into memory
+// (see map_from_file). Growing it, or assigning to it, moves the contents to
+// an ordinary allocation first, but the file itself is never written.
+template <class T, MemorySpace memory, class Allocator = femto::default_allocator<memory>>
+struct buffer : femto::array_operand {
+  explicit buffer() : ptr_(nullptr), size_(0), capacity_(0) {}
 
-  explicit buffer(size_t n) { allocate(n); }
+  explicit buffer(size_t n) : buffer() { allocate(n); }
 
-  buffer(const buffer<T, memory>& other) {
+  buffer(const buffer& other) : buffer() {
     allocate(other.size());
     femto::copy<memory, memory>(other.begin(), other.end(), begin());
   }
 
-  buffer<T, memory>& operator=(const buffer<T, memory>& other) {
-    allocate(other.size());
-    femto::copy<memory, memory>(other.begin(), other.end(), begin());
+  buffer(buffer&& other) noexcept : ptr_(other.ptr_), size_(other.size_), capacity_(other.capacity_),
+                                    mapping_(std::move(other.mapping_)) {
+    other.ptr_ = nullptr;
+    other.size_ = other.capacity_ = 0;
+  }
+
+  buffer& operator=(const buffer& other) {
+    if (this != &other) {
+      resize(other.size(), uninitialized);
+      femto::copy<memory, memory>(other.begin(), other.end(), begin());
+    }
+    return *this;
+  }
+
+  buffer& operator=(buffer&& other) noexcept {
+    if (this != &other) {
+      free();
+      std::swap(ptr_, other.ptr_);
+      std::swap(size_, other.size_);
+      std::swap(capacity_, other.capacity_);
+      std::swap(mapping_, other.mapping_);
+    }
     return *this;
   }
 
-  template <MemorySpace other_memory>
-  buffer(const buffer<T, other_memory>& other) {
+  template <MemorySpace other_memory, class other_allocator>
+  buffer(const buffer<T, other_memory, other_allocator>& other) : buffer() {
     allocate(other.size());
     femto::copy<other_memory, memory>(other.begin(), other.end(), begin());
   }
 
-  template <MemorySpace other_memory>
-  buffer<T, memory>& operator=(const buffer<T, other_memory>& other) {
-    resize(other.size());
+  template <MemorySpace other_memory, class other_allocator>
+  buffer& operator=(const buffer<T, other_memory, other_allocator>& other) {
+    resize(other.size(), uninitialized);
     femto::copy<other_memory, memory>(other.begin(), other.end(), begin());
     return *this;
   }
 
-  buffer(const std::vector<T>& other) {
+  buffer(const std::vector<T>& other) : buffer() {
     allocate(other.size());
-    femto::copy<MemorySpace::CPU, memory>(other.begin(), other.end(), begin());
+    femto::copy<MemorySpace::CPU, memory>(other.data(), other.data() + other.size(), begin());
+  }
+
+  buffer& operator=(const std::vector<T>& other) {
+    resize(other.size(), uninitialized);
+    femto::copy<MemorySpace::CPU, memory>(other.data(), other.data() + other.size(), begin());
+    return *this;
   }
 
-  buffer<T, memory>& operator=(const std::vector<T>& other) {
-    resize(other.size());
-    femto::copy<MemorySpace::CPU, memory>(other.begin(), other.end(), begin());
+  // evaluate an element-wise expression (see expressions.hpp), in a single pass
+  template <class E, class = std::enable_if_t<femto::is_expression_v<E>>>
+  buffer& operator=(const E& e) {
+    static_assert(is_host_memory(memory), "expressions are only evaluated on the CPU");
+    size_t n = e.size();
+    if (n == size_ && !mapped()) {
+      femto::evaluate(ptr_, e, n);
+    } else {
+      // the expression may refer to this buffer's current elements
+      buffer result(n);
+      femto::evaluate(result.ptr_, e, n);
+      *this = std::move(result);
+    }
     return *this;
   }
 
+  template <class E, class = femto::enable_binary<buffer, E>>
+  buffer& operator+=(const E& e) { return *this = femto::make_binary<femto::add>(*this, e); }
+
+  template <class E, class = femto::enable_binary<buffer, E>>
+  buffer& operator-=(const E& e) { return *this = femto::make_binary<femto::subtract>(*this, e); }
+
+  template <class E, class = femto::enable_binary<buffer, E>>
+  buffer& operator*=(const E& e) { return *this = femto::make_binary<femto::multiply>(*this, e); }
+
   ~buffer() noexcept { free(); }
 
+  // tag for resize(), to skip copying the old contents when they'll be overwritten anyway
+  struct uninitialized_t {};
+  static constexpr uninitialized_t uninitialized{};
+
+  // Keeps the first min(size(), new_size) elements, and leaves the rest uninitialized.
+  // Shrinking keeps the allocation, and growing past capacity() at least doubles it.
   void resize(size_t new_size) {
-    free();
-    allocate(new_size);
+    if (new_size > capacity_) reallocate(std::max(new_size, 2 * capacity_), true);
+    size_ = new_size;
+  }
+
+  // grow with copies of value
+  void resize(size_t new_size, const T& value) {
+    size_t old_size = size_;
+    resize(new_size);
+    if (new_size > old_size) femto::fill_n<memory>(ptr_ + old_size, new_size - old_size, value);
+  }
+
+  // all of the elements are left uninitialized, and the old ones are not copied
+  void resize(size_t new_size, uninitialized_t) {
+    if (new_size > capacity_ || mapped()) reallocate(new_size, false);
+    size_ = new_size;
+  }
+
+  void reserve(size_t n) {
+    if (n > capacity_) reallocate(n, true);
+  }
+
+  void shrink_to_fit() {
+    if (size_ < capacity_) reallocate(size_, true);
   }
 
   operator T*() { return ptr_; }
@@ -167,8 +313,12 @@ struct buffer {
   T* end() { return ptr_ + size_; }
 
   size_t size() const { return size_; }
+  size_t capacity() const { return capacity_; }
+
+  // true if the elements live in a mapped file rather than an allocation
+  bool mapped() const { return mapping_ != nullptr; }
 
-  void fill(const T& value) { femto::fill_n(ptr_, size_, value); }
+  void fill(const T& value) { femto::fill_n<memory>(ptr_, size_, value); }
 
   T& operator[](size_t i) { return ptr_[i]; }
 
@@ -183,84 +333,334 @@ struct buffer {
     outfile.close();
   }
 
+  // copies the contents of a file written by write_to_file, straight
+  // from the page cache into this buffer's own memory
   void read_from_file(std::string filename) {
-    std::ifstream infile;
-    infile.open(filename, std::ios::in | std::ios::binary);
-    infile.read((char*)&size_, sizeof(size_t));
-    buffer<T, MemorySpace::CPU> host_copy(size_);
-    infile.read((char*)host_copy.begin(), sizeof(T) * size_);
-    infile.close();
+    femto::mapped_file file(filename, femto::MapAccess::READ_ONLY, femto::MapAdvice::SEQUENTIAL);
+    const T* payload = payload_of(file, filename);
+    if (payload == nullptr) return;
+    size_t n = *(const size_t*)file.data();
+    resize(n, uninitialized);
+    femto::copy<MemorySpace::CPU, memory>(payload, payload + n, ptr_);
+  }
+
+  // Refer to the contents of a file written by write_to_file without reading
+  // it, so the pages are only loaded from disk as they're accessed. With
+  // MapAccess::READ_ONLY, writing to the elements crashes. If the file is
+  // missing or truncated, the buffer is left empty.
+  void map_from_file(std::string filename, femto::MapAccess access = femto::MapAccess::READ_ONLY,
+                     femto::MapAdvice advice = femto::MapAdvice::NORMAL) {
+    static_assert(memory == MemorySpace::CPU, "only CPU buffers can be mapped from a file");
+    auto file = std::make_unique<femto::mapped_file>(filename, access, advice);
+    T* payload = (T*)payload_of(*file, filename);
+    free();
+    if (payload == nullptr) return;
+    ptr_ = payload;
+    size_ = capacity_ = *(const size_t*)file->data();
+    mapping_ = std::move(file);
+  }
 
-    *this = host_copy;
+  // change the access pattern hint for the mapped elements [begin, end)
+  void advise(femto::MapAdvice advice, size_t begin = 0, size_t end = size_t(-1)) {
+    if (!mapped()) return;
+    end = std::min(end, size_);
+    if (begin >= end) return;
+    size_t offset = (char*)(ptr_ + begin) - mapping_->data();
+    mapping_->advise(advice, offset, (end - begin) * sizeof(T));
   }
 
  private:
   // allocate memory in the specified memory space
   void allocate(size_t n) {
-    size_ = n;
-    femto::malloc<memory>(ptr_, n);
+    ptr_ = (T*)Allocator::allocate(n * sizeof(T));
+    size_ = capacity_ = n;
   }
 
-  // free memory in the specified memory space
+  // move to an allocation of new_capacity elements, keeping size()
+  void reallocate(size_t new_capacity, bool keep_contents) {
+    T* new_ptr = (T*)Allocator::allocate(new_capacity * sizeof(T));
+    if (keep_contents && ptr_ != nullptr) {
+      size_t n = std::min(size_, new_capacity);
+      femto::copy<memory, memory>(ptr_, ptr_ + n, new_ptr);
+    }
+    size_t old_size = size_;
+    free();
+    ptr_ = new_ptr;
+    size_ = old_size;
+    capacity_ = new_capacity;
+  }
+
+  // free memory in the specified memory space, leaving an empty buffer
   void free() {
-    if (ptr_ != NULL) {
-      femto::free<memory>(ptr_);
-      ptr_ = nullptr;
+    if (mapping_) {
+      mapping_.reset();
+    } else if (ptr_ != nullptr) {
+      Allocator::deallocate(ptr_);
+    }
+    ptr_ = nullptr;
+    size_ = capacity_ = 0;
+  }
+
+  // the elements of a file written by write_to_file, or nullptr if it's missing or truncated
+  static const T* payload_of(const femto::mapped_file& file, const std::string& filename) {
+    if (!file) {
+      std::cout << "file not found: " << filename << std::endl;
+      return nullptr;
+    }
+    size_t n = (file.size() >= sizeof(size_t)) ? *(const size_t*)file.data() : 0;
+    if (file.size() < sizeof(size_t) || (file.size() - sizeof(size_t)) / sizeof(T) < n) {
+      std::cout << "file is truncated: " << filename << std::endl;
+      return nullptr;
     }
+    return (const T*)(file.data() + sizeof(size_t));
   }
 
   T* ptr_;
   size_t size_;
+  size_t capacity_;
+  std::unique_ptr<femto::mapped_file> mapping_;
 };
 
-template <class T, size_t dimension, MemorySpace memory = MemorySpace::CPU>
+template <class T, size_t dimension, MemorySpace memory = MemorySpace::CPU,
+          class Allocator = femto::default_allocator<memory>>
 struct heap_array;
 
-template <class T>
-struct heap_array<T, 1, MemorySpace::CPU> : buffer<T, MemorySpace::CPU>, Indexable<1> {
+template <class T, class Allocator>
+struct heap_array<T, 1, MemorySpace::CPU, Allocator> : buffer<T, MemorySpace::CPU, Allocator>, Indexable<1> {
   static constexpr auto memory = MemorySpace::CPU;
-  explicit heap_array() : buffer<T, memory>{}, Indexable<1>{0} {}
-  explicit heap_array(size_t n) : buffer<T, memory>{n}, Indexable<1>{n} {}
-  T& operator[](size_t i) { return *this[i]; }
-  T operator[](size_t i) const { return *this[i]; }
-  T& operator()(size_t i) { return *this[i]; }
-  T operator()(size_t i) const { return *this[i]; }
+  using buffer_type = buffer<T, memory, Allocator>;
+  using buffer_type::operator=;
+  using buffer_type::operator+=;
+  using buffer_type::operator-=;
+  using buffer_type::operator*=;
+  explicit heap_array() : buffer_type{}, Indexable<1>{0} {}
+  explicit heap_array(size_t n) : buffer_type{n}, Indexable<1>{n} {}
+  T& operator[](size_t i) { return buffer_type::operator[](i); }
+  T operator[](size_t i) const { return buffer_type::operator[](i); }
+  T& operator()(size_t i) { return buffer_type::operator[](i); }
+  T operator()(size_t i) const { return buffer_type::operator[](i); }
   size_t shape([[maybe_unused]] size_t i = 0) { return Indexable<1>::shape; }
+  void map_from_file(std::string filename, femto::MapAccess access = femto::MapAccess::READ_ONLY,
+                     femto::MapAdvice advice = femto::MapAdvice::NORMAL) {
+    buffer_type::map_from_file(filename, access, advice);
+    Indexable<1>::shape = buffer_type::size();
+  }
 };
 
-template <class T>
-struct heap_array<T, 2, MemorySpace::CPU> : public buffer<T, MemorySpace::CPU>, Indexable<2> {
+template <class T, class Allocator>
+struct heap_array<T, 2, MemorySpace::CPU, Allocator> : public buffer<T, MemorySpace::CPU, Allocator>, Indexable<2> {
   static constexpr auto memory = MemorySpace::CPU;
-  explicit heap_array() : buffer<T, memory>{}, Indexable<2>{0, 0} {}
-  explicit heap_array(size_t n0, size_t n1) : buffer<T, memory>{n0 * n1}, Indexable<2>{n0, n1} {}
+  using buffer_type = buffer<T, memory, Allocator>;
+  using buffer_type::operator=;
+  using buffer_type::operator+=;
+  using buffer_type::operator-=;
+  using buffer_type::operator*=;
+  explicit heap_array() : buffer_type{}, Indexable<2>{0, 0} {}
+  explicit heap_array(size_t n0, size_t n1) : buffer_type{n0 * n1}, Indexable<2>{n0, n1} {}
   Iterator< T > operator()(size_t i) { 
-    return Iterator<T>{&buffer<T, memory>::operator[](index(i,0)), &buffer<T, memory>::operator[](index(i+1,0))};
+    return Iterator<T>{buffer_type::begin() + index(i,0), buffer_type::begin() + index(i+1,0)};
   }
   Iterator< const T > operator()(size_t i) const { 
-    return Iterator<const T>{&buffer<T, memory>::operator[](index(i,0)), &buffer<T, memory>::operator[](index(i+1,0))};
+    return Iterator<const T>{buffer_type::begin() + index(i,0), buffer_type::begin() + index(i+1,0)};
   }
-  T& operator()(size_t i, size_t j) { return buffer<T, memory>::operator[](index(i,j)); }
-  T operator()(size_t i, size_t j) const { return buffer<T, memory>::operator[](index(i,j)); }
+  T& operator()(size_t i, size_t j) { return buffer_type::operator[](index(i,j)); }
+  T operator()(size_t i, size_t j) const { return buffer_type::operator[](index(i,j)); }
   size_t shape(size_t i) { return Indexable<2>::shape[i]; }
+  // a missing file, or one without n0 * n1 elements, leaves the array empty, with shape 0
+  void map_from_file(std::string filename, size_t n0, size_t n1,
+                     femto::MapAccess access = femto::MapAccess::READ_ONLY,
+                     femto::MapAdvice advice = femto::MapAdvice::NORMAL) {
+    buffer_type::map_from_file(filename, access, advice);
+    if (!buffer_type::mapped() || buffer_type::size() != n0 * n1) {
+      if (buffer_type::mapped()) std::cout << "file has the wrong number of elements: " << filename << std::endl;
+      buffer_type::operator=(buffer_type{});
+      static_cast<Indexable<2>&>(*this) = Indexable<2>{0, 0};
+      return;
+    }
+    static_cast<Indexable<2>&>(*this) = Indexable<2>{n0, n1};
+  }
 };
 
-template <class T>
-struct heap_array<T, 3, MemorySpace::CPU> : buffer<T, MemorySpace::CPU>, Indexable<3> {
+template <class T, class Allocator>
+struct heap_array<T, 3, MemorySpace::CPU, Allocator> : buffer<T, MemorySpace::CPU, Allocator>, Indexable<3> {
   static constexpr auto memory = MemorySpace::CPU;
-  explicit heap_array() : buffer<T, memory>{}, Indexable<3>{0, 0 ,0} {}
-  explicit heap_array(size_t n0, size_t n1, size_t n2) : buffer<T, memory>{n0 * n1 * n2}, Indexable<3>{n0, n1, n2} {}
-  T& operator()(size_t i, size_t j, size_t k) { return buffer<T, memory>::operator[](index(i,j,k)); }
-  T operator()(size_t i, size_t j, size_t k) const { return buffer<T, memory>::operator[](index(i,j,k));}
+  using buffer_type = buffer<T, memory, Allocator>;
+  using buffer_type::operator=;
+  using buffer_type::operator+=;
+  using buffer_type::operator-=;
+  using buffer_type::operator*=;
+  explicit heap_array() : buffer_type{}, Indexable<3>{0, 0 ,0} {}
+  explicit heap_array(size_t n0, size_t n1, size_t n2) : buffer_type{n0 * n1 * n2}, Indexable<3>{n0, n1, n2} {}
+  T& operator()(size_t i, size_t j, size_t k) { return buffer_type::operator[](index(i,j,k)); }
+  T operator()(size_t i, size_t j, size_t k) const { return buffer_type::operator[](index(i,j,k));}
   size_t shape(size_t i) { return Indexable<3>::shape[i]; }
+  // a missing file, or one without n0 * n1 * n2 elements, leaves the array empty, with shape 0
+  void map_from_file(std::string filename, size_t n0, size_t n1, size_t n2,
+                     femto::MapAccess access = femto::MapAccess::READ_ONLY,
+                     femto::MapAdvice advice = femto::MapAdvice::NORMAL) {
+    buffer_type::map_from_file(filename, access, advice);
+    if (!buffer_type::mapped() || buffer_type::size() != n0 * n1 * n2) {
+      if (buffer_type::mapped()) std::cout << "file has the wrong number of elements: " << filename << std::endl;
+      buffer_type::operator=(buffer_type{});
+      static_cast<Indexable<3>&>(*this) = Indexable<3>{0, 0, 0};
+      return;
+    }
+    static_cast<Indexable<3>&>(*this) = Indexable<3>{n0, n1, n2};
+  }
 };
 
-template <class T, size_t dimension, MemorySpace memory>
-struct view : Indexable< dimension >{
+// A non-owning, strided window into a row-major array, with strides counted
+// in elements. Slicing, taking sub-blocks and permuting the axes only make a
+// new view of the same elements, so nothing is copied until copy_to().
+//
+// Views are cheap to copy and can be captured by value, e.g.
+//
+//   view<float, 2> plane = view<float, 3>(field).slice(2, k);
+//   pool.parallel_for(plane.shape(0), plane.shape(1), [=](uint64_t i, uint64_t j) {
+//     plane(i, j) *= 2.0f;
+//   });
+//
+// Use view<const T, ...> for read-only access.
+template <class T, size_t dimension, MemorySpace memory = MemorySpace::CPU>
+struct view {
+  using value_type = std::remove_const_t<T>;
+
+  view() : ptr_(nullptr), shape_{}, strides_{} {}
+
+  view(T* ptr, const std::array<size_t, dimension>& shape, const std::array<size_t, dimension>& strides)
+      : ptr_(ptr), shape_(shape), strides_(strides) {}
+
+  // the whole of a heap_array
+  template <class Allocator>
+  view(heap_array<value_type, dimension, memory, Allocator>& arr) : view() {
+    from_array(arr.begin(), arr);
+  }
+
+  template <class Allocator, class U = T, class = std::enable_if_t<std::is_const_v<U>>>
+  view(const heap_array<value_type, dimension, memory, Allocator>& arr) : view() {
+    from_array(arr.begin(), arr);
+  }
+
+  // a view of T converts to a view of const T
+  template <class U, class = std::enable_if_t<std::is_same_v<const U, T>>>
+  view(const view<U, dimension, memory>& other)
+      : view(other.data(), other.shape(), other.strides()) {}
+
+  template <typename... index>
+  T& operator()(index... i) const {
+    static_assert(sizeof...(index) == dimension, "wrong number of indices");
+    const size_t indices[] = {size_t(i)...};
+    size_t offset = 0;
+    for (size_t a = 0; a < dimension; a++) offset += indices[a] * strides_[a];
+    return ptr_[offset];
+  }
+
+  T* data() const { return ptr_; }
+
+  size_t shape(size_t axis) const { return shape_[axis]; }
+  const std::array<size_t, dimension>& shape() const { return shape_; }
+
+  size_t stride(size_t axis) const { return strides_[axis]; }
+  const std::array<size_t, dimension>& strides() const { return strides_; }
+
+  size_t size() const {
+    size_t n = 1;
+    for (size_t s : shape_) n *= s;
+    return n;
+  }
+
+  // true if the elements are packed together in row-major order
+  bool contiguous() const {
+    size_t expected = 1;
+    for (size_t axis = dimension; axis-- > 0;) {
+      if (shape_[axis] != 1 && strides_[axis] != expected) return false;
+      expected *= shape_[axis];
+    }
+    return true;
+  }
+
+  // the elements with index i along the given axis, e.g. a plane of a 3D array
+  view<T, dimension - 1, memory> slice(size_t axis, size_t i) const {
+    static_assert(dimension > 1, "can't slice a 1D view");
+    std::array<size_t, dimension - 1> shape, strides;
+    for (size_t a = 0, b = 0; a < dimension; a++) {
+      if (a == axis) continue;
+      shape[b] = shape_[a];
+      strides[b++] = strides_[a];
+    }
+    return view<T, dimension - 1, memory>(ptr_ + i * strides_[axis], shape, strides);
+  }
+
+  // the elements with indices in [begin[a], end[a]) along each axis a
+  view block(const std::array<size_t, dimension>& begin, const std::array<size_t, dimension>& end) const {
+    std::array<size_t, dimension> shape;
+    size_t offset = 0;
+    for (size_t a = 0; a < dimension; a++) {
+      shape[a] = end[a] - begin[a];
+      offset += begin[a] * strides_[a];
+    }
+    return view(ptr_ + offset, shape, strides_);
+  }
+
+  // axis a of the result is axis axes[a] of this view
+  view permute(const std::array<size_t, dimension>& axes) const {
+    std::array<size_t, dimension> shape, strides;
+    for (size_t a = 0; a < dimension; a++) {
+      shape[a] = shape_[axes[a]];
+      strides[a] = strides_[axes[a]];
+    }
+    return view(ptr_, shape, strides);
+  }
 
-    view(const heap_array< T, dimension, memory > & arr) : Indexable<dimension>{arr} {
+  // reverses the order of the axes
+  view transpose() const {
+    std::array<size_t, dimension> axes;
+    for (size_t a = 0; a < dimension; a++) axes[a] = dimension - 1 - a;
+    return permute(axes);
+  }
 
+  // copy the elements, in row-major order, to output (e.g. a mapped GL buffer)
+  void copy_to(value_type* output) const {
+    if (size() == 0) return;
+    if (contiguous()) {
+      femto::copy<memory, MemorySpace::CPU>(ptr_, ptr_ + size(), output);
+    } else {
+      static_assert(is_host_memory(memory), "strided copies are only supported on the CPU");
+      copy_axis(0, ptr_, output);
     }
+  }
 
-    T * ptr_;
+ private:
+  template <class array_type>
+  void from_array(T* ptr, const array_type& arr) {
+    ptr_ = ptr;
+    const Indexable<dimension>& indexable = arr;
+    if constexpr (dimension == 1) {
+      shape_[0] = indexable.shape;
+    } else {
+      for (size_t a = 0; a < dimension; a++) shape_[a] = indexable.shape[a];
+    }
+    size_t stride = 1;
+    for (size_t a = dimension; a-- > 0;) {
+      strides_[a] = stride;
+      stride *= shape_[a];
+    }
+  }
 
+  value_type* copy_axis(size_t axis, const T* ptr, value_type* output) const {
+    if (axis + 1 == dimension) {
+      size_t n = shape_[axis], s = strides_[axis];
+      if (s == 1) return std::copy(ptr, ptr + n, output);
+      for (size_t i = 0; i < n; i++) *output++ = ptr[i * s];
+      return output;
+    }
+    for (size_t i = 0; i < shape_[axis]; i++) {
+      output = copy_axis(axis + 1, ptr + i * strides_[axis], output);
+    }
+    return output;
+  }
+
+  T* ptr_;
+  std::array<size_t, dimension> shape_;
+  std::array<size_t, dimension> strides_;
 };
@@ -1,7 +1,11 @@
 #pragma once
 
+#include "expressions.hpp"
+
 template < typename T >
-struct Iterator {
+struct Iterator : femto::array_operand {
+  Iterator(T * b, T * e) : begin_(b), end_(e) {}
+
   T * begin() { return begin_; };
   T * end() { return end_; };
   T * begin_;
@@ -10,11 +14,27 @@ struct Iterator {
   T & operator[](size_t i) { return begin_[i]; }
   const T & operator[](size_t i) const { return begin_[i]; }
 
+  // evaluate an element-wise expression (see expressions.hpp) into this range,
+  // which is left unchanged if the expression has a different size
+  template < typename E, typename = std::enable_if_t< femto::is_expression_v< E > > >
+  void operator=(const E & e) {
+    size_t n = end_ - begin_;
+    if (e.size() != n) {
+      std::cout << "error: expression has " << e.size() << " elements, but the range has " << n << std::endl;
+      return;
+    }
+    femto::evaluate(begin_, e, n);
+  }
+
   template < typename indexable >
   void operator+=(const indexable & f) {
     size_t n = end_ - begin_;
-    for (size_t i = 0; i < n; i++) {
-      begin_[i] += f(i);
-    }; 
+    if constexpr (femto::is_operand_v< indexable > || std::is_arithmetic_v< indexable >) {
+      *this = *this + f;
+    } else {
+      for (size_t i = 0; i < n; i++) {
+        begin_[i] += f(i);
+      }; 
+    }
   }
 };
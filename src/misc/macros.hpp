@@ -1,6 +1,12 @@
 #pragma once
 
-enum class MemorySpace { CPU, GPU, UNIFIED };
+// GL_MAPPED is a persistently mapped GL buffer object (see src/gl_mapped_memory.hpp)
+enum class MemorySpace { CPU, GPU, UNIFIED, GL_MAPPED };
+
+// memory that host code can read and write directly, without CUDA
+constexpr bool is_host_memory(MemorySpace memory) {
+  return memory == MemorySpace::CPU || memory == MemorySpace::GL_MAPPED;
+}
 
 #ifdef __CUDACC__
 
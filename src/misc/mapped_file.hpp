@@ -0,0 +1,113 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <algorithm>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace femto {
+
+enum class MapAccess {
+  READ_ONLY,     // pages are shared with the page cache, and writing to them crashes
+  COPY_ON_WRITE  // pages are private, and become ordinary memory when first written
+};
+
+// how the mapped pages will be read, so the kernel knows how far to read ahead
+enum class MapAdvice { NORMAL, SEQUENTIAL, RANDOM };
+
+// A whole file mapped into memory. Nothing is read until the pages are touched,
+// so opening even very large files is quick, and the file is never modified.
+struct mapped_file {
+  mapped_file(const std::string& filename, MapAccess access = MapAccess::READ_ONLY,
+              MapAdvice advice = MapAdvice::NORMAL) : data_(nullptr), size_(0), valid_(false) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return;
+    LARGE_INTEGER filesize;
+    GetFileSizeEx(file, &filesize);
+    size_ = filesize.QuadPart;
+    valid_ = true;
+    if (size_ > 0) {
+      HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+      if (mapping != nullptr) {
+        DWORD flags = (access == MapAccess::READ_ONLY) ? FILE_MAP_READ : FILE_MAP_COPY;
+        data_ = (char*)MapViewOfFile(mapping, flags, 0, 0, 0);
+        CloseHandle(mapping);
+      }
+      valid_ = (data_ != nullptr);
+    }
+    CloseHandle(file);
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd == -1) return;
+    struct stat info;
+    if (fstat(fd, &info) == 0) {
+      size_ = info.st_size;
+      valid_ = true;
+      if (size_ > 0) {
+        int protection = (access == MapAccess::READ_ONLY) ? PROT_READ : (PROT_READ | PROT_WRITE);
+        int flags = (access == MapAccess::READ_ONLY) ? MAP_SHARED : MAP_PRIVATE;
+        void* ptr = mmap(nullptr, size_, protection, flags, fd, 0);
+        if (ptr != MAP_FAILED) data_ = (char*)ptr;
+        valid_ = (data_ != nullptr);
+      }
+    }
+    // the mapping keeps the file open
+    ::close(fd);
+#endif
+    if (!valid_) size_ = 0;
+    advise(advice);
+  }
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  ~mapped_file() {
+    if (data_ == nullptr) return;
+#ifdef _WIN32
+    UnmapViewOfFile(data_);
+#else
+    munmap(data_, size_);
+#endif
+  }
+
+  // change the access pattern hint for the bytes [offset, offset + count)
+  void advise(MapAdvice advice, size_t offset = 0, size_t count = size_t(-1)) {
+#ifndef _WIN32
+    if (data_ == nullptr || offset >= size_) return;
+    count = std::min(count, size_ - offset);
+
+    // madvise needs a page aligned address
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t begin = (offset / page) * page;
+    int hint = (advice == MapAdvice::SEQUENTIAL) ? MADV_SEQUENTIAL :
+               (advice == MapAdvice::RANDOM)     ? MADV_RANDOM : MADV_NORMAL;
+    madvise(data_ + begin, offset + count - begin, hint);
+#endif
+  }
+
+  // false if the file couldn't be opened or mapped
+  explicit operator bool() const { return valid_; }
+
+  char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  char* data_;
+  size_t size_;
+  bool valid_;
+};
+
+}  // namespace femto
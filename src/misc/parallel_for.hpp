@@ -1,111 +1,552 @@
 #pragma once
 
+#include <array>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
 #include <thread>
+#include <cstdint>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <condition_variable>
 
 #include "timer.hpp"
 
+// the order in which the tiles of a tiled parallel_for are handed out: MORTON
+// keeps consecutive tiles (and so each thread's share of them) spatially close
+enum class TileOrder { ROW_MAJOR, MORTON };
+
+// A pool of persistent worker threads.
+//
+// parallel_for splits its range into chunks of (about) grain_size iterations,
+// deals contiguous runs of chunks out to a deque per worker, and wakes the
+// workers. Each worker takes chunks from the front of its own deque and, when
+// that runs dry, steals from the back of the others'. The calling thread
+// takes part as well, so threadpool(n) runs loops on n threads in total, and
+// parallel_for can be called from inside a parallel_for body.
 struct threadpool {
 
-  std::vector< uint64_t > partition(uint64_t n) {
-    uint64_t quotient = n / num_threads;
-    uint64_t remainder = n % num_threads;
+  threadpool(int n) : print_timings(false), num_threads(std::max(n, 1)), grain_size(0),
+                      queues(new queue[num_threads]),
+                      generation(0), stop(false) {
+    for (int i = 1; i < num_threads; i++) {
+      threads.push_back(std::thread([this, i]() { work(i); }));
+    }
+  }
 
-    std::vector< uint64_t > blocks(num_threads + 1);
-    blocks[0] = 0;
-    for (int i = 1; i < num_threads + 1; i++) {
-      if (remainder > 0) {
-        blocks[i] = blocks[i-1] + quotient + 1;
-        remainder--;
-      } else {
-        blocks[i] = blocks[i-1] + quotient;
-      }
+  ~threadpool() {
+    {
+      std::lock_guard< std::mutex > lock(mutex);
+      stop = true;
     }
-    return blocks;
+    wake.notify_all();
+    for (auto & thread : threads) thread.join();
   }
 
-  threadpool(int n) : num_threads(n), stopwatch(n), print_timings(false) {}
+  threadpool(const threadpool &) = delete;
+  threadpool & operator=(const threadpool &) = delete;
 
   template < typename lambda >
   void parallel_for(uint64_t n, const lambda & f) {
+    run(n, grain_size, [&](uint64_t begin, uint64_t end) {
+      for (uint64_t i = begin; i < end; i++) {
+        f(i);
+      }
+    });
+  }
 
-    std::vector< uint64_t > blocks = partition(n);
+  // f(begin, end) for chunks [begin, end) of exactly `grain` iterations (except for the last
+  // one) covering [0, n), so chunk begin / grain can own per-chunk state; a loop of a single
+  // chunk runs on the calling thread
+  template < typename range_lambda >
+  void parallel_for_range(uint64_t n, uint64_t grain, const range_lambda & f) {
+    run(n, std::max< uint64_t >(grain, 1), f);
+  }
 
-    for (int tid = 0; tid < num_threads; tid++) {
-      threads.push_back(
-        std::thread([&](uint64_t i0) {
-          stopwatch[i0].start();
-          for (uint64_t i = blocks[i0]; i < blocks[i0+1]; i++) {
-            f(i);
+  // the (i, j) pairs are flattened with j fastest, so chunks are contiguous rows
+  template < typename lambda >
+  void parallel_for(uint64_t ni, uint64_t nj, const lambda & f) {
+    if (nj == 0) return;
+    run(ni * nj, grain_size, [&](uint64_t begin, uint64_t end) {
+      uint64_t i = begin / nj;
+      uint64_t j = begin % nj;
+      for (uint64_t id = begin; id < end; id++) {
+        f(i, j);
+        if (++j == nj) { j = 0; i++; }
+      }
+    });
+  }
+
+  template < typename lambda >
+  void parallel_for(uint64_t ni, uint64_t nj, uint64_t nk, const lambda & f) {
+    if (nj == 0 || nk == 0) return;
+    run(ni * nj * nk, grain_size, [&](uint64_t begin, uint64_t end) {
+      uint64_t i = begin / (nj * nk);
+      uint64_t j = (begin / nk) % nj;
+      uint64_t k = begin % nk;
+      for (uint64_t id = begin; id < end; id++) {
+        f(i, j, k);
+        if (++k == nk) { k = 0; if (++j == nj) { j = 0; i++; } }
+      }
+    });
+  }
+
+  // Call f(i, j) for (i, j) in [0, n[0]) x [0, n[1]), one tile of tile[0] x tile[1]
+  // iterations at a time (with j fastest within a tile). Tiles that fit in cache
+  // give better locality for neighborhood operations on row-major heap_arrays,
+  // and small n[0] no longer limits the parallelism.
+  //
+  // (a braced list of 2 extents also converts to std::array< uint64_t, 3 >,
+  // so the 2D and 3D versions are told apart by the arguments f accepts)
+  template < typename lambda, typename = std::enable_if_t< std::is_invocable_v< const lambda &, uint64_t, uint64_t > > >
+  void parallel_for(std::array< uint64_t, 2 > n, std::array< uint64_t, 2 > tile, const lambda & f,
+                    TileOrder order = TileOrder::ROW_MAJOR) {
+    for_each_tile(n, tile, order, [&](const std::array< uint64_t, 2 > & lo, const std::array< uint64_t, 2 > & hi) {
+      for (uint64_t i = lo[0]; i < hi[0]; i++) {
+        for (uint64_t j = lo[1]; j < hi[1]; j++) {
+          f(i, j);
+        }
+      }
+    });
+  }
+
+  template < typename lambda, typename = std::enable_if_t< std::is_invocable_v< const lambda &, uint64_t, uint64_t, uint64_t > > >
+  void parallel_for(std::array< uint64_t, 3 > n, std::array< uint64_t, 3 > tile, const lambda & f,
+                    TileOrder order = TileOrder::ROW_MAJOR) {
+    for_each_tile(n, tile, order, [&](const std::array< uint64_t, 3 > & lo, const std::array< uint64_t, 3 > & hi) {
+      for (uint64_t i = lo[0]; i < hi[0]; i++) {
+        for (uint64_t j = lo[1]; j < hi[1]; j++) {
+          for (uint64_t k = lo[2]; k < hi[2]; k++) {
+            f(i, j, k);
           }
-          stopwatch[i0].stop();
-        }, tid)
-      );
-    }
+        }
+      }
+    });
+  }
 
-    for (int i = 0; i < num_threads; i++) {
-      threads[i].join();
-      if (print_timings) {
-        std::cout << "thread " << i << ": " << stopwatch[i].elapsed() << std::endl;
+  // f(0) op f(1) op ... op f(n-1), for an associative op with the given identity.
+  // The blocks that are reduced independently have a fixed size, so the result
+  // (e.g. of a floating point sum) doesn't depend on the number of threads.
+  template < typename T, typename map, typename combine >
+  T parallel_reduce(uint64_t n, T identity, const map & f, const combine & op) {
+    uint64_t blocks = (n + algorithm_block_size - 1) / algorithm_block_size;
+    std::vector< T > partial(blocks, identity);
+    for_each_block(n, [&](uint64_t b, uint64_t begin, uint64_t end) {
+      T value = identity;
+      for (uint64_t i = begin; i < end; i++) {
+        value = op(value, f(i));
+      }
+      partial[b] = value;
+    });
+
+    T value = identity;
+    for (auto & p : partial) value = op(value, p);
+    return value;
+  }
+
+  // out[i] = in[0] op in[1] op ... op in[i], where out may be the same vector as in
+  template < typename T, typename combine >
+  void parallel_inclusive_scan(const std::vector< T > & in, std::vector< T > & out, T identity, const combine & op) {
+    scan(in, out, identity, op, true);
+  }
+
+  // out[i] = identity op in[0] op ... op in[i-1], where out may be the same vector as in
+  template < typename T, typename combine >
+  void parallel_exclusive_scan(const std::vector< T > & in, std::vector< T > & out, T identity, const combine & op) {
+    scan(in, out, identity, op, false);
+  }
+
+  // the elements of in for which keep(x) is true, in their original order
+  template < typename T, typename predicate >
+  void parallel_copy_if(const std::vector< T > & in, std::vector< T > & out, const predicate & keep) {
+    std::vector< uint8_t > flags;
+    std::vector< uint64_t > offsets;
+    uint64_t total = count_if(in, keep, flags, offsets);
+
+    out.resize(total);
+    for_each_block(in.size(), [&](uint64_t b, uint64_t begin, uint64_t end) {
+      uint64_t next = offsets[b];
+      for (uint64_t i = begin; i < end; i++) {
+        if (flags[i]) out[next++] = in[i];
       }
+    });
+  }
+
+  // stable partition: moves the elements for which pred(x) is true to the front,
+  // keeping their relative order (and that of the rest), and returns how many there are
+  template < typename T, typename predicate >
+  uint64_t parallel_partition(std::vector< T > & v, const predicate & pred) {
+    std::vector< uint8_t > flags;
+    std::vector< uint64_t > offsets;
+    uint64_t total = count_if(v, pred, flags, offsets);
+
+    std::vector< T > partitioned(v.size());
+    for_each_block(v.size(), [&](uint64_t b, uint64_t begin, uint64_t end) {
+      uint64_t next_true = offsets[b];
+      uint64_t next_false = total + (begin - offsets[b]);
+      for (uint64_t i = begin; i < end; i++) {
+        partitioned[flags[i] ? next_true++ : next_false++] = std::move(v[i]);
+      }
+    });
+    v.swap(partitioned);
+    return total;
+  }
+
+  // Stable sort: blocks of a fixed size are sorted independently, and then merged
+  // pairwise. Each merge is split into pieces at matching positions of its two
+  // inputs, so that the last few merges are also spread over all of the threads.
+  template < typename T, typename compare = std::less< T > >
+  void parallel_sort(std::vector< T > & v, const compare & less = compare()) {
+    uint64_t n = v.size();
+    uint64_t blocks = (n + sort_block_size - 1) / sort_block_size;
+
+    parallel_for(blocks, [&](uint64_t b) {
+      std::stable_sort(v.begin() + b * sort_block_size,
+                       v.begin() + std::min(n, (b + 1) * sort_block_size), less);
+    });
+
+    if (blocks <= 1) return;
+
+    std::vector< T > buffer(n);
+    T * src = v.data();
+    T * dst = buffer.data();
+    for (uint64_t width = sort_block_size; width < n; width *= 2) {
+      uint64_t pairs = (n + 2 * width - 1) / (2 * width);
+      uint64_t pieces = std::max< uint64_t >(1, (4 * num_threads + pairs - 1) / pairs);
+
+      parallel_for(pairs, pieces, [&](uint64_t p, uint64_t k) {
+        uint64_t offset = p * 2 * width;
+        const T * a = src + offset;
+        uint64_t na = std::min(width, n - offset);
+        const T * b = a + na;
+        uint64_t nb = std::min(width, n - offset - na);
+
+        // where piece k starts in a and b, splitting at evenly spaced elements of the longer one
+        auto split = [&](uint64_t k, uint64_t & ia, uint64_t & ib) {
+          if (k == 0) { ia = ib = 0; return; }
+          if (k == pieces) { ia = na; ib = nb; return; }
+          if (na >= nb) {
+            ia = (k * na) / pieces;
+            ib = std::lower_bound(b, b + nb, a[ia], less) - b;
+          } else {
+            ib = (k * nb) / pieces;
+            ia = std::upper_bound(a, a + na, b[ib], less) - a;
+          }
+        };
+
+        uint64_t a0, b0, a1, b1;
+        split(k, a0, b0);
+        split(k + 1, a1, b1);
+        std::merge(a + a0, a + a1, b + b0, b + b1, dst + offset + a0 + b0, less);
+      });
+
+      std::swap(src, dst);
     }
 
-    threads.clear();
+    if (src != v.data()) v.swap(buffer);
   }
 
+  // print how long each thread spent on each loop's chunks
+  bool print_timings;
+  int num_threads;
+
+  // iterations per chunk, where 0 picks a size that
+  // makes about 8 chunks per thread
+  uint64_t grain_size;
+
+  std::vector< std::thread > threads;
+
+ private:
+
+  // block sizes of the algorithms above, which don't depend
+  // on the number of threads, to keep their results deterministic
+  static constexpr uint64_t algorithm_block_size = 16384;
+  static constexpr uint64_t sort_block_size = 16384;
+
+  // f(b, begin, end) for each block [begin, end) of [0, n)
   template < typename lambda >
-  void parallel_for(uint64_t ni, uint64_t nj, const lambda & f) {
-    for (int tid = 0; tid < num_threads; tid++) {
-      threads.push_back(
-        std::thread([&](uint64_t i0) {
-          for (uint64_t i = i0; i < ni; i += num_threads) {
-            for (uint64_t j = 0; j < nj; j++) {
-              f(i, j);
-            }
+  void for_each_block(uint64_t n, const lambda & f) {
+    uint64_t blocks = (n + algorithm_block_size - 1) / algorithm_block_size;
+    parallel_for(blocks, [&](uint64_t b) {
+      f(b, b * algorithm_block_size, std::min(n, (b + 1) * algorithm_block_size));
+    });
+  }
+
+  // f(lo, hi) for each tile [lo[0], hi[0]) x [lo[1], hi[1]) x ... covering [0, n)
+  template < size_t d, typename lambda >
+  void for_each_tile(const std::array< uint64_t, d > & n, std::array< uint64_t, d > tile,
+                     TileOrder order, const lambda & f) {
+    std::array< uint64_t, d > tiles;
+    uint64_t num_tiles = 1;
+    for (size_t a = 0; a < d; a++) {
+      tile[a] = std::max< uint64_t >(tile[a], 1);
+      tiles[a] = (n[a] + tile[a] - 1) / tile[a];
+      num_tiles *= tiles[a];
+    }
+    if (num_tiles == 0) return;
+
+    auto coordinates = [&](uint64_t id) {
+      std::array< uint64_t, d > t;
+      for (size_t a = d; a-- > 0;) {
+        t[a] = id % tiles[a];
+        id /= tiles[a];
+      }
+      return t;
+    };
+
+    // the row-major tile ids, sorted by the Morton codes of their coordinates
+    std::vector< uint64_t > morton;
+    if (order == TileOrder::MORTON) {
+      std::vector< std::pair< uint64_t, uint64_t > > keys(num_tiles);
+      for (uint64_t id = 0; id < num_tiles; id++) {
+        auto t = coordinates(id);
+        uint64_t key = 0;
+        for (uint64_t bit = 0; bit < 64 / d; bit++) {
+          for (size_t a = 0; a < d; a++) {
+            key |= ((t[a] >> bit) & 1) << (bit * d + (d - 1 - a));
           }
-        }, tid)
-      );
+        }
+        keys[id] = {key, id};
+      }
+      std::sort(keys.begin(), keys.end());
+      morton.resize(num_tiles);
+      for (uint64_t id = 0; id < num_tiles; id++) morton[id] = keys[id].second;
     }
 
-    for (int i = 0; i < num_threads; i++) {
-      threads[i].join();
-      if (print_timings) {
-        std::cout << "thread " << i << ": " << stopwatch[i].elapsed() << std::endl;
+    run(num_tiles, 0, [&](uint64_t begin, uint64_t end) {
+      for (uint64_t id = begin; id < end; id++) {
+        auto t = coordinates((order == TileOrder::MORTON) ? morton[id] : id);
+        std::array< uint64_t, d > lo, hi;
+        for (size_t a = 0; a < d; a++) {
+          lo[a] = t[a] * tile[a];
+          hi[a] = std::min(n[a], lo[a] + tile[a]);
+        }
+        f(lo, hi);
       }
+    });
+  }
+
+  template < typename T, typename combine >
+  void scan(const std::vector< T > & in, std::vector< T > & out, T identity, const combine & op, bool inclusive) {
+    uint64_t n = in.size();
+    uint64_t blocks = (n + algorithm_block_size - 1) / algorithm_block_size;
+
+    std::vector< T > sums(blocks, identity);
+    for_each_block(n, [&](uint64_t b, uint64_t begin, uint64_t end) {
+      T value = identity;
+      for (uint64_t i = begin; i < end; i++) value = op(value, in[i]);
+      sums[b] = value;
+    });
+
+    T total = identity;
+    for (auto & sum : sums) {
+      T next = op(total, sum);
+      sum = total;
+      total = next;
     }
 
-    threads.clear();
+    out.resize(n);
+    for_each_block(n, [&](uint64_t b, uint64_t begin, uint64_t end) {
+      T value = sums[b];
+      for (uint64_t i = begin; i < end; i++) {
+        T x = in[i];
+        if (inclusive) {
+          value = op(value, x);
+          out[i] = value;
+        } else {
+          out[i] = value;
+          value = op(value, x);
+        }
+      }
+    });
   }
 
-  template < typename lambda >
-  void parallel_for(uint64_t ni, uint64_t nj, uint64_t nk, const lambda & f) {
-    for (int tid = 0; tid < num_threads; tid++) {
-      threads.push_back(
-        std::thread([&](uint64_t i0) {
-          stopwatch[i0].start();
-          for (uint64_t i = i0; i < ni; i += num_threads) {
-            for (uint64_t j = 0; j < nj; j++) {
-              for (uint64_t k = 0; k < nk; k++) {
-                f(i, j, k);
-              }
-            }
-          }
-          stopwatch[i0].stop();
-        }, tid)
-      );
+  // evaluates pred once per element into flags, and returns the number of
+  // elements it holds for, along with where each block's first one goes
+  template < typename T, typename predicate >
+  uint64_t count_if(const std::vector< T > & v, const predicate & pred,
+                    std::vector< uint8_t > & flags, std::vector< uint64_t > & offsets) {
+    uint64_t n = v.size();
+    uint64_t blocks = (n + algorithm_block_size - 1) / algorithm_block_size;
+
+    flags.resize(n);
+    offsets.assign(blocks, 0);
+    for_each_block(n, [&](uint64_t b, uint64_t begin, uint64_t end) {
+      uint64_t count = 0;
+      for (uint64_t i = begin; i < end; i++) {
+        flags[i] = pred(v[i]) ? 1 : 0;
+        count += flags[i];
+      }
+      offsets[b] = count;
+    });
+
+    uint64_t total = 0;
+    for (auto & offset : offsets) {
+      uint64_t count = offset;
+      offset = total;
+      total += count;
+    }
+    return total;
+  }
+
+  struct job {
+    void (*body)(const void *, uint64_t, uint64_t);
+    const void * context;
+    std::atomic< uint64_t > pending;
+
+    // seconds each thread spent on this job's chunks, when timing it (each thread
+    // only adds to its own entry, and the owner reads them once pending is 0)
+    double * busy;
+  };
+
+  struct task {
+    job * j;
+    uint64_t begin;
+    uint64_t end;
+  };
+
+  struct queue {
+    std::mutex mutex;
+    std::deque< task > tasks;
+  };
+
+  // index of the current thread's queue in this pool (the workers are 1 ... num_threads - 1)
+  int home() const {
+    for (int i = 0; i < int(threads.size()); i++) {
+      if (threads[i].get_id() == std::this_thread::get_id()) return i + 1;
     }
+    return 0;
+  }
+
+  template < typename range_lambda >
+  void run(uint64_t n, uint64_t grain, const range_lambda & f) {
+    if (n == 0) return;
+
+    grain = (grain > 0) ? grain : std::max< uint64_t >(1, n / (8 * num_threads));
+    uint64_t num_chunks = (n + grain - 1) / grain;
+
+    // per-run, since loops may run concurrently or be nested in one another
+    std::vector< double > busy(print_timings ? num_threads : 0, 0.0);
+    int self = home();
 
-    for (int i = 0; i < num_threads; i++) {
-      threads[i].join();
+    if (num_threads == 1 || num_chunks == 1) {
       if (print_timings) {
-        std::cout << "thread " << i << ": " << stopwatch[i].elapsed() << std::endl;
+        timer stopwatch;
+        stopwatch.start();
+        f(uint64_t(0), n);
+        stopwatch.stop();
+        busy[self] = stopwatch.elapsed();
+      } else {
+        f(uint64_t(0), n);
+      }
+    } else {
+      job j;
+      j.body = [](const void * context, uint64_t begin, uint64_t end) {
+        (*static_cast< const range_lambda * >(context))(begin, end);
+      };
+      j.context = &f;
+      j.pending = num_chunks;
+      j.busy = print_timings ? busy.data() : nullptr;
+
+      // contiguous runs of chunks for each queue, starting with the caller's own
+      for (int q = 0; q < num_threads; q++) {
+        uint64_t first = (num_chunks * q) / num_threads;
+        uint64_t last = (num_chunks * (q + 1)) / num_threads;
+        queue & target = queues[(self + q) % num_threads];
+        std::lock_guard< std::mutex > lock(target.mutex);
+        for (uint64_t c = first; c < last; c++) {
+          target.tasks.push_back(task{&j, c * grain, std::min(n, (c + 1) * grain)});
+        }
+      }
+
+      {
+        std::lock_guard< std::mutex > lock(mutex);
+        generation++;
+      }
+      wake.notify_all();
+
+      // help out until every chunk of this job is done
+      while (j.pending.load(std::memory_order_acquire) > 0) {
+        task t;
+        if (find(self, t)) {
+          execute(t, self);
+        } else {
+          std::unique_lock< std::mutex > lock(mutex);
+          done.wait(lock, [&]() { return j.pending.load(std::memory_order_acquire) == 0; });
+        }
       }
     }
 
-    threads.clear();
+    if (print_timings) {
+      for (int i = 0; i < num_threads; i++) {
+        std::cout << "thread " << i << ": " << busy[i] << std::endl;
+      }
+    }
   }
 
-  bool print_timings;
-  int num_threads;
-  std::vector< timer > stopwatch;
-  std::vector< std::thread > threads;
+  // take a task from the front of our own queue, or steal one from the back of another
+  bool find(int self, task & t) {
+    for (int q = 0; q < num_threads; q++) {
+      queue & source = queues[(self + q) % num_threads];
+      std::lock_guard< std::mutex > lock(source.mutex);
+      if (source.tasks.empty()) continue;
+      if (q == 0) {
+        t = source.tasks.front();
+        source.tasks.pop_front();
+      } else {
+        t = source.tasks.back();
+        source.tasks.pop_back();
+      }
+      return true;
+    }
+    return false;
+  }
+
+  void execute(const task & t, int self) {
+    if (t.j->busy) {
+      timer stopwatch;
+      stopwatch.start();
+      t.j->body(t.j->context, t.begin, t.end);
+      stopwatch.stop();
+      t.j->busy[self] += stopwatch.elapsed();
+    } else {
+      t.j->body(t.j->context, t.begin, t.end);
+    }
+    if (t.j->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      // the job may be destroyed as soon as its owner sees pending == 0,
+      // so don't touch it again after this point
+      std::lock_guard< std::mutex > lock(mutex);
+      done.notify_all();
+    }
+  }
+
+  void work(int self) {
+    uint64_t seen = 0;
+    while (true) {
+      {
+        std::unique_lock< std::mutex > lock(mutex);
+        wake.wait(lock, [&]() { return stop || generation != seen; });
+        if (stop) return;
+        seen = generation;
+      }
+
+      task t;
+      while (find(self, t)) {
+        execute(t, self);
+      }
+    }
+  }
+
+  std::unique_ptr< queue[] > queues;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  uint64_t generation;
+  bool stop;
+
 };
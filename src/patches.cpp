@@ -163,16 +163,16 @@ Patches::RenderGroup::RenderGroup(const std::vector<std::string> & shaders, bool
   glBindVertexArray(vao);
   glCheckError(__FILE__, __LINE__);
 
-  glGenBuffers(1, &position_vbo);
+  position_vbo.generate();
   glCheckError(__FILE__, __LINE__);
 
-  glBindBuffer(GL_ARRAY_BUFFER, position_vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, position_vbo.handle);
   program.setAttribute("vert", 3, 12, 0);
   glCheckError(__FILE__, __LINE__);
 
   if (palette) {
-    glGenBuffers(1, &color_vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, color_vbo);
+    value_vbo.generate();
+    glBindBuffer(GL_ARRAY_BUFFER, value_vbo.handle);
     program.setAttribute("value", 1, 4, 0);
     glCheckError(__FILE__, __LINE__);
 
@@ -183,8 +183,8 @@ Patches::RenderGroup::RenderGroup(const std::vector<std::string> & shaders, bool
     glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
  } else {
-    glGenBuffers(1, &color_vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, color_vbo);
+    color_vbo.generate();
+    glBindBuffer(GL_ARRAY_BUFFER, color_vbo.handle);
     program.setAttribute("rgba", 4, 4, 0, GL_TRUE, GL_UNSIGNED_BYTE);
     glCheckError(__FILE__, __LINE__);
   }
@@ -216,37 +216,49 @@ Patches::Patches() : groups{
 
 void Patches::append(const Quad4 & quad) {
   auto & g = groups[VERTEX_COLOR][PatchType::QUAD4];
+  size_t first = g.positions.size();
   for (auto x : quad) {
     g.positions.push_back(x);
     g.colors.push_back(color);
   }
+  g.position_vbo.mark_dirty(first, g.positions.size());
+  g.color_vbo.mark_dirty(first, g.colors.size());
   g.dirty = true;
 }
 
 void Patches::append(const Tri6 & tri) {
   auto & g = groups[VERTEX_COLOR][PatchType::TRI6];
+  size_t first = g.positions.size();
   for (auto x : tri) {
     g.positions.push_back(x);
     g.colors.push_back(color);
   }
+  g.position_vbo.mark_dirty(first, g.positions.size());
+  g.color_vbo.mark_dirty(first, g.colors.size());
   g.dirty = true;
 }
 
 void Patches::append(const Quad8 & quad) {
   auto & g = groups[VERTEX_COLOR][PatchType::QUAD8];
+  size_t first = g.positions.size();
   for (auto x : quad) {
     g.positions.push_back(x);
     g.colors.push_back(color);
   }
+  g.position_vbo.mark_dirty(first, g.positions.size());
+  g.color_vbo.mark_dirty(first, g.colors.size());
   g.dirty = true;
 }
 
 void Patches::append(const Quad9 & quad) {
   auto & g = groups[VERTEX_COLOR][PatchType::QUAD9];
+  size_t first = g.positions.size();
   for (auto x : quad) {
     g.positions.push_back(x);
     g.colors.push_back(color);
   }
+  g.position_vbo.mark_dirty(first, g.positions.size());
+  g.color_vbo.mark_dirty(first, g.colors.size());
   g.dirty = true;
 }
 
@@ -254,37 +266,49 @@ void Patches::append(const Quad9 & quad) {
 
 void Patches::append(const Quad4v & quad) {
   auto & g = groups[PALETTE][PatchType::QUAD4];
+  size_t first = g.positions.size();
   for (auto x : quad) {
     g.positions.push_back({x[0], x[1], x[2]});
     g.values.push_back(x[3]);
   }
+  g.position_vbo.mark_dirty(first, g.positions.size());
+  g.value_vbo.mark_dirty(first, g.values.size());
   g.dirty = true;
 }
 
 void Patches::append(const Tri6v & tri) {
   auto & g = groups[PALETTE][PatchType::TRI6];
+  size_t first = g.positions.size();
   for (auto x : tri) {
     g.positions.push_back({x[0], x[1], x[2]});
     g.values.push_back(x[3]);
   }
+  g.position_vbo.mark_dirty(first, g.positions.size());
+  g.value_vbo.mark_dirty(first, g.values.size());
   g.dirty = true;
 }
 
 void Patches::append(const Quad8v & quad) {
   auto & g = groups[PALETTE][PatchType::QUAD8];
+  size_t first = g.positions.size();
   for (auto x : quad) {
     g.positions.push_back({x[0], x[1], x[2]});
     g.values.push_back(x[3]);
   }
+  g.position_vbo.mark_dirty(first, g.positions.size());
+  g.value_vbo.mark_dirty(first, g.values.size());
   g.dirty = true;
 }
 
 void Patches::append(const Quad9v & quad) {
   auto & g = groups[PALETTE][PatchType::QUAD9];
+  size_t first = g.positions.size();
   for (auto x : quad) {
     g.positions.push_back({x[0], x[1], x[2]});
     g.values.push_back(x[3]);
   }
+  g.position_vbo.mark_dirty(first, g.positions.size());
+  g.value_vbo.mark_dirty(first, g.values.size());
   g.dirty = true;
 }
 
@@ -298,6 +322,43 @@ void Patches::clear() {
   }
 }
 
+// each of the render groups gets its own sections, tagged by where it is in `groups`
+void Patches::save(SceneWriter & scene, uint32_t tag) const {
+  for (int coloring : {VERTEX_COLOR, PALETTE}) {
+    for (PatchType type : patch_types) {
+      auto & g = groups[coloring][type];
+      uint32_t group_tag = tag * 8 + coloring * 4 + type;
+      scene.add(SectionType::PATCH_POSITIONS, g.positions, group_tag);
+      scene.add(SectionType::PATCH_COLORS, g.colors, group_tag);
+      scene.add(SectionType::PATCH_VALUES, g.values, group_tag);
+    }
+  }
+  scene.add(SectionType::PALETTE, palette, tag);
+  scene.add(SectionType::VALUE_BOUNDS, std::vector< float >{interval[0], interval[1]}, tag);
+}
+
+void Patches::load(const SceneFile & scene, uint32_t tag) {
+  for (int coloring : {VERTEX_COLOR, PALETTE}) {
+    for (PatchType type : patch_types) {
+      auto & g = groups[coloring][type];
+      uint32_t group_tag = tag * 8 + coloring * 4 + type;
+      g.positions = scene.read< glm::vec3 >(SectionType::PATCH_POSITIONS, group_tag);
+      g.colors = scene.read< rgbcolor >(SectionType::PATCH_COLORS, group_tag);
+      g.values = scene.read< float >(SectionType::PATCH_VALUES, group_tag);
+      g.position_vbo.mark_dirty(0, g.positions.size());
+      g.color_vbo.mark_dirty(0, g.colors.size());
+      g.value_vbo.mark_dirty(0, g.values.size());
+      g.dirty = true;
+    }
+  }
+
+  auto p = scene.read< rgbcolor >(SectionType::PALETTE, tag);
+  if (!p.empty()) palette = p;
+
+  auto bounds = scene.section< float >(SectionType::VALUE_BOUNDS, tag);
+  if (bounds.size() == 2) set_value_bounds(bounds.data[0], bounds.data[1]);
+}
+
 void Patches::set_light(glm::vec3 direction, float intensity) {
   auto unit_direction = normalize(direction);
   light[0] = unit_direction[0];
@@ -338,20 +399,17 @@ void Patches::draw(const Camera & camera) {
 
       glBindVertexArray(g.vao);
       if (g.dirty) {
-        glBindBuffer(GL_ARRAY_BUFFER, g.position_vbo);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * g.positions.size(), &g.positions[0], GL_STATIC_DRAW);
+        g.position_vbo.upload(g.positions);
 
         if (g.values.size() == 0) {
 
           // color by vertex
-          glBindBuffer(GL_ARRAY_BUFFER, g.color_vbo);
-          glBufferData(GL_ARRAY_BUFFER, sizeof(rgbcolor) * g.colors.size(), &g.colors[0], GL_STATIC_DRAW);
+          g.color_vbo.upload(g.colors);
 
         } else {
 
           // color by value
-          glBindBuffer(GL_ARRAY_BUFFER, g.color_vbo);
-          glBufferData(GL_ARRAY_BUFFER, sizeof(float) * g.values.size(), &g.values[0], GL_STATIC_DRAW);
+          g.value_vbo.upload(g.values);
 
           glBindTexture(GL_TEXTURE_1D, g.texture);
           glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA, palette.size(), 0, GL_RGBA, GL_UNSIGNED_BYTE, &palette[0]);
@@ -9,6 +9,8 @@
 #include "Camera.hpp"
 #include "rgbcolor.hpp"
 #include "vertex.hpp"
+#include "dynamic_buffer.hpp"
+#include "scene_file.hpp"
 
 namespace Graphics {
 
@@ -58,6 +60,11 @@ struct Patches {
     interval[1] = max;
   }
   
+  // Write the patches, palette and value bounds to a scene file, or replace them
+  // with the ones in it. The tag tells apart several Patches objects in the same file.
+  void save(SceneWriter & scene, uint32_t tag = 0) const;
+  void load(const SceneFile & scene, uint32_t tag = 0);
+
   void set_subdivision(PatchType p, int s) { 
     int clamped = std::max(1, std::min(s, 16)); 
     groups[0][p].subdivision = clamped;
@@ -73,8 +80,9 @@ struct Patches {
 
     bool dirty;
     GLuint vao;
-    GLuint color_vbo;
-    GLuint position_vbo;
+    DynamicBuffer< float > value_vbo;
+    DynamicBuffer< rgbcolor > color_vbo;
+    DynamicBuffer< glm::vec3 > position_vbo;
     GLuint texture;
 
     float subdivision;
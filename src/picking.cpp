@@ -0,0 +1,105 @@
+#include "picking.hpp"
+
+namespace Graphics {
+
+Ray pick_ray(Camera & camera, glm::ivec2 window_size, double window_x, double window_y) {
+
+  if (camera.is_perspective()) {
+    return Ray{camera.pos(), camera.ray_cast(window_size, window_x, window_y)};
+  }
+
+  // orthographic rays are parallel, so start from the near plane under the cursor
+  float x = (2.0f * window_x) / window_size.x - 1.0f;
+  float y = 1.0f - (2.0f * window_y) / window_size.y;
+
+  glm::mat4 inverse = glm::inverse(camera.matrix());
+  glm::vec4 near = inverse * glm::vec4(x, y, -1.0f, 1.0f);
+  glm::vec4 far = inverse * glm::vec4(x, y, 1.0f, 1.0f);
+
+  glm::vec3 origin = glm::vec3(near) / near.w;
+  glm::vec3 direction = glm::normalize(glm::vec3(far) / far.w - origin);
+  return Ray{origin, direction};
+
+}
+
+Picker::Picker(const Spheres * s, const Cylinders * c, const Triangles * t) :
+  spheres(s), cylinders(c), triangles(t) {}
+
+void Picker::build() {
+  if (spheres) sphere_bvh.build(sphere_primitives());
+  if (cylinders) cylinder_bvh.build(cylinder_primitives());
+  if (triangles) triangle_bvh.build(triangles->primitives());
+}
+
+void Picker::refit() {
+  if (spheres) sphere_bvh.refit(sphere_primitives());
+  if (cylinders) cylinder_bvh.refit(cylinder_primitives());
+  if (triangles) triangle_bvh.refit(triangles->primitives());
+}
+
+Pick Picker::pick(const Ray & ray) const {
+
+  // each cell's image is translated, so its hits are at the same distances along the ray
+  if (lattice.num_cells() > 0) {
+    Pick closest{Pick::NONE, 0, miss, 0};
+    glm::uvec3 n = lattice.counts;
+    for (uint32_t k = 0; k < n.z; k++) {
+      for (uint32_t j = 0; j < n.y; j++) {
+        for (uint32_t i = 0; i < n.x; i++) {
+          glm::vec3 offset = float(i) * lattice.basis[0] + float(j) * lattice.basis[1] + float(k) * lattice.basis[2];
+          Pick hit = nearest(Ray{ray.origin - offset, ray.direction}, closest.t);
+          if (hit.type != Pick::NONE) {
+            closest = hit;
+            closest.cell = glm::uvec3(i, j, k);
+          }
+        }
+      }
+    }
+    return closest;
+  }
+
+  if (placements.empty()) return nearest(ray, miss);
+
+  // A placement rotates, scales and then translates the primitives, so undoing that to the ray
+  // gives the same hits, at distances along it divided by the scale.
+  Pick closest{Pick::NONE, 0, miss, 0};
+  for (uint32_t p = 0; p < placements.size(); p++) {
+    const Placement & placement = placements[p];
+    if (!(placement.scale > 0.0f)) continue;
+
+    glm::quat inverse = glm::conjugate(glm::quat(placement.rotation.w, placement.rotation.x,
+                                                 placement.rotation.y, placement.rotation.z));
+    Ray local{inverse * ((ray.origin - placement.translation) / placement.scale), inverse * ray.direction};
+
+    Pick hit = nearest(local, closest.t / placement.scale);
+    if (hit.type != Pick::NONE) {
+      closest = hit;
+      closest.t *= placement.scale;
+      closest.placement = p;
+    }
+  }
+  return closest;
+
+}
+
+// the nearest primitive along the ray, closer than t_max, without placements
+Pick Picker::nearest(const Ray & ray, float t_max) const {
+
+  Pick closest{Pick::NONE, 0, t_max, 0};
+
+  auto nearest_in = [&](const BVH & bvh, const auto & primitives, Pick::Type type) {
+    if (bvh.size() != primitives.size()) return;
+    auto hit = bvh.raycast(ray, [&](uint32_t i) { return intersect(ray, primitives[i]); }, closest.t);
+    if (hit.t < closest.t) closest = Pick{type, hit.primitive, hit.t, 0};
+  };
+
+  if (spheres) nearest_in(sphere_bvh, sphere_primitives(), Pick::SPHERE);
+  if (cylinders) nearest_in(cylinder_bvh, cylinder_primitives(), Pick::CYLINDER);
+  if (triangles) nearest_in(triangle_bvh, triangles->primitives(), Pick::TRIANGLE);
+
+  if (closest.type == Pick::NONE) closest.t = miss;
+  return closest;
+
+}
+
+}
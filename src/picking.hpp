@@ -0,0 +1,75 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include "Camera.hpp"
+#include "bvh.hpp"
+#include "placements.hpp"
+
+namespace Graphics {
+
+// the ray under a cursor position, in the same (screen) coordinates as window_size
+Ray pick_ray(Camera & camera, glm::ivec2 window_size, double window_x, double window_y);
+
+struct Pick {
+  enum Type { NONE, SPHERE, CYLINDER, TRIANGLE };
+
+  Type type;
+  uint32_t index;     // into primitives() of the picked collection
+  float t;            // distance along the ray
+  uint32_t placement; // which of the picker's placements it was hit in, if it has any
+  glm::uvec3 cell;    // which cell of the picker's lattice it was hit in, if it has one
+};
+
+// Ray picking on the CPU, against a BVH over each of the given collections
+// (any of which may be nullptr), so it doesn't stall the GPU with a readback.
+// Call build() after appending or removing primitives, and refit() after moving them.
+struct Picker {
+
+  Picker(const Spheres * s = nullptr, const Cylinders * c = nullptr, const Triangles * t = nullptr);
+
+  void build();
+  void refit();
+
+  // the nearest primitive along the ray
+  Pick pick(const Ray & ray) const;
+
+  // Pick the copies drawn at each placement (see Spheres::set_placements) instead of the
+  // primitives themselves, by moving the ray into each placement's frame. The BVHs are the
+  // same, so this doesn't need a build(). An empty list goes back to the primitives.
+  void set_placements(const std::vector< Placement > & p) { placements = p; }
+
+  // Likewise, pick the images in every cell of a lattice (see Spheres::set_lattice), which takes
+  // precedence over placements. A lattice with no cells goes back to the primitives.
+  void set_lattice(const Lattice & l) { lattice = l; }
+
+  const Spheres * spheres;
+  const Cylinders * cylinders;
+  const Triangles * triangles;
+
+  // Where the spheres and cylinders are drawn, when it isn't their primitives(): e.g. a trajectory
+  // frame streamed with Spheres::map_positions, kept with the same order and size. nullptr goes
+  // back to primitives(). Call refit() after changing them, or what they point to.
+  const std::vector< Sphere > * sphere_positions = nullptr;
+  const std::vector< Cylinder > * cylinder_positions = nullptr;
+
+ private:
+  const std::vector< Sphere > & sphere_primitives() const {
+    return sphere_positions ? *sphere_positions : spheres->primitives();
+  }
+  const std::vector< Cylinder > & cylinder_primitives() const {
+    return cylinder_positions ? *cylinder_positions : cylinders->primitives();
+  }
+
+  Pick nearest(const Ray & ray, float t_max) const;
+
+  BVH sphere_bvh;
+  BVH cylinder_bvh;
+  BVH triangle_bvh;
+
+  std::vector< Placement > placements;
+  Lattice lattice{};
+
+};
+
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <initializer_list>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "Shader.hpp"
+#include "buffer_texture.hpp"
+
+namespace Graphics {
+
+// Where to draw one copy of a set of primitives (e.g. one of the molecules in a solvent box):
+// rotated about the origin, then scaled, then translated. The vertex shaders read it as two
+// texels, `rotation` and `translation` (x, y, z, scale), see draw_placed().
+struct Placement {
+  glm::vec4 rotation; // unit quaternion, as (x, y, z, w) whatever glm's own quaternion layout is
+  glm::vec3 translation;
+  float scale;
+};
+
+inline Placement make_placement(glm::quat q, glm::vec3 translation, float scale = 1.0f) {
+  return Placement{glm::vec4(q.x, q.y, q.z, q.w), translation, scale};
+}
+
+static_assert(sizeof(Placement) == 32, "Placement must match the vertex shader's two texels");
+
+// Draw each of n primitives at each of m placements, with a single instanced draw of n * m
+// instances (or a few, if that overflows the GLsizei instance count). As in draw_lattice(), the
+// per-primitive `attributes` advance once every m instances, and the vertex shader reads the
+// placement of an instance from the buffer texture in unit 2 (two texels per Placement), at
+// placement_first + gl_InstanceID % placement_count, so no attributes are rebound between copies.
+// bind(first) points the per-primitive attributes at primitive `first`, and draw(count) issues
+// the instanced draw call.
+template < typename bind_function, typename draw_function >
+void draw_placed(ShaderProgram & program, std::initializer_list< const char * > attributes,
+                 BufferTexture & placement_texels, GLuint placement_buffer, uint32_t m, uint32_t n,
+                 const bind_function & bind, const draw_function & draw) {
+  if (n == 0 || m == 0) return;
+
+  std::vector< GLint > locations;
+  for (auto name : attributes) locations.push_back(program.attribute(name));
+
+  placement_texels.bind(2, placement_buffer, GL_RGBA32F);
+  program.setUniform("placement_texels", 2);
+  bind(0);
+
+  uint32_t span = std::min< uint64_t >(m, std::max< uint64_t >(1, 0x7FFFFFFF / n));
+  for (uint32_t first = 0; first < m; first += span) {
+    uint32_t copies = std::min(span, m - first);
+    for (GLint location : locations) glVertexAttribDivisor(location, copies);
+    program.setUniform("placement_first", int(first));
+    program.setUniform("placement_count", int(copies));
+    draw(n * copies);
+  }
+
+  for (GLint location : locations) glVertexAttribDivisor(location, 1);
+  program.setUniform("placement_count", 0);
+}
+
+// A periodic lattice of images of a set of primitives, e.g. of a crystal's unit cell: the image in
+// cell (i, j, k) is translated by i * basis[0] + j * basis[1] + k * basis[2], for i < counts.x, etc.
+struct Lattice {
+  glm::vec3 basis[3];
+  glm::uvec3 counts;
+
+  uint64_t num_cells() const { return uint64_t(counts.x) * counts.y * counts.z; }
+};
+
+// the cells [first, first + span) of a lattice, drawn together by draw_lattice()
+struct CellBlock {
+  glm::uvec3 first;
+  glm::uvec3 span;
+};
+
+// Draw each of n primitives in every cell of some blocks of lattice cells, with one instanced draw
+// call per block. The per-primitive attributes advance once every `cells` instances, and the
+// vertex shader finds the cell of an instance from gl_InstanceID % cells (with the uniforms
+// `lattice`, `cell_first` and `cell_span`), so the images take no memory at all. bind(first) and
+// draw(count) are as in draw_placed().
+template < typename bind_function, typename draw_function >
+void draw_lattice(ShaderProgram & program, std::initializer_list< const char * > attributes,
+                  const Lattice & lattice, const std::vector< CellBlock > & blocks, uint32_t n,
+                  const bind_function & bind, const draw_function & draw) {
+  if (n == 0 || blocks.empty()) return;
+
+  std::vector< GLint > locations;
+  for (auto name : attributes) locations.push_back(program.attribute(name));
+
+  program.setUniform("lattice", glm::mat3(lattice.basis[0], lattice.basis[1], lattice.basis[2]));
+  bind(0);
+
+  // instance counts are GLsizei, so large blocks are drawn a layer, row or cell at a time
+  auto draw_block = [&](const CellBlock & block, auto & draw_block) -> void {
+    uint64_t cells = uint64_t(block.span.x) * block.span.y * block.span.z;
+    if (cells > 1 && n * cells > 0x7FFFFFFF) {
+      int axis = (block.span.z > 1) ? 2 : (block.span.y > 1) ? 1 : 0;
+      CellBlock part = block;
+      part.span[axis] = 1;
+      for (uint32_t i = 0; i < block.span[axis]; i++) {
+        part.first[axis] = block.first[axis] + i;
+        draw_block(part, draw_block);
+      }
+      return;
+    }
+    for (GLint location : locations) glVertexAttribDivisor(location, cells);
+    program.setUniform("cell_first", glm::ivec3(block.first));
+    program.setUniform("cell_span", glm::ivec3(block.span));
+    draw(n * cells);
+  };
+  for (auto & block : blocks) draw_block(block, draw_block);
+
+  for (GLint location : locations) glVertexAttribDivisor(location, 1);
+  program.setUniform("cell_span", glm::ivec3(0));
+}
+
+}
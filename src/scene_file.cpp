@@ -0,0 +1,130 @@
+#include "scene_file.hpp"
+
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+
+namespace Graphics {
+
+SceneWriter::SceneWriter(const std::string & f) : filename(f), outfile(f, std::ios::binary) {
+  if (!outfile) {
+    std::cout << "could not open file for writing: " << filename << std::endl;
+    return;
+  }
+
+  // placeholder, until finish() knows where the section table is
+  SceneFileHeader header{};
+  outfile.write((const char *)&header, sizeof(header));
+}
+
+SceneWriter::~SceneWriter() { finish(); }
+
+void SceneWriter::add(SectionType type, uint32_t tag, uint32_t element_size, uint64_t count, const void * elements) {
+  if (!outfile) return;
+
+  // pad to the next section boundary
+  uint64_t position = outfile.tellp();
+  uint64_t offset = ((position + section_alignment - 1) / section_alignment) * section_alignment;
+  static const char zeros[section_alignment] = {};
+  outfile.write(zeros, offset - position);
+
+  outfile.write((const char *)elements, element_size * count);
+  sections.push_back(SceneSection{type, tag, element_size, 0, count, offset});
+}
+
+void SceneWriter::finish() {
+  if (!outfile.is_open()) return;
+
+  SceneFileHeader header{};
+  std::memcpy(header.magic, SceneFileHeader::expected_magic, sizeof(header.magic));
+  header.version = SceneFileHeader::current_version;
+  header.byte_order = SceneFileHeader::byte_order_mark;
+  header.num_sections = sections.size();
+  header.table_offset = outfile.tellp();
+
+  outfile.write((const char *)sections.data(), sizeof(SceneSection) * sections.size());
+  outfile.seekp(0);
+  outfile.write((const char *)&header, sizeof(header));
+  outfile.close();
+
+  if (!outfile) std::cout << "failed to write scene file: " << filename << std::endl;
+}
+
+SceneFile::SceneFile(const std::string & f) :
+  valid(false), filename(f), file(f, femto::MapAccess::READ_ONLY, femto::MapAdvice::SEQUENTIAL) {
+
+  if (!file) {
+    std::cout << "file not found: " << filename << std::endl;
+    return;
+  }
+
+  const SceneFileHeader * header = (const SceneFileHeader *)file.data();
+  if (file.size() < sizeof(SceneFileHeader) ||
+      std::memcmp(header->magic, SceneFileHeader::expected_magic, sizeof(header->magic)) != 0) {
+    std::cout << "not a scene file: " << filename << std::endl;
+    return;
+  }
+
+  if (header->byte_order != SceneFileHeader::byte_order_mark) {
+    std::cout << "scene file was written with a different byte order: " << filename << std::endl;
+    return;
+  }
+
+  if (header->version > SceneFileHeader::current_version) {
+    std::cout << "scene file version " << header->version << " is newer than this reader: " << filename << std::endl;
+    return;
+  }
+
+  uint64_t table_bytes = uint64_t(header->num_sections) * sizeof(SceneSection);
+  if (header->table_offset > file.size() || file.size() - header->table_offset < table_bytes) {
+    std::cout << "scene file is truncated: " << filename << std::endl;
+    return;
+  }
+
+  table.resize(header->num_sections);
+  std::memcpy(table.data(), file.data() + header->table_offset, table_bytes);
+
+  for (auto & s : table) {
+    uint64_t bytes = s.count * s.element_size;
+    if (s.offset > header->table_offset || header->table_offset - s.offset < bytes) {
+      std::cout << "scene file is truncated: " << filename << std::endl;
+      table.clear();
+      return;
+    }
+  }
+
+  valid = true;
+}
+
+const SceneSection * SceneFile::find(SectionType type, uint32_t tag, uint32_t element_size) const {
+  for (auto & s : table) {
+    if (s.type != type || s.tag != tag) continue;
+    if (s.element_size != element_size) {
+      std::cout << "scene file section " << uint32_t(type) << " has " << s.element_size
+                << " byte elements, but expected " << element_size << ": " << filename << std::endl;
+      return nullptr;
+    }
+    return &s;
+  }
+  return nullptr;
+}
+
+std::filesystem::path cache_path(const std::string & filename, const std::string & extension) {
+  std::error_code error;
+  std::filesystem::path directory;
+  if (const char * dir = std::getenv("GRAPHICS_CACHE_DIR")) {
+    directory = dir;
+  } else {
+    directory = std::filesystem::temp_directory_path(error) / "graphics_scene_cache";
+    if (error) return {};
+  }
+
+  std::filesystem::create_directories(directory, error);
+  if (error) return {};
+
+  std::filesystem::path source = std::filesystem::absolute(filename, error);
+  size_t hash = std::hash< std::string >{}(source.string());
+  return directory / (source.filename().string() + "." + std::to_string(hash) + extension);
+}
+
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+#include <filesystem>
+
+#include "misc/mapped_file.hpp"
+
+namespace Graphics {
+
+// A binary scene file is a header, followed by sections that each hold an
+// array of elements with exactly the same layout as the GL vertex buffers
+// they're drawn from, followed by a table describing the sections.
+//
+// Every section starts on a 4KB boundary, so it can also be mapped on its
+// own, and the elements can be passed to glBufferData as they are. Loading
+// a scene is then a copy (or a page fault) per section, with no parsing.
+enum class SectionType : uint32_t {
+  SPHERES,           // Sphere
+  SPHERE_COLORS,     // rgbcolor
+  CYLINDERS,         // Cylinder
+  CYLINDER_COLORS,   // rgbcolor
+  TRIANGLES,         // Tri3
+  TRIANGLE_NORMALS,  // Tri3
+  TRIANGLE_COLORS,   // color3
+  PATCH_POSITIONS,   // glm::vec3, tagged by patch group
+  PATCH_COLORS,      // rgbcolor, tagged by patch group
+  PATCH_VALUES,      // float, tagged by patch group
+  PALETTE,           // rgbcolor
+  VALUE_BOUNDS,      // float[2], the range of values mapped onto the palette
+  UNIT_CELL,         // glm::vec3, the 3 basis vectors of a crystal's unit cell
+  SOURCE_FILE        // SceneSource, the file a cached scene was converted from
+};
+
+struct SceneFileHeader {
+  static constexpr char expected_magic[8] = {'F', 'E', 'M', 'T', 'O', 'S', 'C', 'N'};
+  static constexpr uint32_t current_version = 1;
+  static constexpr uint32_t byte_order_mark = 0x01020304;
+
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t num_sections;
+  uint32_t reserved;
+  uint64_t table_offset;  // bytes from the start of the file to the section table
+};
+
+struct SceneSection {
+  SectionType type;
+  uint32_t tag;  // distinguishes sections of the same type, e.g. patch groups
+  uint32_t element_size;
+  uint32_t reserved;
+  uint64_t count;
+  uint64_t offset;  // bytes from the start of the file to the first element
+};
+
+// For a scene file that caches the result of importing another file: it is only
+// valid while the source and the importer that converted it are unchanged.
+struct SceneSource {
+  uint64_t size;              // bytes
+  int64_t modified;           // last write time, in the file clock's ticks
+  uint32_t importer_version;  // bumped by the importer when its output changes
+  uint32_t reserved;
+
+  bool operator==(const SceneSource & other) const {
+    return size == other.size && modified == other.modified && importer_version == other.importer_version;
+  }
+};
+
+static_assert(sizeof(SceneFileHeader) == 32, "unexpected SceneFileHeader padding");
+static_assert(sizeof(SceneSection) == 32, "unexpected SceneSection padding");
+static_assert(sizeof(SceneSource) == 24, "unexpected SceneSource padding");
+
+// Writes each section as soon as it is added, and the header and section
+// table when finished (or destroyed).
+struct SceneWriter {
+
+  static constexpr uint64_t section_alignment = 4096;
+
+  SceneWriter(const std::string & filename);
+  ~SceneWriter();
+
+  explicit operator bool() const { return bool(outfile); }
+
+  void add(SectionType type, uint32_t tag, uint32_t element_size, uint64_t count, const void * elements);
+
+  template < typename T >
+  void add(SectionType type, const std::vector< T > & elements, uint32_t tag = 0) {
+    add(type, tag, sizeof(T), elements.size(), elements.data());
+  }
+
+  void finish();
+
+ private:
+  std::string filename;
+  std::ofstream outfile;
+  std::vector< SceneSection > sections;
+};
+
+// a section's elements, pointing into the mapped file
+template < typename T >
+struct SectionView {
+  const T * begin() const { return data; }
+  const T * end() const { return data + count; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  const T * data;
+  size_t count;
+};
+
+// A scene file, mapped into memory, so opening it only reads the section table.
+struct SceneFile {
+
+  SceneFile(const std::string & filename);
+
+  // false if the file is missing or isn't a valid scene file
+  explicit operator bool() const { return valid; }
+
+  // the first section with this type and tag, or an empty view if there is none
+  template < typename T >
+  SectionView< T > section(SectionType type, uint32_t tag = 0) const {
+    const SceneSection * s = find(type, tag, sizeof(T));
+    if (s == nullptr) return SectionView< T >{nullptr, 0};
+    return SectionView< T >{(const T *)(file.data() + s->offset), size_t(s->count)};
+  }
+
+  template < typename T >
+  std::vector< T > read(SectionType type, uint32_t tag = 0) const {
+    SectionView< T > s = section< T >(type, tag);
+    return std::vector< T >(s.begin(), s.end());
+  }
+
+  const std::vector< SceneSection > & sections() const { return table; }
+
+ private:
+  const SceneSection * find(SectionType type, uint32_t tag, uint32_t element_size) const;
+
+  bool valid;
+  std::string filename;
+  femto::mapped_file file;
+  std::vector< SceneSection > table;
+};
+
+// Where a file derived from `filename` (a cached scene, a trajectory's frame index) goes:
+// in $GRAPHICS_CACHE_DIR if it is set, or else in the system's temporary directory, named
+// after the file, a hash of its full path and the extension. Returns an empty path if
+// there's nowhere to write it.
+std::filesystem::path cache_path(const std::string & filename, const std::string & extension);
+
+}
@@ -1,7 +1,15 @@
 #include "spheres.hpp"
-
+#include "culling.hpp"
+#include "placements.hpp"
+#include "buffer_texture.hpp"
+
+#include <map>
+#include <array>
+#include <atomic>
+#include <cmath>
 #include <string>
 #include <iostream>
+#include <algorithm>
 
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
@@ -11,19 +19,101 @@
 
 namespace Graphics {
 
-#if 0
-static float instance_vertices[8] = {
-	-1.0f, -1.0f,
-	 1.0f, -1.0f,
-	 1.0f, +1.0f,
-	-1.0f, +1.0f,
+// corners of the camera-facing quad used by the impostor shaders,
+// ordered for drawing as a GL_TRIANGLE_STRIP
+static float impostor_vertices[4][2] = {
+  {-1.0f, -1.0f},
+  { 1.0f, -1.0f},
+  {-1.0f,  1.0f},
+  { 1.0f,  1.0f}
 };
 
-static uint32_t instance_triangles[4] = {1, 2, 0, 3};
-#else
 static float instance_vertices[122][3] = {{-0.6070619982,0,0.7946544723},{0.8944271910,0,0.4472135955},{0,0,1.000000000},{-0.7236067977,-0.5257311121,0.4472135955},{-0.7236067977,0.5257311121,0.4472135955},{0,0,-1.000000000},{0.2763932023,-0.8506508084,0.4472135955},{0.2763932023,0.8506508084,0.4472135955},{-0.1875924741,-0.5773502692,0.7946544723},{-0.1875924741,0.5773502692,0.7946544723},{0.4911234732,0.3568220898,0.7946544723},{0.4911234732,-0.3568220898,0.7946544723},{0.6070619982,0,-0.7946544723},{0.1875924741,-0.5773502692,-0.7946544723},{0.1875924741,0.5773502692,-0.7946544723},{-0.4911234732,0.3568220898,-0.7946544723},{-0.4911234732,-0.3568220898,-0.7946544723},{0.7946544723,-0.5773502692,0.1875924741},{-0.3035309991,-0.9341723590,0.1875924741},{0.7946544723,0.5773502692,0.1875924741},{-0.3035309991,0.9341723590,0.1875924741},{-0.9822469464,0,0.1875924741},{0.9822469464,0,-0.1875924741},{0.3035309991,-0.9341723590,-0.1875924741},{0.3035309991,0.9341723590,-0.1875924741},{-0.7946544723,-0.5773502692,-0.1875924741},{-0.7946544723,0.5773502692,-0.1875924741},{0.7236067977,-0.5257311121,-0.4472135955},{-0.8944271910,0,-0.4472135955},{0.7236067977,0.5257311121,-0.4472135955},{-0.2763932023,-0.8506508084,-0.4472135955},{-0.2763932023,0.8506508084,-0.4472135955},{-0.01432416010,-0.9420843166,0.3350700804},{0.04687174329,-0.7537426922,0.6554959905},{-0.2628655561,-0.8090169944,0.5257311121},{-0.01432416010,0.9420843166,0.3350700804},{-0.2628655561,0.8090169944,0.5257311121},{0.04687174329,0.7537426922,0.6554959905},{0.01432416010,-0.9420843166,-0.3350700804},{-0.04687174329,-0.7537426922,-0.6554959905},{0.2628655561,-0.8090169944,-0.5257311121},{0.01432416010,0.9420843166,-0.3350700804},{0.2628655561,0.8090169944,-0.5257311121},{-0.04687174329,0.7537426922,-0.6554959905},{-0.2592300067,-0.1883416244,-0.9472735804},{0.09901705165,-0.3047431498,-0.9472735804},{-0.1624598481,-0.5000000000,-0.8506508084},{0,-1.000000000,0},{-0.3061017500,-0.9420843166,-0.1370359771},{0.09901705165,0.3047431498,-0.9472735804},{-0.2592300067,0.1883416244,-0.9472735804},{-0.1624598481,0.5000000000,-0.8506508084},{-0.3061017500,0.9420843166,-0.1370359771},{0,1.000000000,0},{-0.09901705165,-0.3047431498,0.9472735804},{0.1624598481,-0.5000000000,0.8506508084},{0.2592300067,-0.1883416244,0.9472735804},{0.3061017500,-0.9420843166,0.1370359771},{-0.09901705165,0.3047431498,0.9472735804},{0.2592300067,0.1883416244,0.9472735804},{0.1624598481,0.5000000000,0.8506508084},{0.3061017500,0.9420843166,0.1370359771},{0.3204259101,0,-0.9472735804},{0.4253254042,-0.3090169944,-0.8506508084},{0.4253254042,0.3090169944,-0.8506508084},{0.5653317567,-0.7537426922,0.3350700804},{0.5877852523,-0.8090169944,0},{0.5653317567,0.7537426922,0.3350700804},{0.5877852523,0.8090169944,0},{-0.9004018371,-0.2774969782,0.3350700804},{-0.7023677338,-0.2774969782,0.6554959905},{-0.8506508084,0,0.5257311121},{-0.9004018371,0.2774969782,0.3350700804},{-0.7023677338,0.2774969782,0.6554959905},{-0.4809588754,-0.5822401279,0.6554959905},{-0.4253254042,-0.3090169944,0.8506508084},{-0.4253254042,0.3090169944,0.8506508084},{-0.4809588754,0.5822401279,0.6554959905},{-0.5653317567,-0.7537426922,-0.3350700804},{-0.6881909602,-0.5000000000,-0.5257311121},{-0.4051188016,-0.6373411668,-0.6554959905},{-0.5653317567,0.7537426922,-0.3350700804},{-0.4051188016,0.6373411668,-0.6554959905},{-0.6881909602,0.5000000000,-0.5257311121},{-0.3204259101,0,0.9472735804},{0.7023677338,-0.2774969782,-0.6554959905},{0.4809588754,-0.5822401279,-0.6554959905},{0.7023677338,0.2774969782,-0.6554959905},{0.4809588754,0.5822401279,-0.6554959905},{0.6881909602,-0.5000000000,0.5257311121},{0.4051188016,-0.6373411668,0.6554959905},{0.4051188016,0.6373411668,0.6554959905},{0.6881909602,0.5000000000,0.5257311121},{-0.7313360643,0.1883416244,-0.6554959905},{-0.5257311121,0,-0.8506508084},{-0.7313360643,-0.1883416244,-0.6554959905},{0.7313360643,0.1883416244,0.6554959905},{0.5257311121,0,0.8506508084},{0.7313360643,-0.1883416244,0.6554959905},{-0.5877852523,-0.8090169944,0},{-0.5877852523,0.8090169944,0},{-0.8915490193,-0.3047431498,-0.3350700804},{-0.8915490193,0.3047431498,-0.3350700804},{0.9004018371,-0.2774969782,-0.3350700804},{0.8506508084,0,-0.5257311121},{0.9004018371,0.2774969782,-0.3350700804},{0.9510565163,-0.3090169944,0},{0.8013847855,-0.5822401279,-0.1370359771},{0.8013847855,0.5822401279,-0.1370359771},{0.9510565163,0.3090169944,0},{0.9905660710,0,0.1370359771},{0.8915490193,-0.3047431498,0.3350700804},{0.8915490193,0.3047431498,0.3350700804},{-0.5421547788,-0.7705817523,0.3350700804},{-0.5421547788,0.7705817523,0.3350700804},{0.5421547788,-0.7705817523,-0.3350700804},{0.5421547788,0.7705817523,-0.3350700804},{-0.9510565163,-0.3090169944,0},{-0.9905660710,0,-0.1370359771},{-0.9510565163,0.3090169944,0},{-0.8013847855,-0.5822401279,0.1370359771},{-0.8013847855,0.5822401279,0.1370359771}};
 static uint32_t instance_triangles[240][3] = {{6, 33, 32}, {32, 33, 34}, {32, 34, 18}, {33, 8, 34}, {20, 36, 35}, {35, 36, 37}, {35, 37, 7}, {36, 9, 37}, {30, 39, 38}, {38, 39, 40}, {38, 40, 23}, {39, 13, 40}, {24, 42, 41}, {41, 42, 43}, {41, 43, 31}, {42, 14, 43}, {5, 45, 44}, {44, 45, 46}, {44, 46, 16}, {45, 13, 46}, {23, 47, 38}, {38, 47, 48}, {38, 48, 30}, {47, 18, 48}, {5, 50, 49}, {49, 50, 51}, {49, 51, 14}, {50, 15, 51}, {20, 53, 52}, {52, 53, 41}, {52, 41, 31}, {53, 24, 41}, {8, 55, 54}, {54, 55, 56}, {54, 56, 2}, {55, 11, 56}, {6, 32, 57}, {57, 32, 47}, {57, 47, 23}, {32, 18, 47}, {2, 59, 58}, {58, 59, 60}, {58, 60, 9}, {59, 10, 60}, {7, 61, 35}, {35, 61, 53}, {35, 53, 20}, {61, 24, 53}, {12, 63, 62}, {62, 63, 45}, {62, 45, 5}, {63, 13, 45}, {5, 49, 62}, {62, 49, 64}, {62, 64, 12}, {49, 14, 64}, {6, 57, 65}, {65, 57, 66}, {65, 66, 17}, {57, 23, 66}, {7, 67, 61}, {61, 67, 68}, {61, 68, 24}, {67, 19, 68}, {3, 70, 69}, {69, 70, 71}, {69, 71, 21}, {70, 0, 71}, {21, 71, 72}, {72, 71, 73}, {72, 73, 4}, {71, 0, 73}, {8, 75, 74}, {74, 75, 70}, {74, 70, 3}, {75, 0, 70}, {0, 76, 73}, {73, 76, 77}, {73, 77, 4}, {76, 9, 77}, {25, 79, 78}, {78, 79, 80}, {78, 80, 30}, {79, 16, 80}, {31, 82, 81}, {81, 82, 83}, {81, 83, 26}, {82, 15, 83}, {2, 84, 54}, {54, 84, 75}, {54, 75, 8}, {84, 0, 75}, {2, 58, 84}, {84, 58, 76}, {84, 76, 0}, {58, 9, 76}, {27, 86, 85}, {85, 86, 63}, {85, 63, 12}, {86, 13, 63}, {12, 64, 87}, {87, 64, 88}, {87, 88, 29}, {64, 14, 88}, {17, 89, 65}, {65, 89, 90}, {65, 90, 6}, {89, 11, 90}, {7, 91, 67}, {67, 91, 92}, {67, 92, 19}, {91, 10, 92}, {15, 94, 93}, {93, 94, 95}, {93, 95, 28}, {94, 16, 95}, {10, 97, 96}, {96, 97, 98}, {96, 98, 1}, {97, 11, 98}, {18, 99, 48}, {48, 99, 78}, {48, 78, 30}, {99, 25, 78}, {26, 100, 81}, {81, 100, 52}, {81, 52, 31}, {100, 20, 52}, {28, 95, 101}, {101, 95, 79}, {101, 79, 25}, {95, 16, 79}, {26, 83, 102}, {102, 83, 93}, {102, 93, 28}, {83, 15, 93}, {27, 85, 103}, {103, 85, 104}, {103, 104, 22}, {85, 12, 104}, {22, 104, 105}, {105, 104, 87}, {105, 87, 29}, {104, 12, 87}, {22, 106, 103}, {103, 106, 107}, {103, 107, 27}, {106, 17, 107}, {29, 108, 105}, {105, 108, 109}, {105, 109, 22}, {108, 19, 109}, {1, 111, 110}, {110, 111, 106}, {110, 106, 22}, {111, 17, 106}, {22, 109, 110}, {110, 109, 112}, {110, 112, 1}, {109, 19, 112}, {18, 34, 113}, {113, 34, 74}, {113, 74, 3}, {34, 8, 74}, {4, 77, 114}, {114, 77, 36}, {114, 36, 20}, {77, 9, 36}, {23, 40, 115}, {115, 40, 86}, {115, 86, 27}, {40, 13, 86}, {29, 88, 116}, {116, 88, 42}, {116, 42, 24}, {88, 14, 42}, {25, 117, 101}, {101, 117, 118}, {101, 118, 28}, {117, 21, 118}, {21, 119, 118}, {118, 119, 102}, {118, 102, 28}, {119, 26, 102}, {3, 120, 113}, {113, 120, 99}, {113, 99, 18}, {120, 25, 99}, {4, 114, 121}, {121, 114, 100}, {121, 100, 26}, {114, 20, 100}, {17, 66, 107}, {107, 66, 115}, {107, 115, 27}, {66, 23, 115}, {24, 68, 116}, {116, 68, 108}, {116, 108, 29}, {68, 19, 108}, {1, 98, 111}, {111, 98, 89}, {111, 89, 17}, {98, 11, 89}, {19, 92, 112}, {112, 92, 96}, {112, 96, 1}, {92, 10, 96}, {2, 56, 59}, {59, 56, 97}, {59, 97, 10}, {56, 11, 97}, {3, 69, 120}, {120, 69, 117}, {120, 117, 25}, {69, 21, 117}, {4, 121, 72}, {72, 121, 119}, {72, 119, 21}, {121, 26, 119}, {5, 44, 50}, {50, 44, 94}, {50, 94, 15}, {44, 16, 94}, {16, 46, 80}, {80, 46, 39}, {80, 39, 30}, {46, 13, 39}, {14, 51, 43}, {43, 51, 82}, {43, 82, 31}, {51, 15, 82}, {6, 90, 33}, {33, 90, 55}, {33, 55, 8}, {90, 11, 55}, {9, 60, 37}, {37, 60, 91}, {37, 91, 7}, {60, 10, 91}};
-#endif
+
+struct SphereMesh {
+  std::vector< glm::vec3 > vertices;
+  std::vector< std::array< uint32_t, 3 > > triangles;
+};
+
+// split each triangle into 4 by its edge midpoints, projected onto the unit sphere
+static SphereMesh subdivide(const SphereMesh & mesh) {
+  SphereMesh refined{mesh.vertices, {}};
+
+  std::map< std::pair< uint32_t, uint32_t >, uint32_t > midpoints;
+  auto midpoint = [&](uint32_t a, uint32_t b) {
+    std::pair< uint32_t, uint32_t > key = std::minmax(a, b);
+    auto it = midpoints.find(key);
+    if (it != midpoints.end()) return it->second;
+    uint32_t id = refined.vertices.size();
+    refined.vertices.push_back(glm::normalize(mesh.vertices[a] + mesh.vertices[b]));
+    midpoints[key] = id;
+    return id;
+  };
+
+  for (auto [a, b, c] : mesh.triangles) {
+    uint32_t ab = midpoint(a, b);
+    uint32_t bc = midpoint(b, c);
+    uint32_t ca = midpoint(c, a);
+    refined.triangles.push_back({a, ab, ca});
+    refined.triangles.push_back({b, bc, ab});
+    refined.triangles.push_back({c, ca, bc});
+    refined.triangles.push_back({ab, bc, ca});
+  }
+
+  return refined;
+}
+
+static SphereMesh icosahedron() {
+  const float t = 0.5f * (1.0f + std::sqrt(5.0f));
+  SphereMesh mesh{
+    {{-1, t, 0}, {1, t, 0}, {-1, -t, 0}, {1, -t, 0}, {0, -1, t}, {0, 1, t},
+     {0, -1, -t}, {0, 1, -t}, {t, 0, -1}, {t, 0, 1}, {-t, 0, -1}, {-t, 0, 1}},
+    {{0, 11, 5}, {0, 5, 1}, {0, 1, 7}, {0, 7, 10}, {0, 10, 11}, {1, 5, 9}, {5, 11, 4},
+     {11, 10, 2}, {10, 7, 6}, {7, 1, 8}, {3, 9, 4}, {3, 4, 2}, {3, 2, 6}, {3, 6, 8},
+     {3, 8, 9}, {4, 9, 5}, {2, 4, 11}, {6, 2, 10}, {8, 6, 7}, {9, 8, 1}}
+  };
+  for (auto & v : mesh.vertices) { v = glm::normalize(v); }
+  return mesh;
+}
+
+struct LevelOfDetail {
+  uint32_t first_vertex;
+  uint32_t first_index;
+  uint32_t num_indices;
+};
+
+struct SphereLODs {
+  std::vector< glm::vec3 > vertices;
+  std::vector< uint32_t > indices;
+  std::vector< LevelOfDetail > levels;
+};
+
+// every tessellation (20, 80, 240 and 960 triangles), packed into one
+// vertex / index buffer pair, from coarsest to finest
+static const SphereLODs sphere_lods = [](){
+  SphereMesh original;
+  for (auto & v : instance_vertices) { original.vertices.push_back({v[0], v[1], v[2]}); }
+  for (auto & t : instance_triangles) { original.triangles.push_back({t[0], t[1], t[2]}); }
+
+  SphereLODs lods;
+  for (const SphereMesh & mesh : {icosahedron(), subdivide(icosahedron()), original, subdivide(original)}) {
+    lods.levels.push_back({uint32_t(lods.vertices.size()), uint32_t(lods.indices.size()), uint32_t(3 * mesh.triangles.size())});
+    lods.vertices.insert(lods.vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+    for (auto & t : mesh.triangles) {
+      lods.indices.insert(lods.indices.end(), t.begin(), t.end());
+    }
+  }
+  return lods;
+}();
+
+// the tessellation used when level of detail selection is disabled
+static constexpr int default_lod = 2;
+
+// spheres with a projected radius (in pixels) less than lod_thresholds[i]
+// are drawn with sphere_lods.levels[i], and larger spheres use the finest level
+static constexpr float lod_thresholds[] = {4.0f, 12.0f, 40.0f};
+static constexpr int num_lods = 4;
 
 const std::string vert_shader(R"vert(
 #version 400
@@ -31,8 +121,48 @@ const std::string vert_shader(R"vert(
 in vec3 instance_vertex;
 
 in vec4 sphere;
+in vec3 position;
 in vec4 rgba;
 
+// with `indexed` set, the instance is sphere number binned_index of the buffer textures
+// over all of the spheres and colors instead, see Spheres::update_bins()
+uniform int indexed;
+in uint binned_index;
+uniform samplerBuffer sphere_texels;
+uniform samplerBuffer color_texels;
+
+// the copy of the spheres being drawn, see draw_placed()
+uniform int placement_count;
+uniform int placement_first;
+uniform samplerBuffer placement_texels;
+vec4 rotation = vec4(0, 0, 0, 1);
+vec4 translation = vec4(0, 0, 0, 1);
+
+void find_placement() {
+  if (placement_count == 0) return;
+  int c = placement_first + gl_InstanceID % placement_count;
+  rotation = texelFetch(placement_texels, 2 * c);
+  translation = texelFetch(placement_texels, 2 * c + 1);
+}
+
+vec3 place(vec3 p) {
+  return translation.xyz + translation.w * (p + 2.0 * cross(rotation.xyz, cross(rotation.xyz, p) + rotation.w * p));
+}
+
+// the cell of the periodic image being drawn, see draw_lattice()
+uniform mat3 lattice;
+uniform ivec3 cell_first;
+uniform ivec3 cell_span;
+
+vec3 image() {
+  int cells = cell_span.x * cell_span.y * cell_span.z;
+  if (cells == 0) return vec3(0);
+  int c = gl_InstanceID % cells;
+  ivec3 cell = cell_first + ivec3(c % cell_span.x, (c / cell_span.x) % cell_span.y, c / (cell_span.x * cell_span.y));
+  return lattice * vec3(cell);
+}
+
+out vec3 normal;
 out vec3 sphere_center;
 out vec4 sphere_color;
 
@@ -41,9 +171,20 @@ uniform vec3 up;
 uniform vec3 camera_position;
 
 void main() {
+  find_placement();
+
+  vec4 s = sphere;
+  vec3 p = position;
   sphere_color = rgba;
-  sphere_center = sphere.xyz;
-  float sphere_radius = sphere.w;
+  if (indexed != 0) {
+    s = texelFetch(sphere_texels, int(binned_index));
+    p = s.xyz;
+    sphere_color = texelFetch(color_texels, int(binned_index));
+  }
+
+  normal = instance_vertex;
+  sphere_center = place(p) + image();
+  float sphere_radius = s.w * translation.w;
   gl_Position = proj * vec4(sphere_center + sphere_radius * instance_vertex, 1);
 }
 )vert");
@@ -51,6 +192,7 @@ void main() {
 const std::string frag_shader(R"frag(
 #version 400
 
+in vec3 normal;
 in vec3 sphere_center;
 in vec4 sphere_color;
 
@@ -64,77 +206,377 @@ void main() {
 
   frag_color = sphere_color;
 
-  //if (light.w != 0) {
-  //  vec3 normal = normalize(p - sphere_center);
-  //  float ambient = 1.0 - light.w;
-  //  float diffuse = clamp(dot(normal,light.xyz), 0.0, 1.0) * light.w;
-  //  frag_color *= ambient + diffuse;
-  //}
+  if (light.w != 0) {
+    float ambient = 1.0 - light.w;
+    float diffuse = clamp(dot(normalize(normal),light.xyz), 0.0, 1.0) * light.w;
+    frag_color.xyz *= ambient + diffuse;
+  }
 
 }
 )frag");
 
-Spheres::Spheres() : program({
+const std::string impostor_vert_shader(R"vert(
+#version 400
+
+in vec2 corner;
+
+in vec4 sphere;
+in vec3 position;
+in vec4 rgba;
+
+// with `indexed` set, the instance is sphere number binned_index of the buffer textures
+// over all of the spheres and colors instead, see Spheres::update_bins()
+uniform int indexed;
+in uint binned_index;
+uniform samplerBuffer sphere_texels;
+uniform samplerBuffer color_texels;
+
+// the copy of the spheres being drawn, see draw_placed()
+uniform int placement_count;
+uniform int placement_first;
+uniform samplerBuffer placement_texels;
+vec4 rotation = vec4(0, 0, 0, 1);
+vec4 translation = vec4(0, 0, 0, 1);
+
+void find_placement() {
+  if (placement_count == 0) return;
+  int c = placement_first + gl_InstanceID % placement_count;
+  rotation = texelFetch(placement_texels, 2 * c);
+  translation = texelFetch(placement_texels, 2 * c + 1);
+}
+
+vec3 place(vec3 p) {
+  return translation.xyz + translation.w * (p + 2.0 * cross(rotation.xyz, cross(rotation.xyz, p) + rotation.w * p));
+}
+
+// the cell of the periodic image being drawn, see draw_lattice()
+uniform mat3 lattice;
+uniform ivec3 cell_first;
+uniform ivec3 cell_span;
+
+vec3 image() {
+  int cells = cell_span.x * cell_span.y * cell_span.z;
+  if (cells == 0) return vec3(0);
+  int c = gl_InstanceID % cells;
+  ivec3 cell = cell_first + ivec3(c % cell_span.x, (c / cell_span.x) % cell_span.y, c / (cell_span.x * cell_span.y));
+  return lattice * vec3(cell);
+}
+
+out vec3 quad_position;
+flat out vec4 sphere_data;
+flat out vec4 sphere_color;
+
+uniform mat4 proj;
+uniform vec3 up;
+uniform vec3 camera_position;
+uniform vec3 camera_direction;
+uniform int perspective;
+
+void main() {
+  find_placement();
+
+  vec4 s = sphere;
+  vec3 p = position;
+  sphere_color = rgba;
+  if (indexed != 0) {
+    s = texelFetch(sphere_texels, int(binned_index));
+    p = s.xyz;
+    sphere_color = texelFetch(color_texels, int(binned_index));
+  }
+
+  vec3 center = place(p) + image();
+  float radius = s.w * translation.w;
+  sphere_data = vec4(center, radius);
+
+  // with a perspective projection, the quad must be enlarged to
+  // cover the silhouette of the sphere (the cone tangent to it)
+  vec3 d = camera_direction;
+  float scale = 1.0;
+  if (perspective != 0) {
+    d = center - camera_position;
+    float L = length(d);
+    d /= L;
+    scale = (L > radius) ? L / sqrt(L * L - radius * radius) : 0.0;
+  }
+
+  vec3 e1 = cross(d, up);
+  if (length(e1) < 1.0e-5) {
+    e1 = cross(d, vec3(1,0,0));
+  }
+  e1 = normalize(e1);
+  vec3 e2 = cross(e1, d);
+
+  quad_position = center + (scale * radius) * (corner.x * e1 + corner.y * e2);
+  gl_Position = proj * vec4(quad_position, 1);
+}
+)vert");
+
+const std::string impostor_frag_shader(R"frag(
+#version 400
+
+in vec3 quad_position;
+flat in vec4 sphere_data;
+flat in vec4 sphere_color;
+
+out vec4 frag_color;
+
+uniform vec4 light;
+uniform mat4 proj;
+uniform vec3 camera_position;
+uniform vec3 camera_direction;
+uniform int perspective;
+
+void main() {
+
+  vec3 center = sphere_data.xyz;
+  float radius = sphere_data.w;
+
+  vec3 ray_origin;
+  vec3 ray_direction;
+  if (perspective != 0) {
+    ray_origin = camera_position;
+    ray_direction = normalize(quad_position - camera_position);
+  } else {
+    ray_direction = camera_direction;
+    ray_origin = quad_position - (2.0 * radius) * ray_direction;
+  }
+
+  vec3 oc = ray_origin - center;
+  float b = dot(oc, ray_direction);
+  float c = dot(oc, oc) - radius * radius;
+  float discriminant = b * b - c;
+  if (discriminant < 0.0) discard;
+
+  vec3 p = ray_origin + (-b - sqrt(discriminant)) * ray_direction;
+
+  vec4 clip = proj * vec4(p, 1);
+  float ndc_depth = clip.z / clip.w;
+  gl_FragDepth = 0.5 * (gl_DepthRange.diff * ndc_depth + gl_DepthRange.near + gl_DepthRange.far);
+
+  frag_color = sphere_color;
+
+  if (light.w != 0) {
+    vec3 normal = (p - center) / radius;
+    float ambient = 1.0 - light.w;
+    float diffuse = clamp(dot(normal,light.xyz), 0.0, 1.0) * light.w;
+    frag_color.xyz *= ambient + diffuse;
+  }
+
+}
+)frag");
+
+Spheres::Spheres() :
+  mode(RenderMode::MESH),
+  program({
     Shader::fromString(vert_shader, GL_VERTEX_SHADER),
     Shader::fromString(frag_shader, GL_FRAGMENT_SHADER)
   }),
+  impostor_program({
+    Shader::fromString(impostor_vert_shader, GL_VERTEX_SHADER),
+    Shader::fromString(impostor_frag_shader, GL_FRAGMENT_SHADER)
+  }),
   color{255, 255, 255, 255},
   light(0.721995, 0.618853, 0.309426, 0.0) {
 
   dirty = true;
+  lod = true;
+  culling = false;
+  bins_dirty = true;
+  recheck_bins = false;
+  num_culled = 0;
+  dynamic = false;
+  moving = false;
+  lattice.counts = glm::uvec3(0);
 
   glGenVertexArrays(1, &vao);
   glBindVertexArray(vao);
 
   glGenBuffers(1, &instance_ebo);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, instance_ebo);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(instance_triangles), instance_triangles, GL_STATIC_DRAW);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint32_t) * sphere_lods.indices.size(), &sphere_lods.indices[0], GL_STATIC_DRAW);
 
   glGenBuffers(1, &instance_vbo);
   glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(instance_vertices), instance_vertices, GL_STATIC_DRAW);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * sphere_lods.vertices.size(), &sphere_lods.vertices[0], GL_STATIC_DRAW);
   program.setAttribute("instance_vertex", 3, sizeof(float) * 3, 0);
 
-  glGenBuffers(1, &sphere_vbo);
-  glBindBuffer(GL_ARRAY_BUFFER, sphere_vbo);
+  sphere_vbo.generate();
+  glBindBuffer(GL_ARRAY_BUFFER, sphere_vbo.handle);
   program.setAttribute("sphere", 4, sizeof(glm::vec4), 0);
   glVertexAttribDivisor(program.attribute("sphere"), 1);
+  program.setAttribute("position", 3, sizeof(glm::vec4), 0);
+  glVertexAttribDivisor(program.attribute("position"), 1);
 
-  glGenBuffers(1, &color_vbo);
-  glBindBuffer(GL_ARRAY_BUFFER, color_vbo);
+  color_vbo.generate();
+  glBindBuffer(GL_ARRAY_BUFFER, color_vbo.handle);
   program.setAttribute("rgba", 4, sizeof(rgbcolor), 0, GL_TRUE, GL_UNSIGNED_BYTE);
   glVertexAttribDivisor(program.attribute("rgba"), 1);
 
+  placement_vbo.generate();
+
+  binned_index_vbo.generate();
+  sphere_texels.generate();
+  color_texels.generate();
+  placement_texels.generate();
+
+  // the impostor vao shares the per-instance buffers above
+  glGenVertexArrays(1, &impostor_vao);
+  glBindVertexArray(impostor_vao);
+
+  glGenBuffers(1, &impostor_vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, impostor_vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(impostor_vertices), impostor_vertices, GL_STATIC_DRAW);
+  impostor_program.setAttribute("corner", 2, sizeof(float) * 2, 0);
+
+  glBindBuffer(GL_ARRAY_BUFFER, sphere_vbo.handle);
+  impostor_program.setAttribute("sphere", 4, sizeof(glm::vec4), 0);
+  glVertexAttribDivisor(impostor_program.attribute("sphere"), 1);
+  impostor_program.setAttribute("position", 3, sizeof(glm::vec4), 0);
+  glVertexAttribDivisor(impostor_program.attribute("position"), 1);
+
+  glBindBuffer(GL_ARRAY_BUFFER, color_vbo.handle);
+  impostor_program.setAttribute("rgba", 4, sizeof(rgbcolor), 0, GL_TRUE, GL_UNSIGNED_BYTE);
+  glVertexAttribDivisor(impostor_program.attribute("rgba"), 1);
+
 }
 
 void Spheres::clear() {
   data.clear();
   colors.clear();
+  ids.clear();
+  moving = false;
   dirty = true;
+  bins_dirty = true;
 }
 
-void Spheres::append(const Sphere & sphere) {
+uint32_t Spheres::append(const Sphere & sphere) {
   data.push_back(sphere);
   colors.push_back(color);
+  sphere_vbo.mark_dirty(data.size() - 1);
+  color_vbo.mark_dirty(colors.size() - 1);
   dirty = true;
+  bin_appended(1);
+  return ids.create();
 }
 
-void Spheres::append(const std::vector< Sphere > & more_spheres) {
-  data.reserve(data.size() + more_spheres.size());
+uint32_t Spheres::append(const std::vector< Sphere > & more_spheres) {
   data.insert(data.end(), more_spheres.begin(), more_spheres.end());  
-
   colors.insert(colors.end(), more_spheres.size(), color);
+  sphere_vbo.mark_dirty(data.size() - more_spheres.size(), data.size());
+  color_vbo.mark_dirty(colors.size() - more_spheres.size(), colors.size());
   dirty = true;
+  bin_appended(more_spheres.size());
+  return ids.create(more_spheres.size());
 }
 
-void Spheres::append(const std::vector< Sphere > & more_spheres,
+uint32_t Spheres::append(const std::vector< Sphere > & more_spheres,
                      const std::vector< rgbcolor > & more_colors) {
-  data.reserve(data.size() + more_spheres.size());
   data.insert(data.end(), more_spheres.begin(), more_spheres.end());  
-
-  colors.reserve(colors.size() + more_colors.size());
   colors.insert(colors.end(), more_colors.begin(), more_colors.end());  
+  sphere_vbo.mark_dirty(data.size() - more_spheres.size(), data.size());
+  color_vbo.mark_dirty(colors.size() - more_colors.size(), colors.size());
+  dirty = true;
+  bin_appended(more_spheres.size());
+  return ids.create(more_spheres.size());
+}
+
+void Spheres::update(uint32_t id, const Sphere & sphere) {
+  if (!ids.contains(id)) {
+    std::cout << "error: `Sphere` id " << id << " does not exist" << std::endl;
+    return;
+  }
+  uint32_t i = ids.index(id);
+  data[i] = sphere;
+  sphere_vbo.mark_dirty(i);
+  dirty = true;
+
+  // the sphere stays where it is in the index buffer, unless it changed bins
+  if (updated.size() < data.size() / 16) {
+    updated.push_back(i);
+  } else {
+    recheck_bins = true;
+  }
+}
+
+void Spheres::set_color(uint32_t id, rgbcolor c) {
+  if (!ids.contains(id)) {
+    std::cout << "error: `Sphere` id " << id << " does not exist" << std::endl;
+    return;
+  }
+  uint32_t i = ids.index(id);
+  colors[i] = c;
+  color_vbo.mark_dirty(i);
+  dirty = true;
+}
+
+void Spheres::remove(uint32_t id) {
+  if (!ids.contains(id)) {
+    std::cout << "error: `Sphere` id " << id << " does not exist" << std::endl;
+    return;
+  }
+  uint32_t i = ids.remove(id);
+  swap_remove(data, i);
+  swap_remove(colors, i);
+  sphere_vbo.mark_dirty(i);
+  color_vbo.mark_dirty(i);
   dirty = true;
+
+  // the removed sphere leaves its bin, and the last one, now at i, keeps its own
+  if (!bins_dirty && binned.bins.size() == data.size() + 1) {
+    binned.swap_remove(i);
+    for (uint32_t & u : updated) {
+      if (u == data.size()) u = i;
+    }
+  } else {
+    bins_dirty = true;
+  }
+}
+
+// Appended spheres only need their own bins found, like updated ones, unless there are too
+// many to keep track of, while the rest stay where they are in the index buffer.
+void Spheres::bin_appended(uint32_t count) {
+  uint32_t n = data.size();
+  if (bins_dirty || binned.bins.size() != n - count) return;
+  binned.append(count);
+  if (updated.size() + count < n / 16) {
+    for (uint32_t i = n - count; i < n; i++) updated.push_back(i);
+  } else {
+    recheck_bins = true;
+  }
+}
+
+void Spheres::save(SceneWriter & scene, uint32_t tag) const {
+  scene.add(SectionType::SPHERES, data, tag);
+  scene.add(SectionType::SPHERE_COLORS, colors, tag);
+}
+
+void Spheres::load(const SceneFile & scene, uint32_t tag) {
+  clear();
+  data = scene.read< Sphere >(SectionType::SPHERES, tag);
+  colors = scene.read< rgbcolor >(SectionType::SPHERE_COLORS, tag);
+  if (colors.size() != data.size()) colors.assign(data.size(), color);
+  ids.create(data.size());
+  sphere_vbo.mark_dirty(0, data.size());
+  color_vbo.mark_dirty(0, colors.size());
+}
+
+void Spheres::set_lattice(const Lattice & l) {
+  lattice = l;
+  lattice_bounds = bounding_sphere(data);
+}
+
+void Spheres::set_placements(const std::vector< Placement > & p) {
+  placements = p;
+  placement_vbo.mark_dirty(0, placements.size());
+}
+
+Sphere * Spheres::map_spheres() {
+  return dynamic_spheres.map(data.size());
+}
+
+glm::vec3 * Spheres::map_positions() {
+  moving = true;
+  return positions.map(data.size());
 }
 
 void Spheres::set_light(glm::vec3 direction, float intensity) {
@@ -149,34 +591,274 @@ void Spheres::set_color(rgbcolor c) {
   color = c;
 }
 
-void Spheres::draw(const Camera & camera) {
+// Sorts the indices of the visible spheres by level of detail into binned_index_vbo, which the
+// shaders use to read the spheres and colors straight from sphere_vbo and color_vbo, so edits
+// to those only send the changed ranges. The indices are only sorted and sent again when a
+// camera move changes some sphere's bin. After update(), append() or remove(), only the spheres
+// concerned are moved between bins (see BinnedIndices), and only the entries of the index buffer
+// that moved are sent.
+void Spheres::update_bins(const Camera & camera) {
 
-  program.use();
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
 
-  //program.setUniform("light", light);
-  program.setUniform("proj", camera.matrix());
+  // a sphere at clip-space depth w covers (pixel_scale * radius / w) pixels vertically
+  glm::mat4 proj = camera.matrix();
+  float pixel_scale = 0.5f * viewport[3] * camera.projection()[1][1];
+
+  uint32_t n = data.size();
+  bool moved_camera = (proj != binned_camera || pixel_scale != binned_pixel_scale);
+  bool changed = bins_dirty || binned.bins.size() != n;
+
+  if (!changed && !moved_camera && !recheck_bins && updated.empty() && binned.written.empty()) {
+    num_culled = n - binned.permutation.size();
+    return;
+  }
+
+  bool select_lod = lod && (mode == RenderMode::MESH);
+
+  Frustum frustum(proj);
+  auto bin_of = [&](uint32_t i) -> uint8_t {
+    if (culling && !frustum.intersects(data[i])) return culled_bin;
+    if (!select_lod) return 0;
+
+    const glm::vec3 & x = data[i].center;
+    float w = proj[0][3] * x[0] + proj[1][3] * x[1] + proj[2][3] * x[2] + proj[3][3];
+    float pixels = (w > 0.0f) ? pixel_scale * data[i].radius / w : 0.0f;
+
+    uint8_t level = 0;
+    while (level < num_lods - 1 && pixels >= lod_thresholds[level]) level++;
+    return level;
+  };
+
+  threadpool & pool = worker_threads();
+  if (changed || moved_camera || recheck_bins) {
+    std::vector< uint8_t > & bins = binned.bins;
+    bins.resize(n, culled_bin);
+    std::atomic< bool > any_changed(false);
+    pool.parallel_for_range(n, primitive_grain, [&](uint64_t begin, uint64_t end) {
+      bool differs = false;
+      for (uint32_t i = begin; i < end; i++) {
+        uint8_t bin = bin_of(i);
+        differs |= (bin != bins[i]);
+        bins[i] = bin;
+      }
+      if (differs) any_changed.store(true, std::memory_order_relaxed);
+    });
+    changed |= any_changed.load(std::memory_order_relaxed);
+  } else {
+    for (uint32_t i : updated) binned.set_bin(i, bin_of(i));
+  }
+
+  updated.clear();
+  recheck_bins = false;
+  bins_dirty = false;
+  binned_camera = proj;
+  binned_pixel_scale = pixel_scale;
+
+  if (changed) {
+    binned.sort(pool, select_lod ? num_lods : 1);
+    binned_index_vbo.mark_dirty(0, binned.permutation.size());
+  }
+  for (uint32_t position : binned.written) binned_index_vbo.mark_dirty(position);
+  binned.written.clear();
+  if (binned_index_vbo.dirty()) binned_index_vbo.upload(binned.permutation);
+  num_culled = n - binned.permutation.size();
+
+}
+
+// where the sphere centers are read from, if not from the spheres themselves
+struct InstancePositions {
+  GLuint buffer;
+  GLintptr base;
+};
+
+// point the per-instance attributes of the bound vao at instance `first` of the given buffers,
+// where the sphere data may start at some byte offset `sphere_base` into its buffer
+static void bind_instances(ShaderProgram & program, GLuint sphere_buffer, GLuint color_buffer,
+                           uint32_t first, GLintptr sphere_base = 0, InstancePositions moved = {0, 0}) {
+  glBindBuffer(GL_ARRAY_BUFFER, sphere_buffer);
+  program.setAttribute("sphere", 4, sizeof(glm::vec4), sphere_base + first * sizeof(Sphere));
+
+  if (moved.buffer) {
+    glBindBuffer(GL_ARRAY_BUFFER, moved.buffer);
+    program.setAttribute("position", 3, sizeof(glm::vec3), moved.base + first * sizeof(glm::vec3));
+  } else {
+    program.setAttribute("position", 3, sizeof(glm::vec4), sphere_base + first * sizeof(Sphere));
+  }
+
+  glBindBuffer(GL_ARRAY_BUFFER, color_buffer);
+  program.setAttribute("rgba", 4, sizeof(rgbcolor), first * sizeof(rgbcolor), GL_TRUE, GL_UNSIGNED_BYTE);
+}
+
+// Draw the spheres listed in an index buffer instead, from entry `first` on, which the shaders
+// read from the buffer textures in texture units 0 and 1. The per-sphere attribute arrays are
+// disabled meanwhile, since there may be fewer of them than indexed instances.
+static void bind_indexed_instances(ShaderProgram & program, GLuint index_buffer, uint32_t first) {
+  for (auto name : {"sphere", "position", "rgba"}) glDisableVertexAttribArray(program.attribute(name));
+
+  GLint location = program.attribute("binned_index");
+  glBindBuffer(GL_ARRAY_BUFFER, index_buffer);
+  glEnableVertexAttribArray(location);
+  glVertexAttribIPointer(location, 1, GL_UNSIGNED_INT, sizeof(uint32_t), (void*)(sizeof(uint32_t) * first));
+  glVertexAttribDivisor(location, 1);
+
+  program.setUniform("indexed", 1);
+  program.setUniform("sphere_texels", 0);
+  program.setUniform("color_texels", 1);
+}
+
+// go back to the per-sphere attributes, which bind_instances() enables again
+static void unbind_indexed_instances(ShaderProgram & program) {
+  glDisableVertexAttribArray(program.attribute("binned_index"));
+  program.setUniform("indexed", 0);
+}
+
+// draw `count` tessellated spheres, from the instances bound above
+static void draw_meshed_instances(const LevelOfDetail & level, uint32_t count) {
+  if (count == 0) return;
+
+  glDrawElementsInstancedBaseVertex(GL_TRIANGLES, level.num_indices, GL_UNSIGNED_INT,
+                                    (void*)(sizeof(uint32_t) * level.first_index), count, level.first_vertex);
+}
+
+void Spheres::draw(const Camera & camera) {
 
-  glBindVertexArray(vao);
   if (dirty) {
     if (colors.size() != data.size()) {
       std::cout << "error: `Sphere` buffer sizes are incompatible" << std::endl;
     }
 
-    glBindBuffer(GL_ARRAY_BUFFER, sphere_vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(Sphere) * data.size(), &data[0], GL_STATIC_DRAW);
-
-    glBindBuffer(GL_ARRAY_BUFFER, color_vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(rgbcolor) * colors.size(), &colors[0], GL_STATIC_DRAW);
+    if (lattice.num_cells() > 0 && sphere_vbo.dirty()) lattice_bounds = bounding_sphere(data);
+    sphere_vbo.upload(data);
+    color_vbo.upload(colors);
     dirty = false;
   }
 
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, instance_ebo);
+  if (placement_vbo.dirty()) placement_vbo.upload(placements);
+  bool placed = !placements.empty();
+  bool periodic = lattice.num_cells() > 0;
+
+  // in dynamic mode, draw the spheres most recently written to map_spheres()
+  if (dynamic) dynamic_spheres.commit();
+  bool streaming = dynamic && dynamic_spheres.ready();
+  GLuint sphere_buffer = (streaming) ? dynamic_spheres.handle : sphere_vbo.handle;
+  GLintptr sphere_base = (streaming) ? dynamic_spheres.offset() : 0;
+  uint32_t count = (streaming) ? std::min(dynamic_spheres.count, colors.size()) : data.size();
+
+  // and with positions, at the centers most recently written to map_positions()
+  if (moving) positions.commit();
+  bool moved = moving && positions.ready();
+  InstancePositions moved_positions = {0, 0};
+  if (moved) {
+    moved_positions = {positions.handle, positions.offset()};
+    count = std::min< size_t >(count, positions.count);
+  }
+
+  // only the cells of the lattice in view are drawn, unless the spheres' bounds are unknown
+  if (periodic) {
+    if (culling && !streaming && !moved) {
+      cell_blocks = visible_cells(Frustum(camera.matrix()), lattice, lattice_bounds);
+    } else {
+      cell_blocks = {CellBlock{glm::uvec3(0), lattice.counts}};
+    }
+    uint64_t visible = 0;
+    for (auto & block : cell_blocks) visible += uint64_t(block.span.x) * block.span.y * block.span.z;
+    num_culled = std::min< uint64_t >((lattice.num_cells() - visible) * count, UINT32_MAX);
+  }
+
   glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-  glEnable(GL_CULL_FACE);
-  glCullFace(GL_BACK);
-  glDrawElementsInstanced(GL_TRIANGLES, sizeof(instance_triangles), GL_UNSIGNED_INT, 0, data.size());
 
-  program.unuse();
+  if (mode == RenderMode::IMPOSTOR) {
+
+    impostor_program.use();
+
+    impostor_program.setUniform("light", light);
+    impostor_program.setUniform("proj", camera.matrix());
+    impostor_program.setUniform("up", camera.up());
+    impostor_program.setUniform("camera_position", camera.pos());
+    impostor_program.setUniform("camera_direction", camera.direction());
+    impostor_program.setUniform("perspective", int(camera.is_perspective()));
+
+    glBindVertexArray(impostor_vao);
+    glDisable(GL_CULL_FACE);
+
+    if (periodic || placed) {
+      auto bind = [&](uint32_t first) {
+        bind_instances(impostor_program, sphere_buffer, color_vbo.handle, first, sphere_base, moved_positions);
+      };
+      auto draw = [&](uint32_t n) { glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, n); };
+      if (periodic) {
+        draw_lattice(impostor_program, {"sphere", "position", "rgba"}, lattice, cell_blocks, count, bind, draw);
+      } else {
+        num_culled = 0;
+        draw_placed(impostor_program, {"sphere", "position", "rgba"}, placement_texels, placement_vbo.handle, placements.size(), count, bind, draw);
+      }
+    } else if (culling && !streaming && !moved) {
+      update_bins(camera);
+      if (!binned.permutation.empty()) {
+        sphere_texels.bind(0, sphere_vbo.handle, GL_RGBA32F);
+        color_texels.bind(1, color_vbo.handle, GL_RGBA8);
+        bind_indexed_instances(impostor_program, binned_index_vbo.handle, 0);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, binned.permutation.size());
+        unbind_indexed_instances(impostor_program);
+      }
+    } else {
+      num_culled = 0;
+      bind_instances(impostor_program, sphere_buffer, color_vbo.handle, 0, sphere_base, moved_positions);
+      glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+    }
+
+    impostor_program.unuse();
+
+  } else {
+
+    program.use();
+
+    program.setUniform("light", light);
+    program.setUniform("proj", camera.matrix());
+
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, instance_ebo);
+    glEnable(GL_CULL_FACE);
+    glCullFace(GL_BACK);
+
+    if (periodic || placed) {
+      const LevelOfDetail & level = sphere_lods.levels[default_lod];
+      auto bind = [&](uint32_t first) {
+        bind_instances(program, sphere_buffer, color_vbo.handle, first, sphere_base, moved_positions);
+      };
+      auto draw = [&](uint32_t n) { draw_meshed_instances(level, n); };
+      if (periodic) {
+        draw_lattice(program, {"sphere", "position", "rgba"}, lattice, cell_blocks, count, bind, draw);
+      } else {
+        num_culled = 0;
+        draw_placed(program, {"sphere", "position", "rgba"}, placement_texels, placement_vbo.handle, placements.size(), count, bind, draw);
+      }
+    } else if ((lod || culling) && !streaming && !moved) {
+      update_bins(camera);
+      sphere_texels.bind(0, sphere_vbo.handle, GL_RGBA32F);
+      color_texels.bind(1, color_vbo.handle, GL_RGBA8);
+      for (uint32_t bin = 0; bin + 1 < binned.offsets.size(); bin++) {
+        const LevelOfDetail & level = sphere_lods.levels[lod ? bin : default_lod];
+        uint32_t first = binned.offsets[bin];
+        if (binned.offsets[bin + 1] == first) continue;
+        bind_indexed_instances(program, binned_index_vbo.handle, first);
+        draw_meshed_instances(level, binned.offsets[bin + 1] - first);
+      }
+      unbind_indexed_instances(program);
+    } else {
+      num_culled = 0;
+      bind_instances(program, sphere_buffer, color_vbo.handle, 0, sphere_base, moved_positions);
+      draw_meshed_instances(sphere_lods.levels[default_lod], count);
+    }
+
+    program.unuse();
+
+  }
+
+  if (streaming) dynamic_spheres.fence();
+  if (moved) positions.fence();
 
 }
 
@@ -8,6 +8,13 @@
 #include "Shader.hpp"
 #include "Camera.hpp"
 #include "rgbcolor.hpp"
+#include "dynamic_buffer.hpp"
+#include "buffer_texture.hpp"
+#include "scene_file.hpp"
+#include "stream_buffer.hpp"
+#include "instance_ids.hpp"
+#include "binned_indices.hpp"
+#include "placements.hpp"
 
 namespace Graphics {
 
@@ -16,35 +23,147 @@ struct Sphere {
   float radius;
 };
 
+// MESH draws a tessellated icosphere per instance,
+// IMPOSTOR draws a camera-facing quad and ray casts the surface per-fragment
+enum class RenderMode { MESH, IMPOSTOR };
+
 struct Spheres {
 
   Spheres();
   void draw(const Camera & camera);
 
   void clear();
-  void append(const Sphere & sphere);
-  void append(const std::vector< Sphere > & more_spheres);
-  void append(const std::vector< Sphere > & more_spheres, const std::vector < rgbcolor > & more_colors);
+
+  // append() returns a stable id for the new sphere, which stays valid until it is
+  // removed. Appending a batch returns the first of its consecutive, new ids.
+  //
+  // The next draw() only sends the new or changed spheres and colors to the GPU, however they
+  // are drawn, except in dynamic mode, which streams all of them every frame. The culled / level
+  // of detail draws read the same buffers through an index buffer of the visible spheres, where
+  // appending or removing a sphere only rewrites an entry or so per bin.
+  uint32_t append(const Sphere & sphere);
+  uint32_t append(const std::vector< Sphere > & more_spheres);
+  uint32_t append(const std::vector< Sphere > & more_spheres, const std::vector < rgbcolor > & more_colors);
+
+  // Modify or remove a single sphere, only sending the changed instances to the GPU. After
+  // update(), the index buffer of the culled / level of detail draws only changes if the
+  // sphere moved to another bin (in or out of view, or to another level of detail).
+  void update(uint32_t id, const Sphere & sphere);
+  void set_color(uint32_t id, rgbcolor c);
+  void remove(uint32_t id);
 
   void set_color(rgbcolor c);
   void set_light(glm::vec3 direction, float intensity);
 
+  void set_render_mode(RenderMode m) { bins_dirty |= (m != mode); mode = m; }
+
+  // when enabled, meshed spheres are drawn with coarser tessellations
+  // as their projected radius on screen gets smaller
+  void set_level_of_detail(bool enable) { bins_dirty |= (enable != lod); lod = enable; }
+
+  // when enabled, spheres outside of the camera's view frustum are not drawn
+  void set_frustum_culling(bool enable) { bins_dirty |= (enable != culling); culling = enable; }
+
+  // In dynamic mode, the spheres are streamed to the GPU through a persistently
+  // mapped ring buffer, for simulations that move every sphere every frame.
+  // Each frame, write all size() spheres to the pointer returned by map_spheres()
+  // before calling draw(). Colors still come from append() and set_color(), and
+  // culling / level of detail are skipped, since they would read `data` on the CPU.
+  void set_dynamic(bool enable) { bins_dirty |= (enable != dynamic); dynamic = enable; }
+  Sphere * map_spheres();
+
+  // For trajectories, where the spheres move but keep their radii and colors: each frame, write
+  // size() centers to the pointer returned by map_positions() before calling draw(). Only those
+  // 12 bytes per sphere are sent to the GPU, through a ring buffer like dynamic mode's, and as in
+  // dynamic mode, culling / level of detail are skipped. Picking uses the spheres' own centers,
+  // which clear_positions() goes back to drawing, unless given the frame's (Picker::sphere_positions).
+  glm::vec3 * map_positions();
+  void clear_positions() { moving = false; }
+
+  // Draw all of the spheres once per placement, e.g. for a box of identical solvent molecules,
+  // where each copy only costs the 32 bytes of its Placement instead of a copy of every sphere.
+  // Culling and level of detail are skipped while there are placements, and a Picker only picks
+  // the copies if given the same ones. An empty list goes back to drawing the spheres once.
+  void set_placements(const std::vector< Placement > & p);
+
+  // Draw the spheres once per cell of a lattice, e.g. for a supercell of a crystal, where the
+  // images are made up by the vertex shader, so they take no memory. With frustum culling
+  // enabled, cells whose bounds are out of view aren't drawn, and culled() counts the spheres
+  // in them. As with placements, a Picker only picks the images if given the same lattice. A
+  // lattice takes precedence over placements, and one with no cells turns it off.
+  void set_lattice(const Lattice & l);
+
+  // Write the spheres and their colors to a scene file, or replace them with the ones in it. The tag
+  // tells apart several Spheres objects saved to the same file.
+  void save(SceneWriter & scene, uint32_t tag = 0) const;
+  void load(const SceneFile & scene, uint32_t tag = 0);
+
   auto size() { return data.size(); }
 
+  const std::vector< Sphere > & primitives() const { return data; }
+
+  // stable id of the sphere currently stored at `index`
+  uint32_t id(uint32_t index) const { return ids.id_of[index]; }
+
+  // how many spheres were skipped by frustum culling in the last call to draw()
+  auto culled() { return num_culled; }
+
  private:
+  void update_bins(const Camera & camera);
+  void bin_appended(uint32_t count);
+
   bool dirty;
   GLuint vao;
-  GLuint color_vbo;
-  GLuint sphere_vbo;
+  DynamicBuffer< rgbcolor > color_vbo;
+  DynamicBuffer< Sphere > sphere_vbo;
   GLuint instance_vbo; 
   GLuint instance_ebo;
 
+  GLuint impostor_vao;
+  GLuint impostor_vbo;
+
+  bool dynamic;
+  StreamBuffer< Sphere > dynamic_spheres;
+
+  bool moving;
+  StreamBuffer< glm::vec3 > positions;
+
+  std::vector< Placement > placements;
+  DynamicBuffer< Placement > placement_vbo;
+  BufferTexture placement_texels;
+
+  Lattice lattice;
+  Sphere lattice_bounds;
+  std::vector< CellBlock > cell_blocks;
+
+  RenderMode mode;
+
+  bool lod;
+  bool culling;
+  bool bins_dirty;
+  uint32_t num_culled;
+  glm::mat4 binned_camera;
+  float binned_pixel_scale;
+  DynamicBuffer< uint32_t > binned_index_vbo;
+  BufferTexture sphere_texels;
+  BufferTexture color_texels;
+
   ShaderProgram program;
+  ShaderProgram impostor_program;
 
   rgbcolor color;
 
   std::vector< Sphere > data;
   std::vector< rgbcolor > colors;
+  InstanceIDs ids;
+
+  // the bin of each sphere, and the indices of the visible ones sorted by bin (level of detail)
+  BinnedIndices binned;
+
+  // spheres changed by update() since the last binning, which only need their bins
+  // checked, or all of them when there are too many to keep track of
+  std::vector< uint32_t > updated;
+  bool recheck_bins;
 
   glm::vec4 light;
 
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include <GL/glew.h>
+
+namespace Graphics {
+
+// A ring of GPU buffer regions for data that is rewritten every frame.
+//
+// When GL_ARB_buffer_storage is available (GL 4.4+), the buffer is mapped once
+// with GL_MAP_PERSISTENT_BIT and the caller writes directly into GPU-visible
+// memory. Each region is guarded by a fence, so the CPU can fill the region for
+// frame N+1 while the GPU is still reading the one from frame N, and it only
+// blocks if it gets more than num_regions frames ahead.
+//
+// Without buffer storage (e.g. a GL 4.1 context), map() hands out a CPU staging
+// array instead, and commit() copies it into the next region with glBufferSubData.
+template < typename T >
+struct StreamBuffer {
+
+  static constexpr uint32_t num_regions = 3;
+
+  StreamBuffer() : handle(0), capacity(0), count(0), current(-1), next(0),
+                   pending(false), mapped(nullptr), fences{} {}
+
+  // returns storage for n elements, which must all be written before commit()
+  T * map(size_t n) {
+    if (n > capacity) allocate(n);
+
+    next = (current + 1) % num_regions;
+    wait(next);
+
+    count = n;
+    pending = true;
+    return (mapped) ? mapped + next * capacity : staging.data();
+  }
+
+  // make the most recently mapped region the one that draw calls read from
+  void commit() {
+    if (!pending) return;
+
+    if (!mapped && count > 0) {
+      glBindBuffer(GL_ARRAY_BUFFER, handle);
+      glBufferSubData(GL_ARRAY_BUFFER, offset(next), sizeof(T) * count, staging.data());
+    }
+
+    current = next;
+    pending = false;
+  }
+
+  // called after the draw calls that read the current region have been issued
+  void fence() {
+    if (current < 0) return;
+    if (fences[current]) glDeleteSync(fences[current]);
+    fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  }
+
+  // true once some data has been committed
+  bool ready() const { return current >= 0; }
+
+  // byte offset of the region that draw calls should read from
+  GLintptr offset() const { return offset(current); }
+
+  GLuint handle;
+
+  // number of elements per region
+  size_t capacity;
+
+  // number of elements written to the last mapped region
+  size_t count;
+
+ private:
+
+  GLintptr offset(int region) const { return GLintptr(sizeof(T) * capacity * region); }
+
+  void wait(int region) {
+    if (!fences[region]) return;
+    while (glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {}
+    glDeleteSync(fences[region]);
+    fences[region] = 0;
+  }
+
+  // immutable storage can't be resized, so growing means replacing the buffer
+  void allocate(size_t n) {
+    for (uint32_t i = 0; i < num_regions; i++) wait(i);
+    if (handle) glDeleteBuffers(1, &handle);
+
+    capacity = std::max(n, 2 * capacity);
+    current = -1;
+    mapped = nullptr;
+
+    GLsizeiptr bytes = sizeof(T) * capacity * num_regions;
+
+    glGenBuffers(1, &handle);
+    glBindBuffer(GL_ARRAY_BUFFER, handle);
+    if (GLEW_ARB_buffer_storage) {
+      GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glBufferStorage(GL_ARRAY_BUFFER, bytes, nullptr, flags);
+      mapped = (T *)glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, flags);
+      std::vector< T >().swap(staging);
+    } else {
+      glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+      staging.resize(capacity);
+    }
+  }
+
+  int current;
+  int next;
+  bool pending;
+
+  T * mapped;
+  std::vector< T > staging;
+
+  GLsync fences[num_regions];
+
+};
+
+}
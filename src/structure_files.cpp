@@ -0,0 +1,520 @@
+#include "structure_files.hpp"
+
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <unordered_map>
+
+#include <glm/gtc/constants.hpp>
+
+#include "worker_threads.hpp"
+#include "misc/mapped_file.hpp"
+
+namespace Graphics {
+
+static constexpr const char * element_symbols[] = {
+  "",
+  "H", "He",
+  "Li", "Be", "B", "C", "N", "O", "F", "Ne",
+  "Na", "Mg", "Al", "Si", "P", "S", "Cl", "Ar",
+  "K", "Ca", "Sc", "Ti", "V", "Cr", "Mn", "Fe", "Co", "Ni", "Cu", "Zn", "Ga", "Ge", "As", "Se", "Br", "Kr",
+  "Rb", "Sr", "Y", "Zr", "Nb", "Mo", "Tc", "Ru", "Rh", "Pd", "Ag", "Cd", "In", "Sn", "Sb", "Te", "I", "Xe",
+  "Cs", "Ba", "La", "Ce", "Pr", "Nd", "Pm", "Sm", "Eu", "Gd", "Tb", "Dy", "Ho", "Er", "Tm", "Yb", "Lu",
+  "Hf", "Ta", "W", "Re", "Os", "Ir", "Pt", "Au", "Hg", "Tl", "Pb", "Bi", "Po", "At", "Rn",
+  "Fr", "Ra", "Ac", "Th", "Pa", "U", "Np", "Pu", "Am", "Cm", "Bk", "Cf", "Es", "Fm", "Md", "No", "Lr"
+};
+
+uint32_t atomic_number(std::string_view symbol) {
+
+  // indexed by the first letter, and then by the second letter (or 0 for none)
+  static const std::vector< uint8_t > table = []() {
+    std::vector< uint8_t > t(26 * 27, 0);
+    for (uint32_t z = 1; z < sizeof(element_symbols) / sizeof(const char *); z++) {
+      const char * s = element_symbols[z];
+      t[(s[0] - 'A') * 27 + (s[1] ? s[1] - 'a' + 1 : 0)] = z;
+    }
+    return t;
+  }();
+
+  auto letter = [](char c) {
+    if (c >= 'a' && c <= 'z') return c - 'a';
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    return -1;
+  };
+
+  if (symbol.empty() || symbol.size() > 2) return 0;
+  int first = letter(symbol[0]);
+  int second = (symbol.size() == 2) ? letter(symbol[1]) : -1;
+  if (first < 0 || (symbol.size() == 2 && second < 0)) return 0;
+  return table[first * 27 + second + 1];
+}
+
+static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+static bool is_letter(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+
+static std::string_view trim(const char * begin, const char * end) {
+  while (begin < end && is_space(*begin)) begin++;
+  while (end > begin && is_space(end[-1])) end--;
+  return std::string_view(begin, end - begin);
+}
+
+// the leading letters of a name like "C12" or "Fe2+"
+static std::string_view letters(std::string_view s) {
+  size_t n = 0;
+  while (n < s.size() && is_letter(s[n])) n++;
+  return s.substr(0, n);
+}
+
+// Parses a decimal number like "-12.345" or "1.5e-3", after any spaces, and moves p past
+// it. Unlike strtof, this doesn't depend on the locale, or need a null-terminated string.
+static bool parse_float(const char *& p, const char * end, float & value) {
+  static constexpr double powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+
+  while (p < end && is_space(*p)) p++;
+
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+
+  double mantissa = 0.0;
+  int exponent = 0;
+  bool digits = false;
+  for (; p < end && is_digit(*p); p++, digits = true) mantissa = mantissa * 10.0 + (*p - '0');
+  if (p < end && *p == '.') {
+    for (p++; p < end && is_digit(*p); p++, digits = true) {
+      mantissa = mantissa * 10.0 + (*p - '0');
+      exponent--;
+    }
+  }
+  if (!digits) return false;
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    const char * q = p + 1;
+    bool negative_exponent = false;
+    if (q < end && (*q == '-' || *q == '+')) negative_exponent = (*q++ == '-');
+    if (q < end && is_digit(*q)) {
+      int e = 0;
+      for (; q < end && is_digit(*q); q++) e = std::min(e * 10 + (*q - '0'), 1000);
+      exponent += negative_exponent ? -e : e;
+      p = q;
+    }
+  }
+
+  double x = mantissa;
+  for (; exponent > 22; exponent -= 22) x *= powers[22];
+  for (; exponent < -22; exponent += 22) x /= powers[22];
+  x = (exponent < 0) ? x / powers[-exponent] : x * powers[exponent];
+  value = float(negative ? -x : x);
+  return true;
+}
+
+static bool parse_uint(const char *& p, const char * end, uint64_t & value) {
+  while (p < end && is_space(*p)) p++;
+  if (p == end || !is_digit(*p)) return false;
+  for (value = 0; p < end && is_digit(*p); p++) value = value * 10 + (*p - '0');
+  return true;
+}
+
+static bool parse_float(std::string_view s, float & value) {
+  const char * p = s.data();
+  return parse_float(p, s.data() + s.size(), value);
+}
+
+// the end of the line starting at p, not including the '\n'
+static const char * line_end(const char * p, const char * end) {
+  const char * newline = (const char *)memchr(p, '\n', end - p);
+  return newline ? newline : end;
+}
+
+// the start of the n-th line after the one starting at p
+static const char * skip_lines(const char * p, const char * end, uint64_t n) {
+  for (; n > 0 && p < end; n--) {
+    const char * e = line_end(p, end);
+    p = (e < end) ? e + 1 : end;
+  }
+  return p;
+}
+
+// the start of the first line at or after p that isn't blank
+static const char * skip_blank_lines(const char * p, const char * end) {
+  while (p < end && trim(p, line_end(p, end)).empty()) p = skip_lines(p, end, 1);
+  return p;
+}
+
+// Splits a line into at most max_tokens tokens separated by whitespace, where a quoted
+// token ('...' or "...") ends at a matching quote that is followed by whitespace.
+static int tokenize(const char * p, const char * end, std::string_view * tokens, int max_tokens) {
+  int n = 0;
+  while (n < max_tokens) {
+    while (p < end && is_space(*p)) p++;
+    if (p == end) break;
+
+    const char * start = p;
+    if (*p == '\'' || *p == '"') {
+      char quote = *p++;
+      start = p;
+      while (p < end && !(*p == quote && (p + 1 == end || is_space(p[1])))) p++;
+      tokens[n++] = std::string_view(start, p - start);
+      if (p < end) p++;
+    } else {
+      while (p < end && !is_space(*p)) p++;
+      tokens[n++] = std::string_view(start, p - start);
+    }
+  }
+  return n;
+}
+
+// the atoms parsed from one chunk of a file
+struct Chunk {
+  std::vector< Sphere > atoms;
+  std::vector< uint32_t > atomic_numbers;
+  std::vector< int64_t > serials;                 // PDB atom serial numbers
+  std::vector< std::array< int64_t, 2 > > links;  // PDB CONECT records, as pairs of serial numbers
+};
+
+// the smallest chunk worth handing to another thread
+static constexpr uint64_t min_chunk_size = 1 << 20;
+
+// Calls parse_line(line, line_end, chunk) for every line in [begin, end). The lines are split
+// into chunks that are parsed in parallel, each into its own Chunk, which are returned in order.
+template < typename lambda >
+static std::vector< Chunk > parse_lines(const char * begin, const char * end, const lambda & parse_line) {
+  threadpool & pool = worker_threads();
+
+  uint64_t size = end - begin;
+  uint64_t num_chunks = std::clamp< uint64_t >(size / min_chunk_size, 1, 8 * pool.num_threads);
+
+  // move each split point forward to the start of a line
+  std::vector< const char * > starts(num_chunks + 1, end);
+  starts[0] = begin;
+  for (uint64_t k = 1; k < num_chunks; k++) {
+    const char * p = std::max(begin + size * k / num_chunks, starts[k - 1]);
+    starts[k] = (p > begin && p[-1] != '\n') ? skip_lines(p, end, 1) : p;
+  }
+
+  std::vector< Chunk > chunks(num_chunks);
+  pool.parallel_for(num_chunks, [&](uint64_t k) {
+    const char * line = starts[k];
+    while (line < starts[k + 1]) {
+      const char * e = line_end(line, starts[k + 1]);
+      parse_line(line, e, chunks[k]);
+      if (e == starts[k + 1]) break;
+      line = e + 1;
+    }
+  });
+  return chunks;
+}
+
+static Structure concatenate(const std::vector< Chunk > & chunks) {
+  std::vector< uint64_t > offsets(chunks.size() + 1, 0);
+  for (size_t k = 0; k < chunks.size(); k++) {
+    offsets[k + 1] = offsets[k] + chunks[k].atoms.size();
+  }
+
+  Structure structure;
+  structure.atoms.resize(offsets.back());
+  structure.atomic_numbers.resize(offsets.back());
+  worker_threads().parallel_for(chunks.size(), [&](uint64_t k) {
+    std::copy(chunks[k].atoms.begin(), chunks[k].atoms.end(), structure.atoms.begin() + offsets[k]);
+    std::copy(chunks[k].atomic_numbers.begin(), chunks[k].atomic_numbers.end(), structure.atomic_numbers.begin() + offsets[k]);
+  });
+  return structure;
+}
+
+// The basis vectors of a unit cell with edges of length a, b and c, and angles alpha (between b
+// and c), beta and gamma in degrees. As in the PDB's convention, a is along x and b is in the xy plane.
+static void unit_cell(double a, double b, double c, double alpha, double beta, double gamma, glm::vec3 cell[3]) {
+  const double radians = glm::pi< double >() / 180.0;
+  double cos_alpha = std::cos(alpha * radians);
+  double cos_beta = std::cos(beta * radians);
+  double cos_gamma = std::cos(gamma * radians);
+  double sin_gamma = std::sin(gamma * radians);
+  if (a <= 0.0 || b <= 0.0 || c <= 0.0 || sin_gamma <= 0.0) return;
+
+  double cx = cos_beta;
+  double cy = (cos_alpha - cos_beta * cos_gamma) / sin_gamma;
+  double cz = std::sqrt(std::max(0.0, 1.0 - cx * cx - cy * cy));
+  cell[0] = glm::vec3(a, 0.0, 0.0);
+  cell[1] = glm::vec3(b * cos_gamma, b * sin_gamma, 0.0);
+  cell[2] = glm::vec3(c * cx, c * cy, c * cz);
+}
+
+// The element of an ATOM or HETATM record, from columns 77-78, or else from the atom
+// name in columns 13-16, where the element symbol is right-justified in columns 13-14.
+static uint32_t pdb_element(const char * line, size_t length) {
+  if (length >= 78) {
+    uint32_t z = atomic_number(trim(line + 76, line + 78));
+    if (z != 0) return z;
+  }
+  if (is_letter(line[12])) return atomic_number(letters(std::string_view(line + 12, 2)));
+  return atomic_number(letters(std::string_view(line + 13, 1)));
+}
+
+// an atom serial number field, or -1 if it's empty (or in hybrid-36)
+static int64_t pdb_serial(const char * begin, const char * end) {
+  uint64_t serial;
+  if (!parse_uint(begin, end, serial)) return -1;
+  return (begin == end || is_space(*begin)) ? int64_t(serial) : -1;
+}
+
+Structure read_pdb(const std::string & filename, float atom_radius) {
+  femto::mapped_file file(filename, femto::MapAccess::READ_ONLY, femto::MapAdvice::SEQUENTIAL);
+  if (!file) {
+    std::cout << "file not found: " << filename << std::endl;
+    return Structure{};
+  }
+
+  // only the atoms of the first model of files with several (e.g. NMR ensembles),
+  // but the CONECT records come after the last model, so the whole file is read
+  std::string_view text(file.data(), file.size());
+  const char * first_model_end = file.data() + std::min(text.find("\nENDMDL"), text.size());
+
+  auto chunks = parse_lines(file.data(), file.data() + file.size(), [&](const char * line, const char * line_end, Chunk & chunk) {
+    size_t length = line_end - line;
+    std::string_view record(line, std::min< size_t >(length, 6));
+
+    if ((record == "ATOM  " || record == "HETATM") && length >= 54 && line < first_model_end) {
+      glm::vec3 p;
+      const char * x = line + 30;
+      const char * y = line + 38;
+      const char * z = line + 46;
+      if (!parse_float(x, line + 38, p.x) || !parse_float(y, line + 46, p.y) || !parse_float(z, line + 54, p.z)) return;
+      chunk.atoms.push_back(Sphere{p, atom_radius});
+      chunk.atomic_numbers.push_back(pdb_element(line, length));
+      chunk.serials.push_back(pdb_serial(line + 6, line + 11));
+    }
+
+    if (record == "CONECT" && length >= 16) {
+      int64_t from = pdb_serial(line + 6, line + 11);
+      for (size_t column = 11; column + 5 <= std::min< size_t >(length, 31); column += 5) {
+        int64_t to = pdb_serial(line + column, line + column + 5);
+        if (from >= 0 && to >= 0) chunk.links.push_back({from, to});
+      }
+    }
+  });
+
+  Structure structure = concatenate(chunks);
+
+  // NMR and EM entries have a CRYST1 record too, with a placeholder 1 x 1 x 1 cell
+  size_t cryst1 = (text.substr(0, 6) == "CRYST1") ? 0 : text.find("\nCRYST1");
+  if (cryst1 != std::string_view::npos) {
+    const char * line = file.data() + cryst1 + ((cryst1 == 0) ? 0 : 1);
+    const char * line_stop = line_end(line, file.data() + file.size());
+    static constexpr int columns[7] = {6, 15, 24, 33, 40, 47, 54};
+    float parameters[6];
+    bool valid = (line_stop - line >= 54);
+    for (int i = 0; valid && i < 6; i++) {
+      const char * p = line + columns[i];
+      valid = parse_float(p, line + columns[i + 1], parameters[i]);
+    }
+    if (valid && !(parameters[0] == 1.0f && parameters[1] == 1.0f && parameters[2] == 1.0f)) {
+      unit_cell(parameters[0], parameters[1], parameters[2], parameters[3], parameters[4], parameters[5], structure.cell);
+    }
+  }
+
+  size_t num_links = 0;
+  for (auto & chunk : chunks) num_links += chunk.links.size();
+  if (num_links > 0) {
+    std::unordered_map< int64_t, uint32_t > index_of;
+    index_of.reserve(structure.atoms.size());
+    uint32_t index = 0;
+    for (auto & chunk : chunks) {
+      for (int64_t serial : chunk.serials) index_of.emplace(serial, index++);
+    }
+
+    // CONECT records list each bond from both of its atoms
+    for (auto & chunk : chunks) {
+      for (auto & link : chunk.links) {
+        auto a = index_of.find(link[0]);
+        auto b = index_of.find(link[1]);
+        if (a == index_of.end() || b == index_of.end() || a->second == b->second) continue;
+        structure.bonds.push_back(Bond{{std::min(a->second, b->second), std::max(a->second, b->second)}, 1});
+      }
+    }
+
+    auto key = [](const Bond & b) { return (uint64_t(b.atoms[0]) << 32) | b.atoms[1]; };
+    std::sort(structure.bonds.begin(), structure.bonds.end(), [&](const Bond & a, const Bond & b) { return key(a) < key(b); });
+    structure.bonds.erase(std::unique(structure.bonds.begin(), structure.bonds.end(),
+      [&](const Bond & a, const Bond & b) { return key(a) == key(b); }), structure.bonds.end());
+  }
+
+  if (structure.atoms.empty()) std::cout << "no atoms found in: " << filename << std::endl;
+  return structure;
+}
+
+Structure read_mmcif(const std::string & filename, float atom_radius) {
+  femto::mapped_file file(filename, femto::MapAccess::READ_ONLY, femto::MapAdvice::SEQUENTIAL);
+  if (!file) {
+    std::cout << "file not found: " << filename << std::endl;
+    return Structure{};
+  }
+
+  const char * data = file.data();
+  const char * end = data + file.size();
+  std::string_view text(data, file.size());
+
+  static constexpr std::string_view prefix = "_atom_site.";
+  size_t header = (text.substr(0, prefix.size()) == prefix) ? 0 : text.find("\n_atom_site.");
+  if (header == std::string_view::npos) {
+    std::cout << "no _atom_site loop in: " << filename << std::endl;
+    return Structure{};
+  }
+
+  // the names of the loop's columns, one per line, followed by its rows
+  std::vector< std::string_view > columns;
+  const char * p = skip_lines(data + header, end, (header == 0) ? 0 : 1);
+  while (std::string_view(p, end - p).substr(0, prefix.size()) == prefix) {
+    const char * e = line_end(p, end);
+    columns.push_back(trim(p + prefix.size(), e));
+    p = skip_lines(p, end, 1);
+  }
+
+  auto column = [&](std::string_view name) {
+    auto c = std::find(columns.begin(), columns.end(), name);
+    return (c != columns.end()) ? int(c - columns.begin()) : -1;
+  };
+  int symbol = column("type_symbol");
+  int x = column("Cartn_x");
+  int y = column("Cartn_y");
+  int z = column("Cartn_z");
+  int model = column("pdbx_PDB_model_num");
+
+  static constexpr int max_columns = 64;
+  int needed = std::max({symbol, x, y, z, model}) + 1;
+  if (x < 0 || y < 0 || z < 0 || needed > max_columns) {
+    std::cout << "unsupported _atom_site columns in: " << filename << std::endl;
+    return Structure{};
+  }
+
+  // the rows end at the next comment, loop, item or data block
+  size_t rows_end = text.size();
+  for (std::string_view marker : {"\n#", "\nloop_", "\n_", "\ndata_"}) {
+    rows_end = std::min(rows_end, text.find(marker, p - data));
+  }
+
+  // only the first model of files with several (e.g. NMR ensembles)
+  std::string first_model;
+  if (model >= 0) {
+    std::string_view tokens[max_columns];
+    if (tokenize(p, line_end(p, data + rows_end), tokens, needed) == needed) first_model = tokens[model];
+  }
+
+  auto chunks = parse_lines(p, data + rows_end, [&](const char * line, const char * line_end, Chunk & chunk) {
+    std::string_view tokens[max_columns];
+    if (tokenize(line, line_end, tokens, needed) < needed) return;
+    if (!first_model.empty() && tokens[model] != first_model) return;
+
+    glm::vec3 position;
+    if (!parse_float(tokens[x], position.x) || !parse_float(tokens[y], position.y) || !parse_float(tokens[z], position.z)) return;
+    chunk.atoms.push_back(Sphere{position, atom_radius});
+    chunk.atomic_numbers.push_back((symbol >= 0) ? atomic_number(tokens[symbol]) : 0);
+  });
+
+  Structure structure = concatenate(chunks);
+
+  // the unit cell is given by single items, like "_cell.length_a 10.123(4)"
+  float parameters[6];
+  int found = 0;
+  for (std::string_view name : {"_cell.length_a", "_cell.length_b", "_cell.length_c",
+                                "_cell.angle_alpha", "_cell.angle_beta", "_cell.angle_gamma"}) {
+    size_t item = text.find(name);
+    if (item == std::string_view::npos || (item > 0 && text[item - 1] != '\n')) break;
+    const char * value = data + item + name.size();
+    if (value == end || !is_space(*value) || !parse_float(value, line_end(value, end), parameters[found])) break;
+    found++;
+  }
+  if (found == 6) {
+    unit_cell(parameters[0], parameters[1], parameters[2], parameters[3], parameters[4], parameters[5], structure.cell);
+  }
+
+  if (structure.atoms.empty()) std::cout << "no atoms found in: " << filename << std::endl;
+  return structure;
+}
+
+Structure parse_xyz_frame(const char * begin, const char * end, float atom_radius) {
+  begin = skip_blank_lines(begin, end);
+
+  uint64_t count = 0;
+  const char * p = begin;
+  if (!parse_uint(p, line_end(begin, end), count)) {
+    std::cout << "XYZ frame doesn't start with a number of atoms" << std::endl;
+    return Structure{};
+  }
+
+  // the line with the number of atoms is followed by a comment line, and then a line per atom
+  const char * atoms_begin = skip_lines(begin, end, 2);
+  const char * atoms_end = skip_lines(atoms_begin, end, count);
+
+  auto chunks = parse_lines(atoms_begin, atoms_end, [&](const char * line, const char * line_end, Chunk & chunk) {
+    std::string_view tokens[4];
+    if (tokenize(line, line_end, tokens, 4) < 4) return;
+
+    // the element can also be given by its atomic number
+    uint64_t z = 0;
+    const char * s = tokens[0].data();
+    if (!parse_uint(s, s + tokens[0].size(), z)) z = atomic_number(letters(tokens[0]));
+
+    glm::vec3 position;
+    if (!parse_float(tokens[1], position.x) || !parse_float(tokens[2], position.y) || !parse_float(tokens[3], position.z)) return;
+    chunk.atoms.push_back(Sphere{position, atom_radius});
+    chunk.atomic_numbers.push_back(z);
+  });
+
+  Structure structure = concatenate(chunks);
+  if (structure.atoms.size() != count) {
+    std::cout << "XYZ frame has " << structure.atoms.size() << " of its " << count << " atoms" << std::endl;
+  }
+  return structure;
+}
+
+std::vector< uint64_t > xyz_frame_index(const char * data, size_t size) {
+  const char * end = data + size;
+
+  std::vector< uint64_t > index;
+  const char * p = skip_blank_lines(data, end);
+  while (p < end) {
+    uint64_t count = 0;
+    const char * q = p;
+    if (!parse_uint(q, line_end(p, end), count)) {
+      std::cout << "XYZ frame " << index.size() << " doesn't start with a number of atoms" << std::endl;
+      break;
+    }
+    index.push_back(p - data);
+    p = skip_blank_lines(skip_lines(p, end, count + 2), end);
+  }
+  index.push_back(p - data);
+  return index;
+}
+
+Structure read_xyz(const std::string & filename, float atom_radius, uint32_t frame) {
+  femto::mapped_file file(filename, femto::MapAccess::READ_ONLY, femto::MapAdvice::SEQUENTIAL);
+  if (!file) {
+    std::cout << "file not found: " << filename << std::endl;
+    return Structure{};
+  }
+
+  const char * data = file.data();
+  const char * end = data + file.size();
+
+  // skip the frames before this one, without parsing their atoms
+  const char * p = skip_blank_lines(data, end);
+  for (uint32_t f = 0; f < frame && p < end; f++) {
+    uint64_t count = 0;
+    const char * q = p;
+    if (!parse_uint(q, line_end(p, end), count)) break;
+    p = skip_blank_lines(skip_lines(p, end, count + 2), end);
+  }
+
+  if (p == end) {
+    std::cout << "XYZ file doesn't have a frame " << frame << ": " << filename << std::endl;
+    return Structure{};
+  }
+  return parse_xyz_frame(p, end, atom_radius);
+}
+
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <string_view>
+
+#include <glm/glm.hpp>
+
+#include "spheres.hpp"
+#include "bonds.hpp"
+
+namespace Graphics {
+
+// the atoms of a molecule or crystal, with positions in angstroms
+struct Structure {
+  std::vector< Sphere > atoms;
+  std::vector< uint32_t > atomic_numbers;
+
+  // only the bonds listed in the file (e.g. PDB CONECT records), see find_bonds() for the rest
+  std::vector< Bond > bonds;
+
+  // the basis vectors of the unit cell of a crystal structure, or zero when the file has none
+  glm::vec3 cell[3] = {glm::vec3(0.0f), glm::vec3(0.0f), glm::vec3(0.0f)};
+};
+
+// atomic number of an element symbol, in any case (e.g. "C", "Cl" or "CL"), or 0 if it isn't one
+uint32_t atomic_number(std::string_view symbol);
+
+// Readers for the atoms of the first model of a PDB or mmCIF file (and its unit cell, from CRYST1
+// or _cell), or of one frame of a (multi-frame) XYZ file, which give every atom a radius of atom_radius.
+//
+// The file is mapped, split into line-aligned chunks, and the chunks are parsed in parallel.
+// mmCIF files are expected to have one _atom_site row per line, as the PDB writes them.
+Structure read_pdb(const std::string & filename, float atom_radius);
+Structure read_mmcif(const std::string & filename, float atom_radius);
+Structure read_xyz(const std::string & filename, float atom_radius, uint32_t frame = 0);
+
+// For reading XYZ trajectories a frame at a time: the byte offsets of the frames in the contents
+// of an XYZ file, where frame f is [index[f], index[f + 1]), which takes one pass over its lines.
+std::vector< uint64_t > xyz_frame_index(const char * data, size_t size);
+
+// the atoms of one frame of an XYZ file, from the line with its number of atoms up to `end`
+Structure parse_xyz_frame(const char * begin, const char * end, float atom_radius);
+
+}
@@ -0,0 +1,116 @@
+#include "trajectory.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+
+#include "scene_file.hpp"
+#include "misc/binary_io.hpp"
+
+namespace Graphics {
+
+Trajectory::Trajectory(const std::string & filename) :
+  file(filename, femto::MapAccess::READ_ONLY, femto::MapAdvice::SEQUENTIAL),
+  current_frame(0), next_frame(0), pending(false), decoded(false), stop(false) {
+
+  if (!file) {
+    std::cout << "file not found: " << filename << std::endl;
+    return;
+  }
+
+  std::string cached = cache_path(filename, ".frames").string();
+  if (!read_index(filename, cached)) {
+    index = xyz_frame_index(file.data(), file.size());
+    if (num_frames() > 0 && !cached.empty()) write_binary(index, cached);
+  }
+
+  if (num_frames() == 0) {
+    std::cout << "no frames found in: " << filename << std::endl;
+    return;
+  }
+
+  // frames are mostly read in order, but not always from the start
+  file.advise(femto::MapAdvice::NORMAL);
+  if (num_frames() > 1) background = std::thread([this]() { decode_next(); });
+  current_frame = num_frames();
+  seek(0);
+}
+
+Trajectory::~Trajectory() {
+  {
+    std::lock_guard< std::mutex > lock(mutex);
+    stop = true;
+  }
+  changed.notify_all();
+  if (background.joinable()) background.join();
+}
+
+// the saved index, if it's at least as new as the trajectory and covers all of it
+bool Trajectory::read_index(const std::string & filename, const std::string & cached) {
+  if (cached.empty()) return false;
+
+  std::error_code source_error, cached_error;
+  auto source_time = std::filesystem::last_write_time(filename, source_error);
+  auto cached_time = std::filesystem::last_write_time(cached, cached_error);
+  if (cached_error || source_error || cached_time < source_time) return false;
+
+  index = read_binary< uint64_t >(cached);
+  if (index.size() < 2 || index.back() != file.size() || !std::is_sorted(index.begin(), index.end())) {
+    index.clear();
+    return false;
+  }
+  return true;
+}
+
+Structure Trajectory::decode(uint32_t f) const {
+  return parse_xyz_frame(file.data() + index[f], file.data() + index[f + 1], 0.0f);
+}
+
+// the background thread: decode each frame that seek() asks for, until the trajectory is destroyed
+void Trajectory::decode_next() {
+  std::unique_lock< std::mutex > lock(mutex);
+  while (true) {
+    changed.wait(lock, [this]() { return pending || stop; });
+    if (stop) return;
+
+    uint32_t f = next_frame;
+    lock.unlock();
+    Structure frame = decode(f);
+    lock.lock();
+
+    next = std::move(frame);
+    pending = false;
+    decoded = true;
+    changed.notify_all();
+  }
+}
+
+void Trajectory::seek(uint32_t f) {
+  if (f >= num_frames()) {
+    std::cout << "error: trajectory has no frame " << f << std::endl;
+    return;
+  }
+
+  std::unique_lock< std::mutex > lock(mutex);
+  changed.wait(lock, [this]() { return !pending; });
+  if (decoded && next_frame == f) {
+    current = std::move(next);
+    current_frame = f;
+  }
+  decoded = false;
+
+  if (current_frame != f) {
+    lock.unlock();
+    current = decode(f);
+    current_frame = f;
+    lock.lock();
+  }
+
+  if (num_frames() > 1) {
+    next_frame = (f + 1) % num_frames();
+    pending = true;
+    changed.notify_all();
+  }
+}
+
+}
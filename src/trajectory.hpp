@@ -0,0 +1,78 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <cstdint>
+#include <condition_variable>
+
+#include "spheres.hpp"
+#include "structure_files.hpp"
+#include "misc/mapped_file.hpp"
+
+namespace Graphics {
+
+// A multi-frame XYZ trajectory, played back a frame at a time.
+//
+// The file is mapped, and the byte offset of every frame is found once when it's opened (and
+// saved in the cache directory, see cache_path, for the next time), so seeking to any frame
+// only decodes that frame. While the caller draws the current frame, the one after it is
+// decoded by a background thread that lives as long as the trajectory, so advance() usually
+// only has to swap two buffers:
+//
+//   Trajectory trajectory("md.xyz");
+//   ...
+//   trajectory.advance();
+//   write trajectory.atoms()[i].center to spheres.map_positions()[i]
+//
+struct Trajectory {
+
+  Trajectory(const std::string & filename);
+  ~Trajectory();
+
+  Trajectory(const Trajectory &) = delete;
+  Trajectory & operator=(const Trajectory &) = delete;
+
+  // false if the file is missing or has no frames
+  explicit operator bool() const { return num_frames() > 0; }
+
+  uint32_t num_frames() const { return (index.size() > 1) ? index.size() - 1 : 0; }
+
+  // index of the current frame
+  uint32_t frame() const { return current_frame; }
+
+  // the atoms of the current frame, with a radius of 0, since XYZ files don't have one
+  const std::vector< Sphere > & atoms() const { return current.atoms; }
+
+  // Make frame f the current one. This doesn't have to wait for decoding when f is the frame
+  // after the previous current one (which was being decoded in the background), and
+  // otherwise decodes f first. Either way, decoding of the frame after f then starts.
+  void seek(uint32_t f);
+
+  // the next frame, wrapping around to the first after the last
+  void advance() { seek((current_frame + 1) % std::max(num_frames(), 1u)); }
+
+ private:
+  bool read_index(const std::string & filename, const std::string & cached);
+  Structure decode(uint32_t f) const;
+  void decode_next();
+
+  femto::mapped_file file;
+  std::vector< uint64_t > index;
+
+  uint32_t current_frame;
+  Structure current;
+
+  // next_frame is decoded into next by the background thread while pending is set
+  std::mutex mutex;
+  std::condition_variable changed;
+  uint32_t next_frame;
+  Structure next;
+  bool pending;
+  bool decoded;
+  bool stop;
+  std::thread background;
+};
+
+}
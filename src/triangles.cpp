@@ -244,16 +244,16 @@ Triangles::Triangles() : program({
   glGenVertexArrays(1, &vao);
   glBindVertexArray(vao);
 
-  glGenBuffers(1, &triangle_vbo);
-  glBindBuffer(GL_ARRAY_BUFFER, triangle_vbo);
+  triangle_vbo.generate();
+  glBindBuffer(GL_ARRAY_BUFFER, triangle_vbo.handle);
   program.setAttribute("vert", 3, 12, 0);
 
-  glGenBuffers(1, &normal_vbo);
-  glBindBuffer(GL_ARRAY_BUFFER, normal_vbo);
+  normal_vbo.generate();
+  glBindBuffer(GL_ARRAY_BUFFER, normal_vbo.handle);
   program.setAttribute("normal", 3, 12, 0);
 
-  glGenBuffers(1, &color_vbo);
-  glBindBuffer(GL_ARRAY_BUFFER, color_vbo);
+  color_vbo.generate();
+  glBindBuffer(GL_ARRAY_BUFFER, color_vbo.handle);
   program.setAttribute("rgba", 4, 4, 0, GL_TRUE, GL_UNSIGNED_BYTE);
 
   glCheckError(__FILE__, __LINE__);
@@ -271,6 +271,9 @@ void Triangles::append(const Tri3 & tri) {
   vertices.push_back(tri);
   normals.push_back(normalVectors(tri));
   colors.push_back({color, color, color});
+  triangle_vbo.mark_dirty(vertices.size() - 1);
+  normal_vbo.mark_dirty(normals.size() - 1);
+  color_vbo.mark_dirty(colors.size() - 1);
   dirty = true;
 }
 
@@ -278,6 +281,32 @@ void Triangles::append(const Tri3 & tri, const std::array< rgbcolor, 3 > & c) {
   vertices.push_back(tri);
   normals.push_back(normalVectors(tri));
   colors.push_back(c);
+  triangle_vbo.mark_dirty(vertices.size() - 1);
+  normal_vbo.mark_dirty(normals.size() - 1);
+  color_vbo.mark_dirty(colors.size() - 1);
+  dirty = true;
+}
+
+void Triangles::save(SceneWriter & scene, uint32_t tag) const {
+  scene.add(SectionType::TRIANGLES, vertices, tag);
+  scene.add(SectionType::TRIANGLE_NORMALS, normals, tag);
+  scene.add(SectionType::TRIANGLE_COLORS, colors, tag);
+}
+
+void Triangles::load(const SceneFile & scene, uint32_t tag) {
+  vertices = scene.read< Tri3 >(SectionType::TRIANGLES, tag);
+  normals = scene.read< Tri3 >(SectionType::TRIANGLE_NORMALS, tag);
+  colors = scene.read< color3 >(SectionType::TRIANGLE_COLORS, tag);
+
+  if (normals.size() != vertices.size()) {
+    normals.resize(vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++) normals[i] = normalVectors(vertices[i]);
+  }
+  if (colors.size() != vertices.size()) colors.assign(vertices.size(), {color, color, color});
+
+  triangle_vbo.mark_dirty(0, vertices.size());
+  normal_vbo.mark_dirty(0, normals.size());
+  color_vbo.mark_dirty(0, colors.size());
   dirty = true;
 }
 
@@ -322,14 +351,9 @@ void Triangles::draw(const Camera & camera) {
 
   glBindVertexArray(vao);
   if (dirty) {
-    glBindBuffer(GL_ARRAY_BUFFER, triangle_vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(Tri3) * vertices.size(), &vertices[0], GL_STATIC_DRAW);
-
-    glBindBuffer(GL_ARRAY_BUFFER, normal_vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(Tri3) * normals.size(), &normals[0], GL_STATIC_DRAW);
-
-    glBindBuffer(GL_ARRAY_BUFFER, color_vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(color3) * colors.size(), &colors[0], GL_STATIC_DRAW);
+    triangle_vbo.upload(vertices);
+    normal_vbo.upload(normals);
+    color_vbo.upload(colors);
     dirty = false;
   }
 
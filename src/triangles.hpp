@@ -9,6 +9,8 @@
 #include "Camera.hpp"
 #include "rgbcolor.hpp"
 #include "vertex.hpp"
+#include "dynamic_buffer.hpp"
+#include "scene_file.hpp"
 
 namespace Graphics {
 
@@ -28,14 +30,21 @@ struct Triangles {
   void set_color(rgbcolor c);
   void set_light(glm::vec3 direction, float intensity);
 
+  // Write the triangles, their normals and colors to a scene file, or replace them with the ones in it. The tag
+  // tells apart several Triangles objects saved to the same file.
+  void save(SceneWriter & scene, uint32_t tag = 0) const;
+  void load(const SceneFile & scene, uint32_t tag = 0);
+
   auto size() { return vertices.size(); }
 
+  const std::vector< Tri3 > & primitives() const { return vertices; }
+
  private:
   bool dirty;
   GLuint vao;
-  GLuint normal_vbo;
-  GLuint triangle_vbo;
-  GLuint color_vbo;
+  DynamicBuffer< Tri3 > normal_vbo;
+  DynamicBuffer< Tri3 > triangle_vbo;
+  DynamicBuffer< color3 > color_vbo;
 
   ShaderProgram program;
 
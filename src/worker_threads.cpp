@@ -0,0 +1,13 @@
+#include "worker_threads.hpp"
+
+#include <thread>
+#include <algorithm>
+
+namespace Graphics {
+
+threadpool & worker_threads() {
+  static threadpool pool(std::max(1u, std::thread::hardware_concurrency()));
+  return pool;
+}
+
+}
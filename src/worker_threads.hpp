@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+
+#include "misc/parallel_for.hpp"
+
+namespace Graphics {
+
+// The threads shared by the library's parallel loops: culling and binning,
+// bond inference, BVH builds, file parsing and trajectory frames. Created on
+// first use, with one thread per hardware thread.
+threadpool & worker_threads();
+
+// iterations per chunk of the parallel loops over primitives (or atoms),
+// enough that the chunks are worth handing to another thread
+static constexpr uint32_t primitive_grain = 4096;
+
+}
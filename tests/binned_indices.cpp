@@ -0,0 +1,99 @@
+#include <vector>
+#include <algorithm>
+
+#include "binned_indices.hpp"
+
+#include "testing.hpp"
+
+using namespace Graphics;
+
+uint8_t random_bin(uint32_t num_bins) {
+  return (rng() % 4 == 0) ? culled_bin : rng() % num_bins;
+}
+
+// each bin holds exactly the indices with that bin, and slots point back at them
+bool consistent(const BinnedIndices & binned, uint32_t num_bins) {
+  uint32_t n = binned.bins.size();
+  if (binned.slots.size() != n || binned.offsets.size() != num_bins + 1) return false;
+  if (binned.offsets[0] != 0 || binned.offsets[num_bins] != binned.permutation.size()) return false;
+
+  std::vector< bool > seen(n, false);
+  for (uint32_t b = 0; b < num_bins; b++) {
+    if (binned.offsets[b] > binned.offsets[b + 1]) return false;
+    for (uint32_t p = binned.offsets[b]; p < binned.offsets[b + 1]; p++) {
+      uint32_t i = binned.permutation[p];
+      if (i >= n || seen[i] || binned.bins[i] != b || binned.slots[i] != p) return false;
+      seen[i] = true;
+    }
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    bool culled = binned.bins[i] == culled_bin;
+    if (culled != !seen[i] || (culled && binned.slots[i] != BinnedIndices::none)) return false;
+  }
+  return true;
+}
+
+// Random changes of bins, removals and appends, after which a copy of the permutation that only
+// gets the written positions (as the GPU's index buffer does) must match the permutation.
+void test_random(threadpool & pool, int trial, uint32_t n, uint32_t num_bins, int operations) {
+  test_case = describe("trial ", trial, ", n = ", n, ", ", num_bins, " bins");
+
+  BinnedIndices binned;
+  binned.bins.resize(n);
+  for (auto & bin : binned.bins) bin = random_bin(num_bins);
+  binned.sort(pool, num_bins);
+  check(consistent(binned, num_bins), "bins are inconsistent after sort()");
+
+  std::vector< uint32_t > uploaded = binned.permutation;
+  bool ok = true;
+  for (int k = 0; k < operations; k++) {
+    uint32_t size = binned.bins.size();
+    int operation = rng() % 8;
+    if (operation == 0 && size > 0) {
+      binned.swap_remove(rng() % size);
+    } else if (operation == 1) {
+      uint32_t count = 1 + rng() % 3;
+      binned.append(count);
+      for (uint32_t i = size; i < size + count; i++) binned.set_bin(i, random_bin(num_bins));
+    } else if (size > 0) {
+      binned.set_bin(rng() % size, random_bin(num_bins));
+    }
+    ok &= consistent(binned, num_bins);
+
+    if (rng() % 4 == 0) {
+      uploaded.resize(std::max(uploaded.size(), binned.permutation.size()));
+      for (uint32_t p : binned.written) {
+        if (p < binned.permutation.size()) uploaded[p] = binned.permutation[p];
+      }
+      binned.written.clear();
+      ok &= std::equal(binned.permutation.begin(), binned.permutation.end(), uploaded.begin());
+    }
+  }
+  check(ok, "bins are inconsistent, or a changed position wasn't written");
+}
+
+int main() {
+
+  threadpool pool(3);
+  for (int trial = 0; trial < 200; trial++) {
+    uint32_t num_bins = (trial % 3 == 0) ? 1 : 1 + rng() % 8;
+    uint32_t n = (trial % 10 == 0) ? 0 : rng() % 300;
+    test_random(pool, trial, n, num_bins, 500);
+  }
+
+  // more than a chunk of the parallel sort
+  test_random(pool, -1, 3 * primitive_grain + 5, 5, 2000);
+
+  test_case.clear();
+
+  // changing one index's bin only writes a position per bin it crosses
+  BinnedIndices binned;
+  binned.bins.assign(10000, 0);
+  for (uint32_t i = 0; i < 10000; i++) binned.bins[i] = i % 4;
+  binned.sort(pool, 4);
+  binned.set_bin(0, 3);
+  check(binned.written.size() <= 5, "moving one index wrote too many positions");
+
+  return finish("binned_indices");
+
+}
@@ -0,0 +1,89 @@
+#include <set>
+#include <cmath>
+#include <vector>
+#include <utility>
+
+#include "bonds.hpp"
+
+#include "testing.hpp"
+
+using namespace Graphics;
+
+// every pair of atoms, with the same criterion as find_bonds, where unknown elements don't bond
+std::set< std::pair< uint32_t, uint32_t > > brute_force(const std::vector< Sphere > & atoms,
+                                                        const std::vector< uint32_t > & atomic_numbers,
+                                                        float tolerance) {
+  std::set< std::pair< uint32_t, uint32_t > > bonds;
+  for (uint32_t i = 0; i < atoms.size(); i++) {
+    for (uint32_t j = i + 1; j < atoms.size(); j++) {
+      glm::vec3 d = atoms[i].center - atoms[j].center;
+      float ri = covalent_radius(atomic_numbers[i]);
+      float rj = covalent_radius(atomic_numbers[j]);
+      float cutoff = ri + rj + tolerance;
+      float distance_squared = glm::dot(d, d);
+      if (ri > 0.0f && rj > 0.0f && distance_squared <= cutoff * cutoff && distance_squared >= 0.4f * 0.4f) {
+        bonds.insert({i, j});
+      }
+    }
+  }
+  return bonds;
+}
+
+// Random atoms in a box of the given extents, with elements from hydrogen to krypton and
+// a few of them unknown. Some atoms are copies of others, moved a little, so there are pairs
+// closer than 0.4 angstroms, and pairs right around the cutoff.
+void test_random(int trial, uint32_t n, glm::vec3 extent, float tolerance) {
+  test_case = describe("trial ", trial, ", n = ", n);
+
+  std::vector< Sphere > atoms(n);
+  std::vector< uint32_t > atomic_numbers(n);
+  for (uint32_t i = 0; i < n; i++) {
+    atoms[i] = Sphere{glm::vec3(uniform(0.0f, extent.x), uniform(0.0f, extent.y), uniform(0.0f, extent.z)), 0.3f};
+    atomic_numbers[i] = (rng() % 20 == 0) ? 200 : 1 + rng() % 36;
+    if (i > 0 && rng() % 8 == 0) {
+      atoms[i].center = atoms[rng() % i].center + glm::vec3(uniform(-0.5f, 0.5f), uniform(-0.5f, 0.5f), 0.0f);
+    }
+  }
+
+  std::vector< Bond > bonds = find_bonds(atoms, atomic_numbers, tolerance);
+
+  std::set< std::pair< uint32_t, uint32_t > > found;
+  bool ordered = true;
+  for (auto & bond : bonds) {
+    ordered &= bond.atoms[0] < bond.atoms[1];
+    found.insert({bond.atoms[0], bond.atoms[1]});
+  }
+
+  check(ordered, "bond doesn't have atoms[0] < atoms[1]");
+  check(found.size() == bonds.size(), "bond found more than once");
+  check(found == brute_force(atoms, atomic_numbers, tolerance), "bonds differ from the brute force search");
+  check(find_bonds(atoms, atomic_numbers, tolerance).size() == bonds.size(), "bonds differ between calls");
+}
+
+int main() {
+
+  for (int trial = 0; trial < 4; trial++) {
+    test_random(trial, 300 + 200 * trial, glm::vec3(12.0f), 0.45f);
+  }
+
+  // thin slabs and long rods, where most of the grid's dimensions are a single cell
+  test_random(4, 500, glm::vec3(40.0f, 40.0f, 1.0f), 0.45f);
+  test_random(5, 500, glm::vec3(200.0f, 2.0f, 2.0f), 0.45f);
+
+  // sparse, where most cells are empty, and a larger tolerance
+  test_random(6, 400, glm::vec3(300.0f), 0.45f);
+  test_random(7, 400, glm::vec3(12.0f), 1.0f);
+
+  test_case.clear();
+  check(find_bonds({}, {}).empty(), "no atoms, but found bonds");
+  check(find_bonds({Sphere{glm::vec3(0.0f), 0.3f}}, {6}).empty(), "a single atom, but found bonds");
+
+  // positions that aren't finite can't be put in a grid, so they're reported instead
+  std::vector< Sphere > with_nan = {Sphere{glm::vec3(0.0f), 0.3f}, Sphere{glm::vec3(NAN), 0.3f},
+                                    Sphere{glm::vec3(1.2f, 0.0f, 0.0f), 0.3f}};
+  check(find_bonds(with_nan, {6, 6, 6}).empty(), "found bonds with a NaN atom");
+  check(find_bonds(with_nan, {6, 6}).empty(), "found bonds with too few atomic numbers");
+
+  return finish("bonds");
+
+}
@@ -0,0 +1,121 @@
+#include <vector>
+
+#include "bvh.hpp"
+
+#include "testing.hpp"
+
+using namespace Graphics;
+
+glm::vec3 random_point(float extent) {
+  return glm::vec3(uniform(0.0f, extent), uniform(0.0f, extent), uniform(0.0f, extent));
+}
+
+glm::vec3 random_direction() {
+  while (true) {
+    glm::vec3 d(uniform(-1.0f, 1.0f), uniform(-1.0f, 1.0f), uniform(-1.0f, 1.0f));
+    float length = glm::length(d);
+    if (length > 0.1f && length < 1.0f) return d / length;
+  }
+}
+
+Sphere random_primitive(Sphere) {
+  return Sphere{random_point(10.0f), uniform(0.05f, 0.5f)};
+}
+
+Cylinder random_primitive(Cylinder) {
+  glm::vec3 p = random_point(10.0f);
+  return Cylinder{Sphere{p, uniform(0.05f, 0.3f)}, Sphere{p + random_direction(), uniform(0.05f, 0.3f)}};
+}
+
+Tri3 random_primitive(Tri3) {
+  glm::vec3 p = random_point(10.0f);
+  return Tri3{p, p + random_direction(), p + random_direction()};
+}
+
+// A ray from inside or around the scene. Every other one is axis-aligned, with its origin often
+// on the planes of the primitives' boxes, so that the slab test sees 0 * inf for the zero
+// components of its direction.
+template < typename T >
+Ray random_ray(int query, const std::vector< T > & primitives) {
+  if (query % 2 == 0 || primitives.empty()) {
+    return Ray{random_point(12.0f) - 1.0f, random_direction()};
+  }
+
+  int axis = (query / 2) % 3;
+  glm::vec3 direction(0.0f);
+  direction[axis] = (query % 4 == 1) ? 1.0f : -1.0f;
+
+  AABB box = bounds(primitives[rng() % primitives.size()]);
+  glm::vec3 origin;
+  for (int a = 0; a < 3; a++) {
+    float choices[3] = {box.min[a], box.max[a], uniform(box.min[a], box.max[a])};
+    origin[a] = choices[rng() % 3];
+  }
+  origin[axis] -= direction[axis] * 20.0f;
+  return Ray{origin, direction};
+}
+
+template < typename T >
+void test_raycasts(uint32_t n) {
+  std::vector< T > primitives(n);
+  for (auto & p : primitives) p = random_primitive(T{});
+
+  test_case = describe("n = ", n);
+
+  BVH bvh;
+  bvh.build(primitives);
+  check(bvh.size() == n, "wrong number of leaves");
+
+  for (int query = 0; query < 1000; query++) {
+    test_case = describe("n = ", n, ", query ", query);
+    Ray ray = random_ray(query, primitives);
+
+    float closest = miss;
+    for (auto & p : primitives) closest = std::min(closest, intersect(ray, p));
+
+    BVH::Hit hit = bvh.raycast(ray, primitives);
+    check(hit.t == closest, "raycast differs from the linear scan");
+    if (closest != miss && hit.t == closest) {
+      check(intersect(ray, primitives[hit.primitive]) == closest, "raycast reports the wrong primitive");
+    }
+  }
+
+  // the same rays after the primitives move a little
+  for (auto & p : primitives) {
+    T moved = random_primitive(T{});
+    p = (rng() % 4 == 0) ? moved : p;
+  }
+  bvh.refit(primitives);
+
+  for (int query = 0; query < 200; query++) {
+    test_case = describe("n = ", n, ", query ", query, ", after refit");
+    Ray ray = random_ray(query, primitives);
+
+    float closest = miss;
+    for (auto & p : primitives) closest = std::min(closest, intersect(ray, p));
+
+    check(bvh.raycast(ray, primitives).t == closest, "raycast after refit differs from the linear scan");
+  }
+}
+
+int main() {
+
+  for (uint32_t n : {0, 1, 2, 3, 100, 5000}) {
+    test_raycasts< Sphere >(n);
+    test_raycasts< Cylinder >(n);
+    test_raycasts< Tri3 >(n);
+  }
+
+  test_case.clear();
+
+  // a ray parallel to a face of a box, starting on that face's plane
+  AABB box{glm::vec3(0.0f), glm::vec3(1.0f)};
+  Ray grazing{glm::vec3(-1.0f, 0.0f, 0.5f), glm::vec3(1.0f, 0.0f, 0.0f)};
+  check(intersect(grazing, 1.0f / grazing.direction, box, miss) == 1.0f, "ray along a face misses the box");
+
+  Ray outside{glm::vec3(-1.0f, -0.5f, 0.5f), glm::vec3(1.0f, 0.0f, 0.0f)};
+  check(intersect(outside, 1.0f / outside.direction, box, miss) == miss, "parallel ray outside hits the box");
+
+  return finish("bvh");
+
+}
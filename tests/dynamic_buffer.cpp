@@ -0,0 +1,81 @@
+#include <vector>
+
+#include "dynamic_buffer.hpp"
+
+#include "testing.hpp"
+
+using namespace Graphics;
+
+// the ranges must be sorted, nonempty, separated by gaps, and cover every marked element
+void test_random(int trial, size_t n, int edits, size_t max_length) {
+  test_case = describe("trial ", trial, ", n = ", n);
+
+  DynamicBuffer< float > buffer;
+  std::vector< bool > marked(n, false);
+  for (int e = 0; e < edits; e++) {
+    size_t begin = rng() % n;
+    size_t end = std::min(n, begin + 1 + rng() % max_length);
+    buffer.mark_dirty(begin, end);
+    for (size_t i = begin; i < end; i++) marked[i] = true;
+  }
+
+  auto & ranges = buffer.dirty_ranges;
+  bool ordered = true;
+  for (size_t r = 0; r < ranges.size(); r++) {
+    ordered &= ranges[r].begin < ranges[r].end;
+    if (r > 0) ordered &= ranges[r - 1].end < ranges[r].begin;
+  }
+  check(ordered, "dirty ranges are empty, overlapping, touching or out of order");
+  check(ranges.size() <= DynamicBuffer< float >::max_dirty_ranges, "too many dirty ranges");
+
+  std::vector< bool > covered(n, false);
+  for (auto & r : ranges) {
+    for (size_t i = r.begin; i < r.end; i++) covered[i] = true;
+  }
+  bool all = true;
+  for (size_t i = 0; i < n; i++) all &= !marked[i] || covered[i];
+  check(all, "a marked element isn't in a dirty range");
+
+  // with few enough edits, nothing unmarked is uploaded
+  if (edits <= int(DynamicBuffer< float >::max_dirty_ranges)) {
+    check(covered == marked, "an unmarked element is in a dirty range");
+  }
+}
+
+int main() {
+
+  for (int trial = 0; trial < 1000; trial++) {
+    int edits = (trial % 2 == 0) ? 1 + rng() % 16 : 1 + rng() % 200;
+    test_random(trial, 1 + rng() % 1000, edits, 1 + rng() % 20);
+  }
+
+  test_case.clear();
+
+  // the first and last elements are two ranges, not the whole buffer
+  DynamicBuffer< float > ends;
+  ends.mark_dirty(0);
+  ends.mark_dirty(999999);
+  check(ends.dirty_ranges.size() == 2 && ends.dirty_ranges[0].end == 1 && ends.dirty_ranges[1].begin == 999999,
+        "editing the first and last elements doesn't give two ranges");
+
+  // neighbors are merged into one range
+  DynamicBuffer< float > neighbors;
+  for (size_t i = 0; i < 100; i++) neighbors.mark_dirty(i);
+  check(neighbors.dirty_ranges.size() == 1 && neighbors.dirty_ranges[0].end == 100,
+        "adjacent elements aren't merged into one range");
+
+  // past the limit, the two closest ranges are merged
+  DynamicBuffer< float > scattered;
+  for (size_t i = 0; i <= DynamicBuffer< float >::max_dirty_ranges; i++) scattered.mark_dirty(100 * i);
+  scattered.mark_dirty(1002);
+  check(scattered.dirty_ranges.size() == DynamicBuffer< float >::max_dirty_ranges, "the ranges weren't merged");
+  check(scattered.dirty_ranges[9].begin == 1000 && scattered.dirty_ranges[9].end == 1003,
+        "the closest ranges weren't the ones merged");
+
+  DynamicBuffer< float > empty;
+  empty.mark_dirty(5, 5);
+  check(!empty.dirty(), "an empty range made the buffer dirty");
+
+  return finish("dynamic_buffer");
+
+}
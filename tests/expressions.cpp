@@ -0,0 +1,57 @@
+#include <vector>
+
+#include "misc/heap_array.hpp"
+
+#include "testing.hpp"
+
+using float_buffer = buffer< float, MemorySpace::CPU >;
+
+float_buffer random_buffer(size_t n) {
+  float_buffer b(n);
+  for (auto & x : b) x = uniform(-1.0f, 1.0f);
+  return b;
+}
+
+// lengths that aren't multiples of the simd width, so the scalar tail runs too
+void test_evaluate(size_t n) {
+  test_case = describe("n = ", n);
+  float_buffer a = random_buffer(n);
+  float_buffer b = random_buffer(n);
+  float_buffer c;
+  c = femto::clamp(2.0f * a - b, -0.5f, 0.5f);
+
+  bool same = c.size() == n;
+  for (size_t i = 0; same && i < n; i++) {
+    same &= c[i] == std::min(std::max(2.0f * a[i] - b[i], -0.5f), 0.5f);
+  }
+  check(same, "expression evaluated wrong");
+}
+
+// operands of different sizes are rejected, instead of reading past the shorter one
+void test_mismatch() {
+  test_case = "size mismatch";
+  float_buffer a = random_buffer(20);
+  float_buffer b = random_buffer(13);
+  check((a + b).size() == 0 && (b * 2.0f - a).size() == 0, "mismatched expression isn't empty");
+
+  heap_array< float, 2 > rows(3, 20);
+  rows.fill(1.0f);
+  rows(1) = a * b;
+  rows(2) += b;
+  bool unchanged = true;
+  for (float x : rows) unchanged &= x == 1.0f;
+  check(unchanged, "row was written from a mismatched expression");
+
+  rows(1) = a * 0.0f;
+  rows(2) += a;
+  check(rows(0, 5) == 1.0f && rows(1, 5) == 0.0f && rows(2, 5) == 1.0f + a[5], "row wasn't written");
+}
+
+int main() {
+
+  for (size_t n : {0, 1, 7, 8, 15, 16, 17, 100, 1001}) test_evaluate(n);
+  test_mismatch();
+
+  return finish("expressions");
+
+}
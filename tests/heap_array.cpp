@@ -0,0 +1,99 @@
+#include <vector>
+#include <numeric>
+#include <filesystem>
+
+#include "misc/heap_array.hpp"
+
+#include "testing.hpp"
+
+using float_buffer = buffer< float, MemorySpace::CPU >;
+
+float_buffer iota(size_t n, float first = 0.0f) {
+  float_buffer b(n);
+  std::iota(b.begin(), b.end(), first);
+  return b;
+}
+
+bool equals_iota(const float_buffer & b, size_t n, float first = 0.0f) {
+  if (b.size() != n) return false;
+  for (size_t i = 0; i < n; i++) {
+    if (b[i] != first + i) return false;
+  }
+  return true;
+}
+
+// a moved-from buffer is empty, and can be resized and written like a new one
+void test_moved_from() {
+  test_case = "move construction";
+  float_buffer a = iota(100);
+  float_buffer b(std::move(a));
+  check(equals_iota(b, 100), "moved-to buffer has the wrong contents");
+  check(a.size() == 0 && a.capacity() == 0 && a.begin() == nullptr, "moved-from buffer isn't empty");
+  a.resize(50, 1.0f);
+  check(a.size() == 50 && a[49] == 1.0f, "moved-from buffer can't be resized");
+
+  test_case = "move assignment";
+  float_buffer c = iota(100);
+  float_buffer d = iota(10, 5.0f);
+  d = std::move(c);
+  check(equals_iota(d, 100), "move-assigned buffer has the wrong contents");
+  check(c.size() == 0 && c.capacity() == 0 && c.begin() == nullptr, "moved-from buffer isn't empty");
+  c.resize(8);
+  std::iota(c.begin(), c.end(), 3.0f);
+  check(equals_iota(c, 8, 3.0f), "moved-from buffer can't be resized and written");
+  c = std::move(d);
+  check(equals_iota(c, 100) && d.size() == 0, "moved-from buffer can't be moved into");
+
+  test_case = "self move assignment";
+  float_buffer & alias = c;
+  c = std::move(alias);
+  check(equals_iota(c, 100), "self move assignment changed the buffer");
+}
+
+// reserve() and shrink_to_fit() only change the capacity
+void test_capacity() {
+  test_case = "capacity";
+  float_buffer b = iota(10);
+  b.reserve(1000);
+  check(b.capacity() >= 1000 && equals_iota(b, 10), "reserve() changed the contents");
+  b.resize(5);
+  b.shrink_to_fit();
+  check(b.capacity() == 5 && equals_iota(b, 5), "shrink_to_fit() changed the contents");
+  b.resize(6);
+  check(b.capacity() >= 10 && b.size() == 6, "resize() past capacity() doesn't double it");
+}
+
+// mapping a file with the wrong number of elements leaves an empty array, not a bad shape
+void test_map_shape() {
+  test_case = "map_from_file";
+  std::string filename = (std::filesystem::temp_directory_path() / "heap_array_test.bin").string();
+  float_buffer b = iota(12);
+  b.write_to_file(filename);
+
+  heap_array< float, 2 > a(2, 2);
+  a.map_from_file(filename, 3, 4);
+  check(a.mapped() && a.shape(0) == 3 && a.shape(1) == 4 && a(2, 3) == 11.0f, "2D array mapped wrong");
+  a.map_from_file(filename, 5, 5);
+  check(!a.mapped() && a.size() == 0 && a.shape(0) == 0 && a.shape(1) == 0, "2D array with the wrong shape isn't empty");
+
+  heap_array< float, 3 > c;
+  c.map_from_file(filename, 2, 3, 2);
+  check(c.mapped() && c.shape(2) == 2 && c(1, 2, 1) == 11.0f, "3D array mapped wrong");
+  c.map_from_file(filename + ".missing", 2, 3, 2);
+  check(c.size() == 0 && c.shape(0) == 0, "3D array mapped from a missing file isn't empty");
+  c.map_from_file(filename, 2, 3, 2);
+  c.map_from_file(filename, 2, 3, 4);
+  check(!c.mapped() && c.size() == 0 && c.shape(0) == 0 && c.shape(2) == 0, "3D array with the wrong shape isn't empty");
+
+  std::filesystem::remove(filename);
+}
+
+int main() {
+
+  test_moved_from();
+  test_capacity();
+  test_map_shape();
+
+  return finish("heap_array");
+
+}
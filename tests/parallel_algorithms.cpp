@@ -0,0 +1,169 @@
+#include <atomic>
+#include <limits>
+#include <random>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+
+#include "misc/parallel_for.hpp"
+
+#include "testing.hpp"
+
+// few distinct keys, so that stability is visible through the original index
+struct Item {
+  int key;
+  uint32_t index;
+  bool operator==(const Item & other) const { return key == other.key && index == other.index; }
+};
+
+std::vector< Item > random_items(uint64_t n) {
+  std::vector< Item > items(n);
+  for (uint64_t i = 0; i < n; i++) {
+    items[i] = Item{int(rng() % 64) - 32, uint32_t(i)};
+  }
+  return items;
+}
+
+void test_algorithms(threadpool & pool, uint64_t n) {
+  test_case = describe("threads = ", pool.num_threads, ", n = ", n);
+  std::vector< Item > items = random_items(n);
+
+  std::vector< int64_t > keys(n);
+  for (uint64_t i = 0; i < n; i++) keys[i] = items[i].key;
+
+  auto plus = [](int64_t a, int64_t b) { return a + b; };
+
+  // reduce
+  int64_t sum = pool.parallel_reduce(n, int64_t(0), [&](uint64_t i) { return keys[i]; }, plus);
+  check(sum == std::accumulate(keys.begin(), keys.end(), int64_t(0)), "parallel_reduce differs from std::accumulate");
+
+  int64_t largest = pool.parallel_reduce(n, std::numeric_limits< int64_t >::lowest(), [&](uint64_t i) { return keys[i]; },
+                                         [](int64_t a, int64_t b) { return std::max(a, b); });
+  int64_t expected = n ? *std::max_element(keys.begin(), keys.end()) : std::numeric_limits< int64_t >::lowest();
+  check(largest == expected, "parallel_reduce (max) differs from std::max_element");
+
+  // scans, into another vector and in place
+  std::vector< int64_t > scanned, expected_scan(n);
+  pool.parallel_inclusive_scan(keys, scanned, int64_t(0), plus);
+  std::inclusive_scan(keys.begin(), keys.end(), expected_scan.begin());
+  check(scanned == expected_scan, "parallel_inclusive_scan differs from std::inclusive_scan");
+
+  pool.parallel_exclusive_scan(keys, scanned, int64_t(0), plus);
+  std::exclusive_scan(keys.begin(), keys.end(), expected_scan.begin(), int64_t(0));
+  check(scanned == expected_scan, "parallel_exclusive_scan differs from std::exclusive_scan");
+
+  scanned = keys;
+  pool.parallel_exclusive_scan(scanned, scanned, int64_t(0), plus);
+  check(scanned == expected_scan, "in-place parallel_exclusive_scan differs from std::exclusive_scan");
+
+  // copy_if
+  auto negative = [](const Item & x) { return x.key < 0; };
+  std::vector< Item > copied, expected_copy;
+  pool.parallel_copy_if(items, copied, negative);
+  std::copy_if(items.begin(), items.end(), std::back_inserter(expected_copy), negative);
+  check(copied == expected_copy, "parallel_copy_if differs from std::copy_if");
+
+  // stable partition
+  std::vector< Item > partitioned = items, expected_partition = items;
+  uint64_t count = pool.parallel_partition(partitioned, negative);
+  auto middle = std::stable_partition(expected_partition.begin(), expected_partition.end(), negative);
+  check(count == uint64_t(middle - expected_partition.begin()), "parallel_partition returns the wrong count");
+  check(partitioned == expected_partition, "parallel_partition differs from std::stable_partition");
+
+  // stable sort, by key only
+  auto by_key = [](const Item & a, const Item & b) { return a.key < b.key; };
+  std::vector< Item > sorted = items, expected_sort = items;
+  pool.parallel_sort(sorted, by_key);
+  std::stable_sort(expected_sort.begin(), expected_sort.end(), by_key);
+  check(sorted == expected_sort, "parallel_sort differs from std::stable_sort");
+
+  std::vector< int64_t > sorted_keys = keys, expected_keys = keys;
+  pool.parallel_sort(sorted_keys);
+  std::sort(expected_keys.begin(), expected_keys.end());
+  check(sorted_keys == expected_keys, "parallel_sort (default order) differs from std::sort");
+}
+
+// floating point sums only depend on the block size, not on the number of threads
+void test_determinism(uint64_t n) {
+  std::vector< double > x(n);
+  for (auto & value : x) value = std::uniform_real_distribution< double >(-1.0, 1.0)(rng);
+
+  auto sum = [&](int threads) {
+    threadpool pool(threads);
+    return pool.parallel_reduce(n, 0.0, [&](uint64_t i) { return x[i]; }, [](double a, double b) { return a + b; });
+  };
+
+  double reference = sum(1);
+  for (int threads : {2, 3, 8}) {
+    test_case = describe("threads = ", threads, ", n = ", n);
+    check(sum(threads) == reference, "parallel_reduce of doubles depends on the number of threads");
+  }
+}
+
+// the algorithms called from inside a parallel_for body
+void test_nested(threadpool & pool) {
+  uint64_t outer = 16;
+  std::vector< std::vector< Item > > sorted(outer), expected(outer);
+  std::vector< int64_t > sums(outer);
+  for (uint64_t i = 0; i < outer; i++) {
+    expected[i] = random_items(5000 + 20000 * i);
+    sorted[i] = expected[i];
+  }
+
+  auto by_key = [](const Item & a, const Item & b) { return a.key < b.key; };
+  pool.parallel_for(outer, [&](uint64_t i) {
+    const std::vector< Item > & items = expected[i];
+    sums[i] = pool.parallel_reduce(items.size(), int64_t(0), [&](uint64_t j) { return int64_t(items[j].key); },
+                                   [](int64_t a, int64_t b) { return a + b; });
+    pool.parallel_sort(sorted[i], by_key);
+  });
+
+  for (uint64_t i = 0; i < outer; i++) {
+    int64_t sum = 0;
+    for (auto & item : expected[i]) sum += item.key;
+    std::stable_sort(expected[i].begin(), expected[i].end(), by_key);
+    test_case = describe("threads = ", pool.num_threads, ", n = ", expected[i].size(), ", nested");
+    check(sums[i] == sum, "nested parallel_reduce differs from a serial sum");
+    check(sorted[i] == expected[i], "nested parallel_sort differs from std::stable_sort");
+  }
+}
+
+// every iteration runs exactly once, for empty loops and loops smaller than a chunk as well
+void test_coverage(threadpool & pool, uint64_t n, uint64_t grain) {
+  test_case = describe("threads = ", pool.num_threads, ", n = ", n, ", grain ", grain);
+  std::vector< std::atomic< int > > visits(n);
+  for (auto & v : visits) v = 0;
+
+  std::atomic< bool > aligned(true);
+  pool.parallel_for_range(n, grain, [&](uint64_t begin, uint64_t end) {
+    if (begin % grain != 0 || end > n || (end - begin != grain && end != n)) aligned = false;
+    for (uint64_t i = begin; i < end; i++) visits[i]++;
+  });
+  check(aligned, "parallel_for_range chunk is misaligned");
+
+  bool once = std::all_of(visits.begin(), visits.end(), [](const std::atomic< int > & v) { return v == 1; });
+  check(once, "parallel_for_range doesn't visit every iteration once");
+}
+
+int main() {
+
+  for (int threads : {1, 3, 8}) {
+    threadpool pool(threads);
+
+    // empty, smaller than a block, exactly one block, and enough blocks for several merge passes
+    for (uint64_t n : {0, 1, 2, 100, 16383, 16384, 16385, 100000, 300001}) {
+      test_algorithms(pool, n);
+    }
+
+    for (uint64_t n : {0, 1, 7, 4096, 4097, 50000}) {
+      test_coverage(pool, n, 4096);
+    }
+
+    test_nested(pool);
+  }
+
+  test_determinism(1000000);
+
+  return finish("parallel_algorithms");
+
+}
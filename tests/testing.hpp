@@ -0,0 +1,43 @@
+#pragma once
+
+#include <random>
+#include <string>
+#include <sstream>
+#include <iostream>
+
+// Shared by the tests: check() prints an error for each failed check, together with the
+// case being tested, and finish() reports the results, as main's return value.
+
+inline int failures = 0;
+
+// the case currently being tested, printed with its failures, see describe()
+inline std::string test_case;
+
+// e.g. describe("n = ", n, ", trial ", trial)
+template < typename ... T >
+std::string describe(const T & ... parts) {
+  std::ostringstream out;
+  (out << ... << parts);
+  return out.str();
+}
+
+inline void check(bool ok, const char * what) {
+  if (!ok) {
+    std::cout << "error: " << what;
+    if (!test_case.empty()) std::cout << " (" << test_case << ")";
+    std::cout << std::endl;
+    failures++;
+  }
+}
+
+inline int finish(const char * name) {
+  if (failures == 0) std::cout << name << ": all tests passed" << std::endl;
+  return (failures == 0) ? 0 : 1;
+}
+
+// with a fixed seed, so that failures can be reproduced
+inline std::mt19937 rng(7);
+
+inline float uniform(float lo, float hi) {
+  return std::uniform_real_distribution< float >(lo, hi)(rng);
+}
@@ -0,0 +1,126 @@
+#include <cmath>
+#include <vector>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "culling.hpp"
+
+#include "testing.hpp"
+
+using namespace Graphics;
+
+glm::vec3 random_vector(float extent) {
+  return glm::vec3(uniform(-extent, extent), uniform(-extent, extent), uniform(-extent, extent));
+}
+
+// a camera somewhere around the lattice, looking at a random point in it
+Frustum random_camera(const Lattice & lattice) {
+  glm::vec3 size = float(lattice.counts.x) * lattice.basis[0] + float(lattice.counts.y) * lattice.basis[1] +
+                   float(lattice.counts.z) * lattice.basis[2];
+  glm::vec3 target = uniform(0.0f, 1.0f) * size + random_vector(2.0f);
+  glm::vec3 eye = target + random_vector(30.0f);
+  glm::mat4 view = glm::lookAt(eye, target, glm::vec3(0.0f, 0.0f, 1.0f));
+  glm::mat4 proj = glm::perspective(uniform(0.3f, 1.5f), uniform(0.5f, 2.0f), 0.1f, uniform(5.0f, 100.0f));
+  return Frustum(proj * view);
+}
+
+// planes that don't come from a projection, and may not bound anything at all
+Frustum random_planes() {
+  Frustum frustum(glm::mat4(1.0f));
+  for (auto & plane : frustum.planes) {
+    glm::vec3 normal = glm::normalize(random_vector(1.0f) + glm::vec3(0.01f));
+    plane = glm::vec4(normal, uniform(-20.0f, 20.0f));
+  }
+  return frustum;
+}
+
+// Every cell where the image of the bounds is in the frustum must be in exactly one block, and
+// the blocks must stay inside the lattice. visible_cells works in double precision, so cells
+// within a rounding error of a plane may go either way, but it shouldn't add any others.
+void test_lattice(int trial, const Frustum & frustum, const Lattice & lattice, const Sphere & bounds) {
+  test_case = describe("trial ", trial);
+  std::vector< CellBlock > blocks = visible_cells(frustum, lattice, bounds);
+
+  glm::uvec3 n = lattice.counts;
+  std::vector< int > visits(lattice.num_cells(), 0);
+  bool inside = true;
+  for (auto & block : blocks) {
+    glm::uvec3 last = block.first + block.span;
+    if (last.x > n.x || last.y > n.y || last.z > n.z) {
+      inside = false;
+      continue;
+    }
+    for (uint32_t k = block.first.z; k < last.z; k++) {
+      for (uint32_t j = block.first.y; j < last.y; j++) {
+        for (uint32_t i = block.first.x; i < last.x; i++) {
+          visits[i + n.x * (j + n.y * k)]++;
+        }
+      }
+    }
+  }
+  check(inside, "block extends past the lattice");
+
+  bool missing = false, extra = false, repeated = false;
+  float slack = 1.0e-3f;
+  for (uint32_t k = 0; k < n.z; k++) {
+    for (uint32_t j = 0; j < n.y; j++) {
+      for (uint32_t i = 0; i < n.x; i++) {
+        glm::vec3 center = bounds.center + float(i) * lattice.basis[0] + float(j) * lattice.basis[1] +
+                           float(k) * lattice.basis[2];
+        int v = visits[i + n.x * (j + n.y * k)];
+        repeated |= v > 1;
+        missing |= v == 0 && frustum.intersects(center, bounds.radius - slack);
+        extra |= v > 0 && !frustum.intersects(center, bounds.radius + slack);
+      }
+    }
+  }
+  check(!repeated, "cell is in more than one block");
+  check(!missing, "visible cell is missing from the blocks");
+  check(!extra, "cell outside of the frustum is in a block");
+}
+
+Lattice random_lattice(int trial) {
+  Lattice lattice;
+  for (auto & b : lattice.basis) b = random_vector(3.0f);
+  lattice.counts = glm::uvec3(1 + rng() % 12, 1 + rng() % 12, 1 + rng() % 12);
+
+  // orthogonal cells, which put many planes parallel to rows, and a degenerate basis vector
+  if (trial % 5 == 0) {
+    lattice.basis[0] = glm::vec3(2.0f, 0.0f, 0.0f);
+    lattice.basis[1] = glm::vec3(0.0f, 2.0f, 0.0f);
+    lattice.basis[2] = glm::vec3(0.0f, 0.0f, 2.0f);
+  }
+  if (trial % 11 == 0) lattice.basis[0] = glm::vec3(0.0f);
+  return lattice;
+}
+
+int main() {
+
+  for (int trial = 0; trial < 2000; trial++) {
+    Lattice lattice = random_lattice(trial);
+    Sphere bounds{random_vector(1.0f), uniform(0.0f, 2.0f)};
+    Frustum frustum = (trial % 2 == 0) ? random_camera(lattice) : random_planes();
+    test_lattice(trial, frustum, lattice, bounds);
+  }
+
+  test_case.clear();
+
+  // a lattice that's entirely in view is a single block
+  Frustum everything(glm::mat4(1.0f));
+  for (auto & plane : everything.planes) plane = glm::vec4(1.0f, 0.0f, 0.0f, 1000.0f);
+  Lattice cubic{{glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f)}, glm::uvec3(50)};
+  check(visible_cells(everything, cubic, Sphere{glm::vec3(0.0f), 1.0f}).size() == 1,
+        "lattice in view isn't a single block");
+
+  // and one that's entirely out of view has none
+  Frustum nothing(glm::mat4(1.0f));
+  for (auto & plane : nothing.planes) plane = glm::vec4(1.0f, 0.0f, 0.0f, -1000.0f);
+  check(visible_cells(nothing, cubic, Sphere{glm::vec3(0.0f), 1.0f}).empty(), "lattice out of view has blocks");
+
+  Lattice empty = cubic;
+  empty.counts.y = 0;
+  check(visible_cells(everything, empty, Sphere{glm::vec3(0.0f), 1.0f}).empty(), "empty lattice has blocks");
+
+  return finish("visible_cells");
+
+}